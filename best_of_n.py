@@ -2,12 +2,21 @@ import streamlit as st
 import os
 import re
 import json
+import hashlib
+import hmac
+import secrets
+import threading
+import time
+import uuid
 import datetime
 import xml.dom.minidom as md
 import xml.etree.ElementTree as ET
-from typing import Dict, List, Any, Tuple, Optional, Union
+from concurrent.futures import ThreadPoolExecutor, wait, FIRST_COMPLETED
+from typing import Dict, List, Any, Tuple, Optional, Union, Callable
 import anthropic
 from pathlib import Path
+from tpt_iterative import ApiGovernor, get_api_governor, estimate_tokens, key_fingerprint as api_key_fingerprint, \
+    SessionIndex, get_session_index, index_entry, rotate_log, session_bytes, session_offsets, write_session_at
 
 def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
     """
@@ -21,8 +30,8 @@ def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
         A dictionary mapping variable names to their values or special handlers
     """
     variables = {}
-    # Match variable definitions using regex
-    pattern = r'([a-zA-Z_][a-zA-Z0-9_]*)\s*=\s*([^,]+)(?:,|$)'
+    # Match variable definitions using regex; $$type(...) and quoted values may contain commas
+    pattern = r'([a-zA-Z_][a-zA-Z0-9_]*)\s*=\s*(\$\$[a-z_]+\((?:[^()]|\([^()]*\))*\)|"[^"]*"|\'[^\']*\'|[^,]+)\s*(?:,|$)'
     matches = re.finditer(pattern, var_definitions)
     
     for match in matches:
@@ -65,13 +74,19 @@ def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
                 variables[var_name] = {'type': 'list', 'elements': list_elements}
                 
             elif var_value.startswith('$$results(') and var_value.endswith(')'):
-                # Extract results variable name
-                results_var_name = var_value[10:-1].strip()
-                variables[var_name] = {'type': 'results', 'var_name': results_var_name}
-                
+                # Extract results variable name and the optional pipeline stage
+                results_args = [arg.strip() for arg in var_value[10:-1].split(',')]
+                variables[var_name] = {'type': 'results', 'var_name': results_args[0]}
+                for arg in results_args[1:]:
+                    if arg.startswith('stage='):
+                        variables[var_name]['stage'] = arg[6:].strip().strip('"\'')
+            
             elif var_value.startswith('$$initial_prompt(') and var_value.endswith(')'):
-                # Special variable type for the initial prompt
+                # Special variable type for the initial prompt (of a pipeline stage, if given)
                 variables[var_name] = {'type': 'initial_prompt'}
+                stage_arg = var_value[17:-1].strip()
+                if stage_arg.startswith('stage='):
+                    variables[var_name]['stage'] = stage_arg[6:].strip().strip('"\'')
         else:
             # Handle regular variable definitions (strip quotes if present)
             if (var_value.startswith('"') and var_value.endswith('"')) or \
@@ -196,54 +211,59 @@ def render_template(template: str, variables: Dict[str, str]) -> str:
     
     return result
 
-def process_special_variables(template: str, variables: Dict[str, Any], initial_prompt: str, outputs: List[str]) -> str:
+def format_results(xml_var_name: str, outputs: List[str]) -> str:
     """
-    Process special variables in the template, like results and initial_prompt.
+    Wrap outputs in numbered XML tags, e.g. <Output1>...</Output1>.
     
     Args:
-        template: The template string with variables
-        variables: Dictionary of variable definitions
-        initial_prompt: The rendered initial prompt
-        outputs: List of LLM outputs from the first prompt
+        xml_var_name: Base name of the XML tags
+        outputs: The outputs
     
     Returns:
-        Template with special variables replaced
+        The tagged outputs, one after another
     """
-    result = template
-    
-    for var_name, var_value in variables.items():
-        if isinstance(var_value, dict):
-            if var_value.get('type') == 'results':
-                # Extract the variable name to use in XML tags
-                xml_var_name = var_value.get('var_name')
-                
-                # Build the XML string for all outputs
-                xml_outputs = ""
-                for i, output in enumerate(outputs, 1):
-                    xml_outputs += f"<{xml_var_name}{i}>\n{output}\n</{xml_var_name}{i}>\n"
-                
-                # Replace the placeholder with the XML string
-                placeholder = "{{" + var_name + "}}"
-                result = result.replace(placeholder, xml_outputs)
-            
-            elif var_value.get('type') == 'initial_prompt':
-                # Replace the initial_prompt placeholder
-                placeholder = "{{" + var_name + "}}"
-                result = result.replace(placeholder, initial_prompt)
-    
-    return result
+    xml_outputs = ""
+    for i, output in enumerate(outputs, 1):
+        xml_outputs += f"<{xml_var_name}{i}>\n{output}\n</{xml_var_name}{i}>\n"
+    return xml_outputs
 
-def call_llm(prompt: str, llm_params: Dict[str, Any]) -> str:
+def call_llm(prompt: str, llm_params: Dict[str, Any], governor: Optional[ApiGovernor] = None,
+             client_id: Optional[str] = None) -> str:
     """
     Call the LLM with the given prompt and parameters.
     
     Args:
         prompt: The prompt to send to the LLM
         llm_params: Dictionary of LLM parameters (temperature, etc.)
+        governor: Process-wide ApiGovernor of the API key (shared with the other tools), or None
+        client_id: Client ID of this session with the governor
     
     Returns:
         The LLM's response
     """
+    if governor is None:
+        return call_llm_ungoverned(prompt, llm_params)
+    governor.acquire(client_id, estimate_tokens(prompt))
+    output = ""
+    try:
+        output = call_llm_ungoverned(prompt, llm_params)
+        return output
+    finally:
+        governor.release(client_id, len(output) // 4)
+
+def timed_call_llm(prompt: str, llm_params: Dict[str, Any], governor: Optional[ApiGovernor] = None,
+                   client_id: Optional[str] = None) -> Tuple[str, float]:
+    """
+    Call the LLM like call_llm(), also returning the latency in seconds (including any wait for the governor).
+    """
+    start = time.perf_counter()
+    output = call_llm(prompt, llm_params, governor, client_id)
+    return output, round(time.perf_counter() - start, 3)
+
+def call_llm_ungoverned(prompt: str, llm_params: Dict[str, Any]) -> str:
+    """
+    Make one LLM call, returning the response text or an error message.
+    """
     try:
         client = anthropic.Anthropic(api_key=llm_params.get("api_key", ""))
         
@@ -262,44 +282,250 @@ def call_llm(prompt: str, llm_params: Dict[str, Any]) -> str:
     except Exception as e:
         return f"Error calling LLM: {str(e)}"
 
-def batch_call_llm(prompt: str, llm_params: Dict[str, Any], num_runs: int) -> List[str]:
+# Stage settings that override the LLM parameters from the sidebar
+STAGE_PARAMS = ("model", "temperature", "max_tokens", "top_p", "system_prompt")
+
+def make_stage(name: str, template: str, definitions: str, runs: int = 1, previous: Optional[str] = None,
+               first: Optional[str] = None, **settings) -> Dict[str, Any]:
     """
-    Make batch calls to the LLM with the same prompt multiple times.
+    Describe one stage of a prompt pipeline.
+    
+    $$results() without a stage refers to the previous stage, and
+    $$initial_prompt() without a stage to the first one.
     
     Args:
-        prompt: The prompt to send to the LLM
-        llm_params: Dictionary of LLM parameters (temperature, etc.)
-        num_runs: Number of times to run the same prompt
+        name: Stage name, referenced by later stages
+        template: The stage's prompt template
+        definitions: The stage's variable definitions
+        runs: Number of calls per prompt (fan-out)
+        previous: Name of the stage defined before this one, or None
+        first: Name of the first stage, or None if this is the first
+        **settings: "for_each" (a stage whose outputs each get their own prompt, as
+                    {{item}} and {{item_index}}) and overrides of STAGE_PARAMS
+    
+    Returns:
+        Stage dictionary with parsed variables and the names of the stages it depends on
+    
+    Raises:
+        ValueError: If a default stage reference has no stage to refer to
+    """
+    variables = parse_variable_definitions(definitions)
+    for var_name, var_def in variables.items():
+        if isinstance(var_def, dict) and var_def["type"] in ("results", "initial_prompt") and not var_def.get("stage"):
+            var_def["stage"] = previous if var_def["type"] == "results" else first
+            if var_def["stage"] is None:
+                raise ValueError(f"Stage {name}: {var_name} needs stage=... (there is no earlier stage)")
+    depends_on = {var_def["stage"] for var_def in variables.values()
+                  if isinstance(var_def, dict) and var_def.get("stage")}
+    if settings.get("for_each"):
+        depends_on.add(settings["for_each"])
+    runs = int(runs)
+    if runs < 1:
+        raise ValueError(f"Stage {name}: runs must be at least 1")
+    return dict(settings, name=name, template=template, definitions=definitions, variables=variables,
+                runs=runs, depends_on=depends_on)
+
+def parse_pipeline(spec: str) -> List[Dict[str, Any]]:
+    """
+    Parse a pipeline definition: a JSON list of stages.
+    
+    Each stage has a "name", a "template", optional "variables" (definitions
+    as for the initial prompt, plus $$results(tag, stage=name) and
+    $$initial_prompt(stage=name)), "runs", "for_each" and overrides of the
+    model and other LLM parameters.
+    
+    Args:
+        spec: The JSON definition
     
     Returns:
-        List of LLM responses
+        List of stages from make_stage(), in definition order
+    
+    Raises:
+        ValueError: If the definition is invalid, refers to unknown stages or has a cycle
     """
     try:
-        client = anthropic.Anthropic(api_key=llm_params.get("api_key", ""))
-        
-        # Create batch of identical messages
-        batch_messages = []
-        for _ in range(num_runs):
-            batch_messages.append({
-                "model": llm_params.get("model", "claude-3-7-sonnet-latest"),
-                "max_tokens": llm_params.get("max_tokens", 1024),
-                "temperature": llm_params.get("temperature", 0.7),
-                "top_p": llm_params.get("top_p", 1.0),
-                "system": llm_params.get("system_prompt", ""),
-                "messages": [
-                    {"role": "user", "content": prompt}
-                ]
-            })
-        
-        # Submit batch request
-        batch_results = []
-        for message_params in batch_messages:
-            message = client.messages.create(**message_params)
-            batch_results.append(message.content[0].text)
-        
-        return batch_results
-    except Exception as e:
-        return [f"Error calling LLM: {str(e)}"] * num_runs
+        raw_stages = json.loads(spec)
+    except json.JSONDecodeError as e:
+        raise ValueError(f"The pipeline is not valid JSON: {e}")
+    if not isinstance(raw_stages, list) or not raw_stages:
+        raise ValueError("The pipeline must be a non-empty JSON list of stages")
+    
+    stages = []
+    for position, raw_stage in enumerate(raw_stages, 1):
+        if not isinstance(raw_stage, dict) or not raw_stage.get("name") or not raw_stage.get("template"):
+            raise ValueError(f"Stage {position} needs a name and a template")
+        settings = {key: value for key, value in raw_stage.items()
+                    if key == "for_each" or key in STAGE_PARAMS}
+        stages.append(make_stage(str(raw_stage["name"]), raw_stage["template"], raw_stage.get("variables", ""),
+                                 raw_stage.get("runs", 1), stages[-1]["name"] if stages else None,
+                                 stages[0]["name"] if stages else None, **settings))
+    
+    names = [stage["name"] for stage in stages]
+    if len(set(names)) != len(names):
+        raise ValueError("Stage names must be unique")
+    for stage in stages:
+        unknown = stage["depends_on"] - set(names)
+        if unknown:
+            raise ValueError(f"Stage {stage['name']} refers to unknown stage(s): {', '.join(sorted(unknown))}")
+    
+    # Every stage must be reachable once its dependencies have run
+    done = set()
+    while len(done) < len(stages):
+        ready = [stage["name"] for stage in stages if stage["name"] not in done and stage["depends_on"] <= done]
+        if not ready:
+            raise ValueError("The stages depend on each other in a cycle: "
+                             + ", ".join(name for name in names if name not in done))
+        done.update(ready)
+    return stages
+
+def render_stage(stage: Dict[str, Any], results: Dict[str, Dict[str, Any]]) -> List[str]:
+    """
+    Render the prompts of a stage from its variables and the results of earlier stages.
+    
+    Args:
+        stage: Stage from make_stage()
+        results: Results of the completed stages, by name
+    
+    Returns:
+        One prompt per call: each rendered prompt repeated "runs" times
+    """
+    combo = expand_variables(stage["variables"])[0]
+    
+    # Text from earlier stages is substituted last, so it is never treated as a placeholder
+    substitutions = {}
+    for var_name, var_def in stage["variables"].items():
+        if isinstance(var_def, dict) and var_def["type"] == "results":
+            substitutions[var_name] = format_results(var_def["var_name"], results[var_def["stage"]]["outputs"])
+        elif isinstance(var_def, dict) and var_def["type"] == "initial_prompt":
+            substitutions[var_name] = results[var_def["stage"]]["prompts"][0]
+    
+    items = results[stage["for_each"]]["outputs"] if stage.get("for_each") else [None]
+    prompts = []
+    for item_index, item in enumerate(items, 1):
+        values = dict(combo)
+        item_substitutions = dict(substitutions)
+        if item is not None:
+            item_substitutions["item"] = item
+            values["item_index"] = str(item_index)
+        for var_name in item_substitutions:
+            values[var_name] = f"\x00{var_name}\x00"
+        prompt = render_template(stage["template"], values)
+        for var_name, text in item_substitutions.items():
+            prompt = prompt.replace(f"\x00{var_name}\x00", text)
+        prompts.extend([prompt] * stage["runs"])
+    return prompts
+
+def stage_cache_key(prompts: List[str], llm_params: Dict[str, Any]) -> str:
+    """
+    Hash the inputs of a stage: its prompts and the parameters that affect the outputs.
+    """
+    request = {name: llm_params.get(name) for name in STAGE_PARAMS}
+    request["prompts"] = prompts
+    return hashlib.sha256(json.dumps(request, sort_keys=True).encode("utf-8")).hexdigest()
+
+def load_cached_stage(cache_dir: str, key: str) -> Optional[List[str]]:
+    """
+    Return the cached outputs of a stage with the given input hash, or None.
+    """
+    try:
+        with open(os.path.join(cache_dir, f"{key}.json"), "r", encoding="utf-8") as f:
+            return json.load(f)["outputs"]
+    except (OSError, ValueError, KeyError):
+        return None
+
+def save_cached_stage(cache_dir: str, key: str, stage_name: str, outputs: List[str]):
+    """
+    Cache the outputs of a stage under its input hash, replacing the file atomically.
+    """
+    os.makedirs(cache_dir, exist_ok=True)
+    path = os.path.join(cache_dir, f"{key}.json")
+    with open(path + ".tmp", "w", encoding="utf-8") as f:
+        json.dump({"stage": stage_name, "created": datetime.datetime.now().isoformat(timespec="seconds"),
+                   "outputs": outputs}, f)
+    os.replace(path + ".tmp", path)
+
+def run_pipeline(stages: List[Dict[str, Any]], llm_params: Dict[str, Any], cache_dir: Optional[str],
+                 max_workers: int, on_stage_done=None, governor: Optional[ApiGovernor] = None,
+                 client_id: Optional[str] = None) -> Dict[str, Dict[str, Any]]:
+    """
+    Run the stages of a pipeline, each as soon as the stages it depends on are done.
+    
+    The calls of all running stages share a thread pool, so independent
+    branches and the runs of a stage proceed in parallel. A stage whose
+    input hash (rendered prompts and LLM parameters) is in the cache reuses
+    the cached outputs instead of calling the LLM; stages without errors are
+    added to the cache.
+    
+    Args:
+        stages: Stages from parse_pipeline() or make_stage()
+        llm_params: Dictionary of LLM parameters, overridden per stage
+        cache_dir: Directory of the stage cache, or None to disable caching
+        max_workers: Maximum number of LLM calls in flight
+        on_stage_done: Optional callback(stage, result) run on the calling thread as each stage completes
+        governor: Process-wide ApiGovernor of the API key, or None
+        client_id: Client ID of this session with the governor
+
+    Returns:
+        Results by stage name, each with "prompts", "outputs", "latencies"
+        (None for cached outputs), "model", "cached" and "seconds"
+    """
+    results = {}
+    remaining = list(stages)
+    # stage name -> state of a running stage
+    running = {}
+    # future -> (stage name, call index)
+    calls = {}
+    
+    def finish(stage: Dict[str, Any], result: Dict[str, Any]):
+        results[stage["name"]] = result
+        if on_stage_done is not None:
+            on_stage_done(stage, result)
+    
+    with ThreadPoolExecutor(max_workers=max(int(max_workers), 1), thread_name_prefix="pvt-stage") as executor:
+        while remaining or calls:
+            # Start every stage whose inputs are ready; cache hits may make more stages ready
+            started = True
+            while started:
+                started = False
+                for stage in list(remaining):
+                    if not stage["depends_on"] <= results.keys():
+                        continue
+                    remaining.remove(stage)
+                    started = True
+                    stage_params = dict(llm_params, **{name: stage[name] for name in STAGE_PARAMS if name in stage})
+                    prompts = render_stage(stage, results)
+                    key = stage_cache_key(prompts, stage_params)
+                    cached = load_cached_stage(cache_dir, key) if cache_dir else None
+                    if cached is not None and len(cached) == len(prompts):
+                        finish(stage, {"prompts": prompts, "outputs": cached, "latencies": [None] * len(prompts),
+                                       "model": stage_params.get("model"), "cached": True, "seconds": 0.0})
+                        continue
+                    running[stage["name"]] = {"stage": stage, "prompts": prompts, "outputs": [None] * len(prompts),
+                                              "latencies": [None] * len(prompts), "left": len(prompts), "key": key, "model": stage_params.get("model"),
+                                              "start": time.perf_counter()}
+                    for index, prompt in enumerate(prompts):
+                        calls[executor.submit(timed_call_llm, prompt, stage_params, governor, client_id)] = (stage["name"], index)
+            
+            if not calls:
+                continue
+            done, _ = wait(calls, return_when=FIRST_COMPLETED)
+            for future in done:
+                name, index = calls.pop(future)
+                state = running[name]
+                state["outputs"][index], state["latencies"][index] = future.result()
+                state["left"] -= 1
+                if state["left"]:
+                    continue
+                del running[name]
+                if cache_dir and not any(output.startswith("Error calling LLM") for output in state["outputs"]):
+                    try:
+                        save_cached_stage(cache_dir, state["key"], name, state["outputs"])
+                    except OSError as e:
+                        st.warning(f"Could not cache stage {name}: {e}")
+                finish(state["stage"], {"prompts": state["prompts"], "outputs": state["outputs"],
+                                        "latencies": state["latencies"], "model": state["model"], "cached": False,
+                                        "seconds": round(time.perf_counter() - state["start"], 3)})
+    return results
 
 def get_log_filename(base_path: str, append_datetime: bool) -> str:
     """
@@ -310,8 +536,9 @@ def get_log_filename(base_path: str, append_datetime: bool) -> str:
         append_datetime: Whether to append the current datetime to the filename
         
     Returns:
-        The final log file path
+        The final log file path, with "~" expanded
     """
+    base_path = os.path.expanduser(base_path)
     if not append_datetime:
         return base_path
         
@@ -331,34 +558,14 @@ def get_log_filename(base_path: str, append_datetime: bool) -> str:
     # Combine directory and new filename
     return os.path.join(directory, new_filename)
 
-def log_session(log_file: str, session_data: Dict[str, Any]):
+def add_best_of_n_elements(session: ET.Element, session_data: Dict[str, Any]):
     """
-    Log the session data to an XML file.
+    Add the initial prompt runs and the evaluation of a Best of N session to its log element.
     
     Args:
-        log_file: Path to the log file
+        session: The <session> element
         session_data: Dictionary containing session information
     """
-    # Create root element for the session
-    timestamp = datetime.datetime.now().strftime("%d%b%Y - %H:%M:%S")
-    
-    # Check if the file exists
-    try:
-        if os.path.exists(log_file):
-            # Parse existing file
-            tree = ET.parse(log_file)
-            root = tree.getroot()
-        else:
-            # Create new root element
-            root = ET.Element("sessions")
-    except Exception as e:
-        st.warning(f"Error opening log file: {e}. Creating new log.")
-        root = ET.Element("sessions")
-    
-    # Create session element
-    session = ET.SubElement(root, "session")
-    session.set("datetime", timestamp)
-    
     # Add initial prompt section
     initial_section = ET.SubElement(session, "initial_prompt")
     initial_section.set("num_runs", str(session_data["num_runs"]))
@@ -399,6 +606,10 @@ def log_session(log_file: str, session_data: Dict[str, Any]):
         # Add output
         output_elem = ET.SubElement(run_elem, "output")
         output_elem.text = run_data["output"]
+        
+        # Add latency (not known for runs made through a Message Batch)
+        if run_data.get("latency") is not None:
+            ET.SubElement(run_elem, "latency").text = str(run_data["latency"])
     
     # Add evaluation section
     eval_section = ET.SubElement(session, "evaluation")
@@ -425,17 +636,548 @@ def log_session(log_file: str, session_data: Dict[str, Any]):
     # Add final output
     eval_output_elem = ET.SubElement(eval_section, "output")
     eval_output_elem.text = session_data["eval_output"]
+    if session_data.get("eval_latency") is not None:
+        ET.SubElement(eval_section, "latency").text = str(session_data["eval_latency"])
+
+def add_pipeline_elements(session: ET.Element, session_data: Dict[str, Any]):
+    """
+    Add the stages of a pipeline session, with every call, to its log element.
     
-    # Write to file with pretty formatting
-    tree = ET.ElementTree(root)
-    xml_str = ET.tostring(root, encoding='utf-8')
-    pretty_xml = md.parseString(xml_str).toprettyxml(indent="  ")
+    Args:
+        session: The <session> element
+        session_data: Dictionary containing session information, with "stages"
+    """
+    pipeline_elem = ET.SubElement(session, "pipeline")
+    params_elem = ET.SubElement(pipeline_elem, "llm_parameters")
+    for param_name, param_value in session_data["llm_params"].items():
+        if param_name != "api_key":  # Skip API key for security
+            param = ET.SubElement(params_elem, param_name)
+            param.text = str(param_value)
+    
+    for stage in session_data["stages"]:
+        stage_elem = ET.SubElement(pipeline_elem, "stage")
+        stage_elem.set("name", stage["name"])
+        stage_elem.set("model", str(stage["model"]))
+        stage_elem.set("runs", str(stage["runs"]))
+        stage_elem.set("cached", "true" if stage["cached"] else "false")
+        stage_elem.set("seconds", str(stage["seconds"]))
+        if stage["depends_on"]:
+            stage_elem.set("depends_on", ",".join(sorted(stage["depends_on"])))
+        ET.SubElement(stage_elem, "prompt_template").text = stage["template"]
+        ET.SubElement(stage_elem, "variables").text = stage["definitions"]
+        for i, (prompt, output, latency) in enumerate(zip(stage["prompts"], stage["outputs"], stage["latencies"])):
+            call_elem = ET.SubElement(stage_elem, f"call{i+1}")
+            ET.SubElement(call_elem, "rendered_prompt").text = prompt
+            ET.SubElement(call_elem, "output").text = output
+            if latency is not None:
+                ET.SubElement(call_elem, "latency").text = str(latency)
+
+def log_session(log_file: str, session_data: Dict[str, Any], warn: Callable[[str], Any] = st.warning):
+    """
+    Log the session data to an XML file.
+    
+    The session is written in place before the closing </sessions> tag (see
+    write_session_at() in tpt_iterative), so logging does not get slower as
+    the file grows; only a file not in that format is parsed and rewritten.
+    With a "log_policy" (see rotate_log() in tpt_iterative), the file is
+    rotated and old logs are deleted first, and the session is recorded in
+    the session index shared with the Templated Prompt Tester.
+    
+    Args:
+        log_file: Path to the log file
+        session_data: Dictionary containing session information
+        warn: Reports a problem with the existing log; st.warning by default,
+              callers off the script thread pass their own
+    """
+    policy = session_data.get("log_policy") or {}
+    index = get_session_index(policy["index_file"]) if policy.get("index_file") else None
+    session_data = dict(session_data, session_id=session_data.get("session_id") or uuid.uuid4().hex[:12])
     
     # Create directory if it doesn't exist
     os.makedirs(os.path.dirname(log_file), exist_ok=True)
+    if policy:
+        rotate_log(log_file, policy, index)
     
-    with open(log_file, "w", encoding="utf-8") as f:
+    session = session_element(session_data)
+    data = session_bytes(session)
+    try:
+        offset = write_session_at(log_file, data)
+    except ValueError:
+        offset = None
+    if offset is None:
+        rewrite_log(log_file, session, session_data, index, warn)
+    elif index is not None:
+        index.record([log_index_entry(log_file, session, session_data, offset, len(data))])
+
+def session_element(session_data: Dict[str, Any]) -> ET.Element:
+    """
+    Build the <session> element of a Best of N or pipeline session.
+    """
+    session = ET.Element("session")
+    session.set("datetime", datetime.datetime.now().strftime("%d%b%Y - %H:%M:%S"))
+    session.set("id", session_data["session_id"])
+    if session_data.get("batch_id"):
+        session.set("batch_id", session_data["batch_id"])
+    if session_data.get("cached_stages"):
+        # Stages whose outputs were reused from the stage cache rather than generated in this session
+        session.set("cached_stages", ",".join(session_data["cached_stages"]))
+
+    if session_data.get("stages"):
+        add_pipeline_elements(session, session_data)
+    else:
+        add_best_of_n_elements(session, session_data)
+    return session
+
+def log_index_entry(log_file: str, session: ET.Element, session_data: Dict[str, Any],
+                    offset: int, length: int) -> Dict[str, Any]:
+    """
+    Describe a logged session for the session index, counting runs (or pipeline stages) as its inputs.
+    """
+    entry = index_entry(log_file, session, session_data, offset, length)
+    entry["inputs"] = len(session_data.get("runs") or session_data.get("stages") or [])
+    return entry
+
+def rewrite_log(log_file: str, session: ET.Element, session_data: Dict[str, Any],
+                index: Optional[SessionIndex], warn: Callable[[str], Any]):
+    """
+    Append a session by parsing and rewriting the whole log file.
+    
+    Used for a file that does not end with </sessions>, such as one written
+    before sessions were appended in place; the rewritten file is in the
+    format later sessions are appended to.
+    """
+    # Check if the file exists
+    try:
+        if os.path.exists(log_file):
+            # Parse existing file
+            root = ET.parse(log_file).getroot()
+        else:
+            # Create new root element
+            root = ET.Element("sessions")
+    except Exception as e:
+        warn(f"Error opening log file: {e}. Creating new log.")
+        root = ET.Element("sessions")
+    
+    # Drop the indentation whitespace of the parsed file so it is not doubled when re-indented
+    for elem in root.iter():
+        if elem.text is not None and not elem.text.strip():
+            elem.text = None
+        if elem.tail is not None and not elem.tail.strip():
+            elem.tail = None
+    root.append(session)
+    
+    # Write to file with pretty formatting
+    xml_str = ET.tostring(root, encoding='utf-8')
+    pretty_xml = md.parseString(xml_str).toprettyxml(indent="  ").encode("utf-8")
+    with open(log_file, "wb") as f:
         f.write(pretty_xml)
+    
+    # Sessions already in the index may have moved
+    if index is not None:
+        offsets = session_offsets(pretty_xml)
+        entries = [dict(entry, offset=offsets[entry["session_id"]][0], length=offsets[entry["session_id"]][1])
+                   for entry in index.sessions(log_file) if entry["session_id"] in offsets]
+        if session_data["session_id"] in offsets:
+            entries.append(log_index_entry(log_file, session, session_data, *offsets[session_data["session_id"]]))
+        index.record(entries)
+
+# Batch job files are kept until the batch is merged into the log; these statuses are final
+FINAL_JOB_STATUSES = ("merged", "failed")
+
+def key_fingerprint(api_key: str, salt: str) -> str:
+    """
+    Identify an API key without storing it.
+    
+    An HMAC keyed with a random per-job salt, so job files cannot be matched
+    against each other or against a precomputed table of key hashes.
+    """
+    return hmac.new(salt.encode("utf-8"), api_key.encode("utf-8"), hashlib.sha256).hexdigest()
+
+def new_key_fingerprint(api_key: str) -> Dict[str, str]:
+    """
+    Return the job fields that identify the API key of a new job.
+    """
+    salt = secrets.token_hex(16)
+    return {"key_salt": salt, "key_fingerprint": key_fingerprint(api_key, salt)}
+
+def save_job(job_dir: str, job: Dict[str, Any]):
+    """
+    Write a batch job file, replacing it atomically so a restart never sees a partial file.
+    
+    Args:
+        job_dir: Directory holding the job files
+        job: Job dictionary (never contains the API key)
+    """
+    os.makedirs(job_dir, exist_ok=True)
+    job["updated"] = datetime.datetime.now().isoformat(timespec="seconds")
+    path = os.path.join(job_dir, f"{job['batch_id']}.json")
+    with open(path + ".tmp", "w", encoding="utf-8") as f:
+        json.dump(job, f, indent=2)
+    os.replace(path + ".tmp", path)
+
+def load_jobs(job_dir: str) -> List[Dict[str, Any]]:
+    """
+    Load all batch job files, newest first.
+    
+    Args:
+        job_dir: Directory holding the job files
+    
+    Returns:
+        List of job dictionaries
+    """
+    jobs = []
+    if not os.path.isdir(job_dir):
+        return jobs
+    for name in os.listdir(job_dir):
+        if not name.endswith(".json"):
+            continue
+        try:
+            with open(os.path.join(job_dir, name), "r", encoding="utf-8") as f:
+                jobs.append(json.load(f))
+        except (OSError, json.JSONDecodeError):
+            continue
+    jobs.sort(key=lambda job: job.get("created", ""), reverse=True)
+    return jobs
+
+def submit_batch(prompt: str, llm_params: Dict[str, Any], num_runs: int) -> Tuple[str, Dict[str, int]]:
+    """
+    Submit the N runs of a prompt as one Message Batch.
+    
+    Args:
+        prompt: The rendered prompt
+        llm_params: Dictionary of LLM parameters (temperature, etc.)
+        num_runs: Number of times to run the prompt
+    
+    Returns:
+        Tuple of the batch ID and the mapping of request custom IDs to run indexes
+    """
+    client = anthropic.Anthropic(api_key=llm_params.get("api_key", ""))
+    requests = []
+    run_map = {}
+    for i in range(num_runs):
+        custom_id = f"run-{i + 1}"
+        run_map[custom_id] = i
+        requests.append({
+            "custom_id": custom_id,
+            "params": {
+                "model": llm_params.get("model", "claude-3-7-sonnet-latest"),
+                "max_tokens": llm_params.get("max_tokens", 1024),
+                "temperature": llm_params.get("temperature", 0.7),
+                "top_p": llm_params.get("top_p", 1.0),
+                "system": llm_params.get("system_prompt", ""),
+                "messages": [
+                    {"role": "user", "content": prompt}
+                ]
+            }
+        })
+    batch = client.messages.batches.create(requests=requests)
+    return batch.id, run_map
+
+def fetch_batch_outputs(client: anthropic.Anthropic, job: Dict[str, Any]) -> List[str]:
+    """
+    Collect the outputs of an ended batch in run order.
+    
+    Args:
+        client: Anthropic client
+        job: Job dictionary with batch_id, run_map and num_runs
+    
+    Returns:
+        List of outputs; requests that did not succeed get an error message
+    """
+    outputs = ["Error calling LLM: no result returned for this run"] * job["num_runs"]
+    for response in client.messages.batches.results(job["batch_id"]):
+        index = job["run_map"].get(response.custom_id)
+        if index is None:
+            continue
+        result = response.result
+        if result.type == "succeeded":
+            outputs[index] = result.message.content[0].text
+        elif result.type == "errored":
+            outputs[index] = f"Error calling LLM: {result.error}"
+        else:
+            outputs[index] = f"Error calling LLM: batch request {result.type}"
+    return outputs
+
+def merge_batch_job(job: Dict[str, Any], api_key: str, governor: Optional[ApiGovernor] = None):
+    """
+    Run the evaluation prompt on the outputs of an ended batch and log the session.
+    
+    Args:
+        job: Job dictionary, updated in place
+        api_key: API key the batch was submitted with
+        governor: Process-wide ApiGovernor of the key, or None
+    """
+    client = anthropic.Anthropic(api_key=api_key)
+    outputs = fetch_batch_outputs(client, job)
+    llm_params = dict(job["llm_params"], api_key=api_key)
+    
+    # Rendered as the evaluation stage of the interactive path, with the batch as its "initial" stage
+    evaluation = make_stage("evaluation", job["eval_prompt_template"], job["eval_var_definitions"], 1,
+                            "initial", "initial")
+    eval_variables = evaluation["variables"]
+    eval_rendered_prompt = render_stage(evaluation, {
+        "initial": {"prompts": [job["rendered_prompt"]] * job["num_runs"], "outputs": outputs}
+    })[0]
+    eval_response, eval_latency = timed_call_llm(eval_rendered_prompt, llm_params, governor, BATCH_CLIENT_ID)
+    
+    def keep_warning(message: str):
+        # Runs on the poller thread, so problems are kept in the job for show_batch_jobs()
+        job["warning"] = message
+    
+    log_session(job["log_file"], {
+        "batch_id": job["batch_id"],
+        "llm_params": job["llm_params"],
+        "num_runs": job["num_runs"],
+        "prompt_template": job["prompt_template"],
+        "variables": job["variables"],
+        "runs": [{"prompt": job["rendered_prompt"], "output": output} for output in outputs],
+        "eval_prompt_template": job["eval_prompt_template"],
+        "eval_variables": eval_variables,
+        "eval_rendered_prompt": eval_rendered_prompt,
+        "eval_output": eval_response,
+        "eval_latency": eval_latency,
+        "log_policy": job.get("log_policy")
+    }, warn=keep_warning)
+    job["status"] = "merged"
+    job["succeeded_runs"] = sum(1 for output in outputs if not output.startswith("Error calling LLM"))
+
+# Client ID of the batch evaluations with the API governor
+BATCH_CLIENT_ID = "best-of-n-batches"
+
+class BatchPoller:
+    """
+    Background thread that follows submitted batch jobs until they are merged into their logs.
+    
+    Jobs live in JSON files in job_dir, so polling resumes after the app
+    restarts. API keys are never written to the job files: a job records a
+    salted fingerprint of its key, and the poller uses the matching key from the
+    ANTHROPIC_API_KEY environment variable or one entered in the app since it
+    started. Jobs whose key is not available wait until it is entered again.
+    Evaluation calls go through the key's API governor.
+    """
+    
+    def __init__(self, job_dir: str, interval: float = 60.0):
+        """
+        Args:
+            job_dir: Directory holding the job files
+            interval: Seconds between checks
+        """
+        self.job_dir = job_dir
+        self.interval = interval
+        # API key -> its governor
+        self.keys = {}
+        self.lock = threading.Lock()
+        self.wake = threading.Event()
+        self.last_poll = None
+        env_key = os.environ.get("ANTHROPIC_API_KEY")
+        if env_key:
+            self.register_key(env_key)
+        self.thread = threading.Thread(target=self._loop, name="pvt-batch-poller", daemon=True)
+        self.thread.start()
+    
+    def register_key(self, api_key: str):
+        """
+        Make an API key entered in the app available to jobs submitted with it.
+        
+        Called from the script thread, which also looks up the key's governor.
+        """
+        if not api_key:
+            return
+        with self.lock:
+            if api_key in self.keys:
+                return
+        governor = get_api_governor(api_key_fingerprint(api_key))
+        governor.register(BATCH_CLIENT_ID, "Best of N batch evaluations")
+        with self.lock:
+            self.keys[api_key] = governor
+    
+    def key_for(self, job: Dict[str, Any]) -> Optional[str]:
+        """
+        Return the known API key a job was submitted with, or None.
+        """
+        with self.lock:
+            keys = list(self.keys)
+        for api_key in keys:
+            if "key_salt" in job:
+                fingerprint = key_fingerprint(api_key, job["key_salt"])
+            else:
+                # Jobs submitted before fingerprints were salted
+                fingerprint = hashlib.sha256(api_key.encode("utf-8")).hexdigest()[:16]
+            if hmac.compare_digest(fingerprint, job["key_fingerprint"]):
+                return api_key
+        return None
+    
+    def check_now(self):
+        """
+        Poll the jobs without waiting for the next interval.
+        """
+        self.wake.set()
+    
+    def _loop(self):
+        while True:
+            self.poll_once()
+            self.wake.wait(self.interval)
+            self.wake.clear()
+    
+    def poll_once(self):
+        """
+        Check every unfinished job once, merging those whose batch has ended.
+        """
+        for job in load_jobs(self.job_dir):
+            if job.get("status") in FINAL_JOB_STATUSES:
+                continue
+            api_key = self.key_for(job)
+            with self.lock:
+                governor = self.keys.get(api_key)
+            if api_key is None:
+                if job.get("status") != "waiting_for_key":
+                    job["status"] = "waiting_for_key"
+                    save_job(self.job_dir, job)
+                continue
+            try:
+                client = anthropic.Anthropic(api_key=api_key)
+                batch = client.messages.batches.retrieve(job["batch_id"])
+                job["status"] = batch.processing_status
+                job["request_counts"] = {
+                    "processing": batch.request_counts.processing,
+                    "succeeded": batch.request_counts.succeeded,
+                    "errored": batch.request_counts.errored,
+                    "canceled": batch.request_counts.canceled,
+                    "expired": batch.request_counts.expired
+                }
+                job.pop("error", None)
+                if batch.processing_status == "ended":
+                    merge_batch_job(job, api_key, governor)
+            except Exception as e:
+                # Keep the job and try again on the next poll
+                job["error"] = str(e)
+            save_job(self.job_dir, job)
+        self.last_poll = datetime.datetime.now()
+
+@st.cache_resource
+def get_batch_poller(job_dir: str) -> BatchPoller:
+    """
+    Return the process-wide poller for a job directory, starting it on first use.
+    """
+    return BatchPoller(job_dir)
+
+def show_batch_jobs(poller: BatchPoller):
+    """
+    Display the tracked batch jobs and their status.
+    
+    Args:
+        poller: The batch poller
+    """
+    jobs = load_jobs(poller.job_dir)
+    if not jobs:
+        return
+    with st.expander(f"Batch Jobs ({sum(1 for job in jobs if job.get('status') not in FINAL_JOB_STATUSES)} pending)"):
+        if st.button("Check batch status now"):
+            poller.check_now()
+        st.dataframe([{
+            "batch": job["batch_id"],
+            "submitted": job.get("created", ""),
+            "status": job.get("status", ""),
+            "runs": job["num_runs"],
+            "succeeded": job.get("request_counts", {}).get("succeeded", job.get("succeeded_runs")),
+            "log file": job["log_file"],
+            "error": job.get("error", "") or job.get("warning", "")
+        } for job in jobs], use_container_width=True)
+        if poller.last_poll:
+            st.caption(f"Last checked at {poller.last_poll:%H:%M:%S}; checked every {poller.interval:.0f} seconds. "
+                       "Results are merged into the log file when a batch ends.")
+        if any(job.get("status") == "waiting_for_key" for job in jobs):
+            st.info("Some jobs were submitted with an API key that has not been entered since the app started. "
+                    "Enter it in the sidebar (or set ANTHROPIC_API_KEY) to resume them.")
+
+DEFAULT_PIPELINE = """[
+  {
+    "name": "draft",
+    "template": "Generate a creative solution to the following problem: {{problem}}",
+    "variables": "problem=\\"Design a system to reduce water waste in urban environments\\"",
+    "runs": 3
+  },
+  {
+    "name": "critique",
+    "template": "List the main weaknesses of each of these solutions:\\n\\n{{drafts}}",
+    "variables": "drafts=$$results(Solution, stage=draft)",
+    "model": "claude-3-5-haiku-latest"
+  },
+  {
+    "name": "final",
+    "template": "<InputPrompt>{{initial_prompt}}</InputPrompt>\\n\\n{{drafts}}\\n\\n<Weaknesses>{{critique}}</Weaknesses>\\n\\nCombine the strengths of these solutions into a single best solution that avoids the weaknesses.",
+    "variables": "initial_prompt=$$initial_prompt(stage=draft), drafts=$$results(Solution, stage=draft), critique=$$results(Critique, stage=critique)"
+  }
+]"""
+
+def pipeline_page(llm_params: Dict[str, Any], parallel_calls: int, cache_dir: Optional[str],
+                  log_file: str, append_datetime: bool, governor: Optional[ApiGovernor] = None,
+                  client_id: Optional[str] = None, log_policy: Optional[Dict[str, Any]] = None):
+    """
+    Define and run a multi-stage prompt pipeline.
+    
+    Args:
+        llm_params: Dictionary of LLM parameters from the sidebar (stages may override them)
+        parallel_calls: Maximum number of LLM calls in flight
+        cache_dir: Directory of the stage cache, or None to disable caching
+        log_file: Base path of the log file
+        append_datetime: Whether to append the current datetime to the log file name
+        governor: Process-wide ApiGovernor of the API key, or None
+        client_id: Client ID of this session with the governor
+        log_policy: Log rotation, retention and session index settings (see log_session()), or None
+    """
+    st.header("Pipeline")
+    st.markdown("""
+    A JSON list of stages. Each stage has a `name`, a `template` and optional `variables` (as for the initial
+    prompt), `runs` (calls per prompt), `for_each` (a stage whose outputs each get their own prompt, as
+    `{{item}}` and `{{item_index}}`) and `model`, `temperature`, `max_tokens`, `top_p` or `system_prompt`.
+    
+    Stage references:
+    - `$$results(xml_tag_name, stage=name)` - Outputs of a stage, wrapped in XML tags (default: the previous stage)
+    - `$$initial_prompt(stage=name)` - The rendered prompt of a stage (default: the first stage)
+    
+    Stages run as soon as the stages they refer to are done, so independent branches run in parallel.
+    """)
+    spec = st.text_area("Pipeline Stages", DEFAULT_PIPELINE, height=400)
+    
+    if st.button("Run Pipeline"):
+        if not llm_params["api_key"]:
+            st.error("Please enter your API key in the sidebar.")
+            return
+        try:
+            stages = parse_pipeline(spec)
+        except ValueError as e:
+            st.error(f"Invalid pipeline: {e}")
+            return
+        
+        def show_stage(stage: Dict[str, Any], result: Dict[str, Any]):
+            st.subheader(f"Stage: {stage['name']}")
+            st.caption(f"{result['model']} · {len(result['outputs'])} call(s) · "
+                       + ("reused from cache" if result["cached"] else f"{result['seconds']:.1f}s"))
+            with st.expander("Show Rendered Prompt"):
+                st.text_area("", result["prompts"][0], height=200, key=f"prompt_{stage['name']}")
+            if len(result["outputs"]) == 1:
+                st.text_area("Output", result["outputs"][0], height=300, key=f"output_{stage['name']}")
+                return
+            tabs = st.tabs([f"Output {i+1}" for i in range(len(result["outputs"]))])
+            for i, (tab, output) in enumerate(zip(tabs, result["outputs"])):
+                with tab:
+                    st.text_area(f"Output {i+1}", output, height=200, key=f"output_{stage['name']}_{i}")
+        
+        with st.spinner(f"Running {len(stages)} stages..."):
+            results = run_pipeline(stages, llm_params, cache_dir, parallel_calls, show_stage, governor, client_id)
+        
+        try:
+            final_log_file = get_log_filename(log_file, append_datetime)
+            log_session(final_log_file, {
+                "llm_params": llm_params,
+                "stages": [dict(stage, **results[stage["name"]]) for stage in stages],
+                "cached_stages": [stage["name"] for stage in stages if results[stage["name"]]["cached"]],
+                "log_policy": log_policy
+            })
+            st.success(f"Session logged to {final_log_file}")
+        except Exception as e:
+            st.error(f"Error logging session: {e}")
 
 def main():
     """
@@ -460,12 +1202,74 @@ def main():
     st.sidebar.header("Best of N Settings")
     num_runs = st.sidebar.number_input("Number of Runs (N)", 2, 20, 5, 
                                       help="Number of times to run the initial prompt")
-    
+    use_batch = st.sidebar.checkbox("Submit runs as a Message Batch", value=False,
+                                    help="Submit the runs through the Message Batches API (lower cost, may take "
+                                         "hours). The job is tracked on disk and merged into the log when it ends, "
+                                         "even if the app is restarted in the meantime")
+    job_dir = os.path.expanduser(st.sidebar.text_input("Batch Job Directory", "~/logs/pvt_best_of_n/batch_jobs"))
+    parallel_calls = st.sidebar.number_input("Parallel calls", 1, 64, 4,
+                                             help="Maximum number of LLM calls in flight across the runs and stages")
+    use_stage_cache = st.sidebar.checkbox("Reuse cached stage results", value=True,
+                                          help="A stage whose rendered prompts and model settings are unchanged "
+                                               "reuses its earlier outputs, so editing a later stage (e.g. the "
+                                               "evaluation prompt) only reruns that stage")
+    cache_dir = os.path.expanduser(st.sidebar.text_input("Stage Cache Directory", "~/logs/pvt_best_of_n/stage_cache"))
+
     st.sidebar.markdown("---")
     st.sidebar.header("Application Settings")
     log_file = st.sidebar.text_input("Log File Path", "~/logs/pvt_best_of_n/best_of_n_tests.xml")
     append_datetime = st.sidebar.checkbox("Append datetime to log filename", value=True,
                                      help="Add current date and time to the log file name")
+    with st.sidebar.expander("Log rotation and retention"):
+        log_max_mb = st.number_input("Rotate log at size (MB)", 0, 100000, 100,
+                                     help="Start a new file before a session would be added to a log this large; "
+                                          "0 disables")
+        log_max_age_days = st.number_input("Rotate log after (days)", 0, 3650, 0,
+                                           help="Start a new file once the log's first session is this old; "
+                                                "0 disables")
+        log_compress = st.checkbox("Compress rotated logs", value=True)
+        log_keep = st.number_input("Old logs to keep", 0, 100000, 0,
+                                   help="Rotated and datetime-stamped logs of the same name beyond this many are "
+                                        "deleted, newest kept; 0 keeps all")
+        log_retention_days = st.number_input("Delete old logs after (days)", 0, 3650, 0,
+                                             help="0 keeps them regardless of age")
+        session_index_file = st.text_input("Session index", "~/logs/pvt_session_index.jsonl",
+                                           help="Where every logged session is recorded, shared with the "
+                                                "Templated Prompt Tester; empty disables")
+    log_policy = {
+        "max_mb": log_max_mb,
+        "max_age_days": log_max_age_days,
+        "compress": log_compress,
+        "keep": log_keep,
+        "retention_days": log_retention_days,
+        "index_file": session_index_file
+    }
+    
+    # Follow submitted batches in the background and make this session's key available to them
+    poller = get_batch_poller(job_dir)
+    poller.register_key(api_key)
+    show_batch_jobs(poller)
+    
+    # Calls share the key's limits with the Templated Prompt Tester sessions on this server
+    client_id = st.session_state.setdefault("client_id", uuid.uuid4().hex[:8])
+    governor = None
+    if api_key:
+        governor = get_api_governor(api_key_fingerprint(api_key))
+        governor.register(client_id, f"best-of-n-{client_id}")
+    
+    mode = st.radio("Mode", ["Best of N", "Pipeline"], horizontal=True,
+                    help="Pipeline runs any number of named stages, each fed by the outputs of earlier ones")
+    if mode == "Pipeline":
+        pipeline_page({
+            "api_key": api_key,
+            "model": model,
+            "temperature": temperature,
+            "max_tokens": max_tokens,
+            "top_p": top_p,
+            "system_prompt": system_prompt
+        }, parallel_calls, cache_dir if use_stage_cache else None, log_file, append_datetime, governor, client_id,
+            log_policy)
+        return
     
     # Main input section (no tabs for inputs)
     st.header("Initial Prompt")
@@ -565,38 +1369,58 @@ def main():
             # Render the template
             rendered_prompt = render_template(initial_prompt_template, combo)
             
-            # Run the prompt N times using batch call
-            status_text = st.empty()
-            run_progress = st.progress(0)
-            
-            status_text.text(f"Running {num_runs} iterations in batch...")
-            run_progress.progress(0.1)
-            
-            # Use batch call for all runs
-            outputs = batch_call_llm(rendered_prompt, llm_params, num_runs)
-            
-            # Store run data
-            run_data = []
-            for output in outputs:
-                run_data.append({
-                    "prompt": rendered_prompt,
-                    "output": output
+            if use_batch:
+                # Hand the runs to the Batches API; the poller evaluates and logs them when the batch ends
+                try:
+                    batch_id, run_map = submit_batch(rendered_prompt, llm_params, num_runs)
+                except Exception as e:
+                    st.error(f"Error submitting batch: {e}")
+                    return
+                save_job(job_dir, {
+                    "batch_id": batch_id,
+                    "created": datetime.datetime.now().isoformat(timespec="seconds"),
+                    "status": "in_progress",
+                    **new_key_fingerprint(api_key),
+                    "run_map": run_map,
+                    "num_runs": num_runs,
+                    "llm_params": {name: value for name, value in llm_params.items() if name != "api_key"},
+                    "prompt_template": initial_prompt_template,
+                    "variables": initial_variables,
+                    "rendered_prompt": rendered_prompt,
+                    "eval_prompt_template": eval_prompt_template,
+                    "eval_var_definitions": eval_var_definitions,
+                    "log_file": get_log_filename(log_file, append_datetime),
+                    "log_policy": log_policy
                 })
-            
-            status_text.text("Initial runs completed!")
-            run_progress.progress(1.0)
+                st.success(f"Submitted batch {batch_id} with {num_runs} runs. It is tracked in {job_dir} and will be "
+                           "evaluated and logged when it ends, even if this page is closed.")
+                return
+
+            # The runs and the evaluation are the two stages of a pipeline, so unchanged
+            # runs are reused from the stage cache when only the evaluation changes
+            status_text = st.empty()
+            status_text.text(f"Running {num_runs} iterations...")
+            stages = [
+                make_stage("initial", initial_prompt_template, initial_var_definitions, num_runs),
+                make_stage("evaluation", eval_prompt_template, eval_var_definitions, 1, "initial", "initial")
+            ]
+            results = run_pipeline(stages, llm_params, cache_dir if use_stage_cache else None, parallel_calls,
+                                   lambda stage, result: status_text.text(
+                                       f"Stage {stage['name']} {'reused from cache' if result['cached'] else 'completed'}"),
+                                   governor, client_id)
+            outputs = results["initial"]["outputs"]
+            run_data = [{"prompt": prompt, "output": output, "latency": latency}
+                        for prompt, output, latency in zip(results["initial"]["prompts"], outputs,
+                                                           results["initial"]["latencies"])]
+            eval_variables = stages[1]["variables"]
+            eval_rendered_prompt = results["evaluation"]["prompts"][0]
+            eval_response = results["evaluation"]["outputs"][0]
+            eval_latency = results["evaluation"]["latencies"][0]
+            cached_stages = [name for name, result in results.items() if result["cached"]]
+            if cached_stages:
+                st.info(f"Reused cached results for: {', '.join(cached_stages)}")
         
-        # Now handle the evaluation prompt
-        with st.spinner("Processing evaluation prompt..."):
-            # Parse variable definitions for evaluation prompt
-            eval_variables = parse_variable_definitions(eval_var_definitions)
-            
-            # Process special variables (results and initial_prompt)
-            eval_rendered_prompt = process_special_variables(eval_prompt_template, eval_variables, rendered_prompt, outputs)
-            
-            # Call the LLM for evaluation
-            eval_response = call_llm(eval_rendered_prompt, llm_params)
-            
+        with st.spinner("Logging session..."):
             # Prepare session data for logging
             session_data = {
                 "llm_params": llm_params,
@@ -607,9 +1431,12 @@ def main():
                 "eval_prompt_template": eval_prompt_template,
                 "eval_variables": eval_variables,
                 "eval_rendered_prompt": eval_rendered_prompt,
-                "eval_output": eval_response
+                "eval_output": eval_response,
+                "eval_latency": eval_latency,
+                "cached_stages": cached_stages,
+                "log_policy": log_policy
             }
-            
+
             # Log the session
             try:
                 final_log_file = get_log_filename(log_file, append_datetime)
@@ -0,0 +1,441 @@
+import streamlit as st
+import os
+import gzip
+import difflib
+import importlib
+import statistics
+import xml.etree.ElementTree as ET
+from concurrent.futures import ProcessPoolExecutor
+from typing import Dict, List, Any, Tuple, Optional
+from tpt_iterative import LOG_FOOTER, LOG_HEADER, SessionIndex, get_session_index, read_indexed_session
+
+def session_input_count(session: ET.Element) -> int:
+    """
+    Count the inputs (or Best of N runs) recorded in a session element.
+    
+    Args:
+        session: A <session> element
+    
+    Returns:
+        Number of inputs
+    """
+    count = sum(1 for child in session if child.tag.startswith("input"))
+    runs = session.find("initial_prompt/runs")
+    if runs is not None:
+        count += len(runs)
+    for stage in session.findall("pipeline/stage"):
+        count += sum(1 for call in stage if call.tag.startswith("call"))
+    return count
+
+def open_log(log_file: str):
+    """
+    Open a log file for reading, decompressing rotated logs that were gzipped.
+    """
+    return gzip.open(log_file, "rb") if log_file.endswith(".gz") else open(log_file, "rb")
+
+def indexed_sessions(log_file: str, index: Optional[SessionIndex]) -> Optional[List[Dict[str, Any]]]:
+    """
+    Return the index entries of every session in a log file, in file order.
+    
+    The entries are only used if their byte ranges follow each other from
+    the start of the file to its end, so a file with sessions that were
+    logged with the index disabled is not listed partially.
+    
+    Args:
+        log_file: Path to the XML log file
+        index: The session index, or None
+    
+    Returns:
+        The entries, or None if the index does not cover the whole file
+    """
+    if index is None:
+        return None
+    entries = sorted(index.sessions(log_file), key=lambda entry: entry["offset"])
+    if not entries:
+        return None
+    position = len(LOG_HEADER)
+    for entry in entries:
+        if entry["offset"] != position:
+            return None
+        position += entry["length"]
+    # The end of a gzipped log is not known without decompressing it
+    if not log_file.endswith(".gz") and position + len(LOG_FOOTER) != os.path.getsize(log_file):
+        return None
+    return entries
+
+def list_sessions(log_file: str, index: Optional[SessionIndex] = None) -> List[Dict[str, Any]]:
+    """
+    List the sessions in a log file, from the session index if it covers the file.
+    
+    Otherwise the file is read with a streaming parse, and each session
+    element is discarded once it has been summarized, so memory use does not
+    grow with the size of the log.
+    
+    Args:
+        log_file: Path to the XML log file (gzipped if it ends with .gz)
+        index: The session index, or None
+    
+    Returns:
+        List of session summaries (index, datetime, id, number of inputs and, from
+        the index, the session's index entry)
+    """
+    entries = indexed_sessions(log_file, index)
+    if entries is not None:
+        return [{"index": position, "datetime": entry.get("datetime") or "", "id": entry["session_id"],
+                 "inputs": entry.get("inputs", 0), "entry": entry} for position, entry in enumerate(entries)]
+    
+    sessions = []
+    root = None
+    depth = 0
+    with open_log(log_file) as f:
+        for event, elem in ET.iterparse(f, events=("start", "end")):
+            if event == "start":
+                if root is None:
+                    root = elem
+                depth += 1
+                continue
+            depth -= 1
+            if depth == 1 and elem.tag == "session":
+                sessions.append({
+                    "index": len(sessions),
+                    "datetime": elem.get("datetime", ""),
+                    "id": elem.get("id", ""),
+                    "inputs": session_input_count(elem)
+                })
+                root.clear()
+    return sessions
+
+def read_output(output_elem: Optional[ET.Element], log_dir: str) -> str:
+    """
+    Return the text of an <output> element, reading spilled outputs from their file.
+    
+    Args:
+        output_elem: An <output> element, or None
+        log_dir: Directory of the log file; spilled output paths are relative to it
+    
+    Returns:
+        The full output, or the logged preview if the spill file is missing
+    """
+    if output_elem is None:
+        return ""
+    if output_elem.get("file"):
+        try:
+            with open(os.path.join(log_dir, output_elem.get("file")), "r", encoding="utf-8") as f:
+                return f.read()
+        except OSError:
+            pass
+    return output_elem.text or ""
+
+def extract_inputs(session: ET.Element, log_dir: str = "") -> Dict[Tuple, Dict[str, Any]]:
+    """
+    Extract the outputs of a session keyed by the variable paths of each input.
+    
+    Inputs of the Templated Prompt Tester are keyed by their *_path variables
+    (and template variant, if the session had several);
+    Best of N runs are keyed by run number, the evaluation by its own key and
+    pipeline calls by stage name and call number.
+    
+    Args:
+        session: A <session> element
+        log_dir: Directory of the log file, used to find spilled outputs
+    
+    Returns:
+        Dictionary mapping input keys to their output, prompt and latency
+    """
+    def entry(elem: ET.Element, prompt_tag: str) -> Dict[str, Any]:
+        latency = elem.findtext("latency")
+        return {
+            "output": read_output(elem.find("output"), log_dir),
+            "prompt": elem.findtext(prompt_tag) or "",
+            "latency": float(latency) if latency else None
+        }
+    
+    inputs = {}
+    def add(key: Tuple, value: Dict[str, Any]):
+        # Inputs with the same variable paths are told apart by occurrence
+        unique_key = key
+        occurrence = 1
+        while unique_key in inputs:
+            occurrence += 1
+            unique_key = key + (("#", str(occurrence)),)
+        inputs[unique_key] = value
+    
+    for child in session:
+        if child.tag.startswith("input"):
+            vars_elem = child.find("variables")
+            key = ()
+            if vars_elem is not None:
+                key = tuple((var.tag, var.text or "") for var in vars_elem if var.tag.endswith("_path"))
+            key = key or (("input", child.tag),)
+            if child.get("template_id"):
+                key += (("template", child.get("template_id")),)
+            add(key, entry(child, "prompt"))
+        elif child.tag == "initial_prompt":
+            runs = child.find("runs")
+            for run in (runs if runs is not None else []):
+                add((("run", run.tag),), entry(run, "rendered_prompt"))
+        elif child.tag == "evaluation":
+            add((("evaluation", "output"),), entry(child, "rendered_prompt"))
+        elif child.tag == "pipeline":
+            for stage in child.findall("stage"):
+                for call in stage:
+                    if call.tag.startswith("call"):
+                        add((("stage", stage.get("name", "")), ("call", call.tag)), entry(call, "rendered_prompt"))
+    return inputs
+
+def load_session_inputs(log_file: str, session_index: int,
+                        entry: Optional[Dict[str, Any]] = None) -> Dict[Tuple, Dict[str, Any]]:
+    """
+    Load the inputs of one session.
+    
+    With its index entry, only the session's own byte range is read;
+    otherwise a streaming parse stops at the session.
+    
+    Args:
+        log_file: Path to the XML log file (gzipped if it ends with .gz)
+        session_index: Zero-based index of the session in the file
+        entry: The session's entry in the session index, or None
+    
+    Returns:
+        Dictionary mapping input keys to their output, prompt and latency
+    """
+    if entry is not None:
+        return extract_inputs(read_indexed_session(entry), os.path.dirname(log_file))
+    
+    root = None
+    depth = 0
+    index = 0
+    with open_log(log_file) as f:
+        for event, elem in ET.iterparse(f, events=("start", "end")):
+            if event == "start":
+                if root is None:
+                    root = elem
+                depth += 1
+                continue
+            depth -= 1
+            if depth == 1 and elem.tag == "session":
+                if index == session_index:
+                    return extract_inputs(elem, os.path.dirname(log_file))
+                index += 1
+                root.clear()
+    return {}
+
+def format_key(key: Tuple) -> str:
+    """
+    Format an input key for display.
+    """
+    return ", ".join(f"{name}={value}" for name, value in key)
+
+def compare_outputs(pair: Tuple[str, str, str]) -> Dict[str, Any]:
+    """
+    Compute the similarity and unified diff of two outputs.
+    
+    Runs in a worker process, so it only takes and returns plain data.
+    
+    Args:
+        pair: Tuple of (label, output A, output B)
+    
+    Returns:
+        Dictionary with the similarity ratio (0-1) and the diff text
+    """
+    label, output_a, output_b = pair
+    if output_a == output_b:
+        return {"label": label, "similarity": 1.0, "diff": ""}
+    
+    lines_a = output_a.splitlines()
+    lines_b = output_b.splitlines()
+    # Line-level matching keeps this fast for long outputs
+    similarity = difflib.SequenceMatcher(None, lines_a, lines_b).ratio()
+    diff = "\n".join(difflib.unified_diff(lines_a, lines_b, fromfile="session A", tofile="session B", lineterm=""))
+    return {"label": label, "similarity": similarity, "diff": diff}
+
+def compare_all(pairs: List[Tuple[str, str, str]], workers: int) -> List[Dict[str, Any]]:
+    """
+    Compare all output pairs, in parallel worker processes when workers > 1.
+    
+    Args:
+        pairs: List of (label, output A, output B)
+        workers: Number of worker processes
+    
+    Returns:
+        Comparison results in the same order as pairs
+    """
+    if workers <= 1 or len(pairs) < 2:
+        return [compare_outputs(pair) for pair in pairs]
+    
+    # Streamlit runs this file as __main__, so hand the workers the function from
+    # the importable module to keep it picklable under the spawn start method
+    worker = importlib.import_module("compare_sessions").compare_outputs
+    with ProcessPoolExecutor(max_workers=workers) as executor:
+        return list(executor.map(worker, pairs, chunksize=max(1, len(pairs) // (workers * 4))))
+
+def summarize(values: List[float]) -> Tuple[Optional[float], Optional[float]]:
+    """
+    Return the mean and median of a list, or (None, None) if it is empty.
+    """
+    if not values:
+        return None, None
+    return statistics.mean(values), statistics.median(values)
+
+def format_delta(a: Optional[float], b: Optional[float], fmt: str) -> str:
+    """
+    Format a value from session B with its change relative to session A.
+    """
+    if a is None or b is None:
+        return "n/a"
+    return f"{b:{fmt}} ({b - a:+{fmt}})"
+
+def compare_sessions(selection_a: Tuple[str, int], selection_b: Tuple[str, int], workers: int) -> Dict[str, Any]:
+    """
+    Align two sessions by input key and compare their outputs.
+    
+    Args:
+        selection_a: (log file, session index, index entry or None) of session A
+        selection_b: (log file, session index, index entry or None) of session B
+        workers: Number of worker processes for the diffs
+    
+    Returns:
+        Dictionary with one row per aligned input, sorted from most to least changed,
+        and the keys that only appear on one side
+    """
+    
+    with st.spinner("Loading sessions..."):
+        inputs_a = load_session_inputs(*selection_a)
+        inputs_b = load_session_inputs(*selection_b)
+    
+    common_keys = [key for key in inputs_a if key in inputs_b]
+    only_a = [key for key in inputs_a if key not in inputs_b]
+    only_b = [key for key in inputs_b if key not in inputs_a]
+    
+    with st.spinner(f"Comparing {len(common_keys)} aligned inputs..."):
+        pairs = [(format_key(key), inputs_a[key]["output"], inputs_b[key]["output"]) for key in common_keys]
+        results = compare_all(pairs, workers)
+    
+    rows = []
+    for key, result in zip(common_keys, results):
+        a, b = inputs_a[key], inputs_b[key]
+        latency_delta = None
+        if a["latency"] is not None and b["latency"] is not None:
+            latency_delta = round(b["latency"] - a["latency"], 3)
+        rows.append({
+            "input": result["label"],
+            "similarity": round(result["similarity"], 4),
+            "length A": len(a["output"]),
+            "length B": len(b["output"]),
+            "length delta": len(b["output"]) - len(a["output"]),
+            "latency A": a["latency"],
+            "latency B": b["latency"],
+            "latency delta": latency_delta,
+            "prompt changed": a["prompt"] != b["prompt"],
+            "diff": result["diff"]
+        })
+    rows.sort(key=lambda row: row["similarity"])
+    return {"rows": rows, "only_a": only_a, "only_b": only_b}
+
+def show_comparison(comparison: Dict[str, Any], max_rows: int):
+    """
+    Display summary statistics, the most changed inputs and their diffs.
+    
+    Args:
+        comparison: Result of compare_sessions()
+        max_rows: Number of most-changed inputs to list
+    """
+    rows, only_a, only_b = comparison["rows"], comparison["only_a"], comparison["only_b"]
+    
+    # Summary statistics
+    st.header("Summary")
+    changed = sum(1 for row in rows if row["similarity"] < 1.0)
+    cols = st.columns(4)
+    cols[0].metric("Aligned inputs", len(rows))
+    cols[1].metric("Changed outputs", changed)
+    cols[2].metric("Only in A", len(only_a))
+    cols[3].metric("Only in B", len(only_b))
+    
+    mean_len_a, median_len_a = summarize([row["length A"] for row in rows])
+    mean_len_b, median_len_b = summarize([row["length B"] for row in rows])
+    mean_lat_a, median_lat_a = summarize([row["latency A"] for row in rows if row["latency A"] is not None])
+    mean_lat_b, median_lat_b = summarize([row["latency B"] for row in rows if row["latency B"] is not None])
+    mean_sim, median_sim = summarize([row["similarity"] for row in rows])
+    
+    cols = st.columns(4)
+    cols[0].metric("Mean similarity", f"{mean_sim:.3f}" if mean_sim is not None else "n/a")
+    cols[1].metric("Mean output length (B vs A)", format_delta(mean_len_a, mean_len_b, ".0f"))
+    cols[2].metric("Median output length (B vs A)", format_delta(median_len_a, median_len_b, ".0f"))
+    cols[3].metric("Mean latency s (B vs A)", format_delta(mean_lat_a, mean_lat_b, ".2f"))
+    
+    # Most changed combinations
+    st.header("Most Changed Inputs")
+    shown = rows[:max_rows]
+    st.dataframe([{name: value for name, value in row.items() if name != "diff"} for row in shown],
+                 use_container_width=True)
+    
+    changed_rows = [row for row in shown if row["diff"]]
+    if changed_rows:
+        selected = st.selectbox("Show diff for", changed_rows,
+                                format_func=lambda row: f"{row['similarity']:.3f}  {row['input']}")
+        st.code(selected["diff"], language="diff")
+    
+    if only_a or only_b:
+        with st.expander("Unmatched inputs"):
+            st.write("Only in session A:")
+            st.write([format_key(key) for key in only_a])
+            st.write("Only in session B:")
+            st.write([format_key(key) for key in only_b])
+
+def main():
+    """
+    Main Streamlit application function.
+    """
+    st.title("Session Comparison")
+    
+    st.sidebar.header("Comparison Settings")
+    workers = st.sidebar.number_input("Parallel workers", 1, 64, min(os.cpu_count() or 1, 8),
+                                      help="Worker processes used to compute diffs")
+    max_rows = st.sidebar.number_input("Rows to show", 1, 10000, 50,
+                                       help="Number of most-changed combinations listed")
+    session_index_file = st.sidebar.text_input("Session index", "~/logs/pvt_session_index.jsonl",
+                                               help="Used to list and read sessions without parsing whole logs; "
+                                                    "empty disables")
+    index = get_session_index(session_index_file) if session_index_file else None
+    
+    col_a, col_b = st.columns(2)
+    selections = []
+    for column, label, default in ((col_a, "A", "~/logs/pvt_file_iterative/file_iterative_tests.xml"),
+                                   (col_b, "B", "~/logs/pvt_file_iterative/file_iterative_tests.xml")):
+        with column:
+            st.subheader(f"Session {label}")
+            log_file = os.path.expanduser(st.text_input(f"Log file {label}", default))
+            if not os.path.isfile(log_file):
+                st.info("Enter the path of an existing log file.")
+                selections.append(None)
+                continue
+            try:
+                sessions = list_sessions(log_file, index)
+            except (ET.ParseError, OSError, EOFError) as e:
+                st.error(f"Could not parse {log_file}: {e}")
+                selections.append(None)
+                continue
+            if not sessions:
+                st.warning("No sessions found in this log.")
+                selections.append(None)
+                continue
+            # Default to comparing the last two sessions
+            default_index = len(sessions) - 1 if label == "B" else max(len(sessions) - 2, 0)
+            session = st.selectbox(
+                f"Session {label}", sessions, index=default_index,
+                format_func=lambda s: f"#{s['index'] + 1} {s['datetime']} ({s['inputs']} inputs)"
+            )
+            selections.append((log_file, session["index"], session.get("entry")))
+    
+    if st.button("Compare Sessions"):
+        if None in selections:
+            st.error("Select a session on both sides first.")
+            return
+        st.session_state["comparison"] = compare_sessions(selections[0], selections[1], workers)
+    
+    # Keep showing the last comparison while the diff selection changes
+    if "comparison" in st.session_state:
+        show_comparison(st.session_state["comparison"], max_rows)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,269 @@
+import streamlit as st
+import os
+import csv
+import time
+import datetime
+import itertools
+import uuid
+from typing import Dict, List, Any, Tuple, Optional
+from tpt_iterative import (parse_variable_definitions, iter_combinations, render_template,
+                           combination_key, RequestDispatcher, log_session, percentile,
+                           ApiGovernor, get_api_governor, key_fingerprint)
+
+def parse_levels(text: str) -> List[int]:
+    """
+    Parse a comma-separated list of concurrency levels.
+    
+    Args:
+        text: Levels such as "1, 2, 4, 8"
+    
+    Returns:
+        Sorted list of distinct positive levels
+    """
+    levels = set()
+    for part in text.split(","):
+        part = part.strip()
+        if part:
+            level = int(part)
+            if level < 1:
+                raise ValueError(f"Concurrency levels must be at least 1, got {level}")
+            levels.add(level)
+    return sorted(levels)
+
+def build_requests(prompt_template: str, variables: Dict[str, Any],
+                   count: int) -> Tuple[List[Dict[str, Any]], float, float]:
+    """
+    Render the requests for one level, cycling through the combinations if there are fewer than count.
+    
+    Args:
+        prompt_template: The prompt template
+        variables: Dictionary of parsed variables
+        count: Number of requests
+    
+    Returns:
+        Tuple of the request dictionaries, the seconds spent rendering and the
+        process CPU seconds used meanwhile
+    """
+    render_cpu_start = time.process_time()
+    render_start = time.perf_counter()
+    combinations = list(itertools.islice(iter_combinations(variables), count))
+    requests = []
+    for index, combo in enumerate(itertools.islice(itertools.cycle(combinations), count)):
+        prompt = render_template(prompt_template, combo)
+        requests.append({
+            "index": index,
+            "key": combination_key(combo),
+            "combo": combo,
+            "prompt": prompt,
+            "estimated_cost": 0.0
+        })
+    return requests, time.perf_counter() - render_start, time.process_time() - render_cpu_start
+
+def run_level(requests: List[Dict[str, Any]], llm_params: Dict[str, Any], concurrency: int,
+              log_file: str, render_seconds: float, render_cpu_seconds: float,
+              governor: Optional[ApiGovernor] = None, client_id: Optional[str] = None) -> Dict[str, Any]:
+    """
+    Drive one concurrency level through dispatch and logging, and measure it.
+    
+    CPU time is measured for the whole process, so it includes the worker
+    threads, the XML logging and Streamlit's own work during the level. Like
+    the wall time, it includes rendering the requests.
+    
+    Args:
+        requests: Rendered requests from build_requests()
+        llm_params: Dictionary of LLM parameters
+        concurrency: Number of calls in flight
+        log_file: Log file each level's session is written to
+        render_seconds: Seconds spent rendering the requests
+        render_cpu_seconds: Process CPU seconds used while rendering the requests
+        governor: Process-wide ApiGovernor of the API key, or None
+        client_id: Client ID of the load test with the governor
+
+    Returns:
+        Dictionary with throughput, latency percentiles, errors and CPU use of the level
+    """
+    cpu_start = time.process_time()
+    wall_start = time.perf_counter()
+    
+    dispatcher = RequestDispatcher(llm_params, concurrency, governor=governor, client_id=client_id)
+    inputs = [None] * len(requests)
+    for request, result in dispatcher.run(requests):
+        inputs[request["index"]] = {
+            "variables": request["combo"],
+            "prompt": request["prompt"],
+            "status": "error" if result["error_type"] else "ok",
+            "error_type": result["error_type"],
+            "output": result["output"],
+            "output_file": result.get("output_file"),
+            "output_chars": result.get("output_chars"),
+            "latency": result["latency"]
+        }
+    dispatch_seconds = time.perf_counter() - wall_start
+    
+    log_start = time.perf_counter()
+    log_session(log_file, {
+        "session_id": uuid.uuid4().hex[:12],
+        "llm_params": dict(llm_params, concurrency=concurrency),
+        "metrics": dispatcher.metrics,
+        "inputs": inputs
+    })
+    log_seconds = time.perf_counter() - log_start
+    
+    wall_seconds = time.perf_counter() - wall_start + render_seconds
+    cpu_seconds = time.process_time() - cpu_start + render_cpu_seconds
+    latencies = [input_data["latency"] for input_data in inputs]
+    return {
+        "concurrency": concurrency,
+        "requests": len(inputs),
+        "errors": sum(1 for input_data in inputs if input_data["status"] == "error"),
+        "wall s": round(wall_seconds, 3),
+        "throughput req/s": round(len(inputs) / wall_seconds, 2) if wall_seconds > 0 else None,
+        "p50 latency s": round(percentile(latencies, 50), 3),
+        "p90 latency s": round(percentile(latencies, 90), 3),
+        "p99 latency s": round(percentile(latencies, 99), 3),
+        "render s": round(render_seconds, 3),
+        "dispatch s": round(dispatch_seconds, 3),
+        "log s": round(log_seconds, 3),
+        "CPU %": round(100.0 * cpu_seconds / wall_seconds, 1) if wall_seconds > 0 else None,
+        "CPU ms/request": round(1000.0 * cpu_seconds / len(inputs), 2)
+    }
+
+def save_report(rows: List[Dict[str, Any]], report_dir: str) -> str:
+    """
+    Save the results of a load test as a CSV file.
+    
+    Args:
+        rows: One result dictionary per level
+        report_dir: Directory the report is written to
+    
+    Returns:
+        Path of the report
+    """
+    os.makedirs(report_dir, exist_ok=True)
+    timestamp = datetime.datetime.now().strftime("%d%b%Y_%H-%M-%S")
+    report_path = os.path.join(report_dir, f"load_test_{timestamp}.csv")
+    with open(report_path, "w", encoding="utf-8", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+        writer.writeheader()
+        writer.writerows(rows)
+    return report_path
+
+def best_level(rows: List[Dict[str, Any]], tolerance: float = 0.05) -> Optional[Dict[str, Any]]:
+    """
+    Pick the lowest error-free level whose throughput is within tolerance of the best.
+    """
+    healthy = [row for row in rows if row["errors"] == 0 and row["throughput req/s"]]
+    if not healthy:
+        return None
+    top = max(row["throughput req/s"] for row in healthy)
+    return next(row for row in healthy if row["throughput req/s"] >= top * (1 - tolerance))
+
+def main():
+    """
+    Main Streamlit application function.
+    """
+    st.title("Load Test")
+    st.write("Drive the render, call and log pipeline at increasing concurrency to find the best setting "
+             "and the tool's own overhead per request.")
+    
+    st.sidebar.header("Backend")
+    backend_labels = {
+        "mock": "Mock responses (offline)",
+        "anthropic": "Anthropic API"
+    }
+    backend = st.sidebar.selectbox("Backend", list(backend_labels.keys()), format_func=lambda key: backend_labels[key])
+    llm_params = {"backend": backend}
+    call_budget = None
+    if backend == "mock":
+        llm_params["mock_latency"] = st.sidebar.number_input("Mock latency (seconds)", 0.0, 600.0, 0.5)
+        llm_params["mock_output_chars"] = st.sidebar.number_input("Mock output length (characters)", 1, 10000000, 2000)
+    else:
+        llm_params["api_key"] = st.sidebar.text_input("API Key", type="password")
+        llm_params["model"] = st.sidebar.selectbox(
+            "Model",
+            ["claude-3-5-haiku-latest", "claude-3-haiku-20240307", "claude-3-7-sonnet-latest"]
+        )
+        llm_params["max_tokens"] = st.sidebar.number_input("Max Tokens", 1, 128000, 256)
+        call_budget = st.sidebar.number_input("Call budget", 1, 100000, 100,
+                                              help="Maximum number of API calls across all levels")
+    
+    st.sidebar.markdown("---")
+    st.sidebar.header("Load Test Settings")
+    levels_text = st.sidebar.text_input("Concurrency levels", "1, 2, 4, 8, 16, 32")
+    requests_per_level = st.sidebar.number_input("Requests per level", 1, 100000, 100)
+    report_dir = os.path.expanduser(st.sidebar.text_input("Report directory", "~/logs/pvt_load_test"))
+    
+    prompt_template = st.text_area("Prompt Template", "Write a short summary of {{file_content}}.", height=150)
+    var_definitions = st.text_area("Variable Definitions", "file_content=$$dir(./sample_data)")
+    
+    if st.button("Run Load Test"):
+        if backend == "anthropic" and not llm_params["api_key"]:
+            st.error("Please enter your API key in the sidebar.")
+            return
+        try:
+            levels = parse_levels(levels_text)
+        except ValueError as e:
+            st.error(f"Invalid concurrency levels: {e}")
+            return
+        if not levels:
+            st.error("Enter at least one concurrency level.")
+            return
+        
+        variables = parse_variable_definitions(var_definitions)
+        if next(iter_combinations(variables), None) is None:
+            st.error("No valid combinations found. Please check your variable definitions.")
+            return
+        
+        if call_budget is not None and len(levels) * requests_per_level > call_budget:
+            st.warning(f"{len(levels)} levels x {requests_per_level} requests exceeds the call budget of "
+                       f"{call_budget}; levels that do not fit are skipped.")
+        
+        # Calls share the key's limits with the other sessions on this server, which caps the levels tested
+        governor = None
+        client_id = st.session_state.setdefault("client_id", uuid.uuid4().hex[:8])
+        if backend == "anthropic":
+            governor = get_api_governor(key_fingerprint(llm_params["api_key"]))
+            governor.register(client_id, f"load-test-{client_id}")
+        
+        os.makedirs(report_dir, exist_ok=True)
+        log_file = os.path.join(report_dir, f"load_test_{datetime.datetime.now():%d%b%Y_%H-%M-%S}.xml")
+        llm_params["spill_dir"] = os.path.join(report_dir, f"{os.path.splitext(os.path.basename(log_file))[0]}_outputs")
+        
+        rows = []
+        calls_made = 0
+        table = st.empty()
+        progress = st.progress(0.0)
+        for position, level in enumerate(levels):
+            if call_budget is not None and calls_made + requests_per_level > call_budget:
+                st.info(f"Stopped before concurrency {level}: the call budget is used up.")
+                break
+            with st.spinner(f"Running {requests_per_level} requests at concurrency {level}..."):
+                requests, render_seconds, render_cpu_seconds = build_requests(prompt_template, variables,
+                                                                              requests_per_level)
+                rows.append(run_level(requests, llm_params, level, log_file, render_seconds, render_cpu_seconds,
+                                      governor, client_id))
+            calls_made += len(requests)
+            table.dataframe(rows, use_container_width=True)
+            progress.progress((position + 1) / len(levels))
+        
+        if not rows:
+            return
+        
+        st.subheader("Throughput by Concurrency")
+        st.line_chart({"concurrency": [row["concurrency"] for row in rows],
+                       "throughput req/s": [row["throughput req/s"] for row in rows]},
+                      x="concurrency", y="throughput req/s")
+        
+        best = best_level(rows)
+        if best:
+            st.success(f"Best setting: concurrency {best['concurrency']} "
+                       f"({best['throughput req/s']} req/s, p90 latency {best['p90 latency s']}s, "
+                       f"{best['CPU ms/request']} ms CPU per request).")
+        else:
+            st.warning("Every level had errors; lower the concurrency levels or check the backend.")
+        
+        report_path = save_report(rows, report_dir)
+        st.success(f"Report saved to {report_path}; sessions logged to {log_file}")
+
+if __name__ == "__main__":
+    main()
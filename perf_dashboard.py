@@ -0,0 +1,461 @@
+import streamlit as st
+import os
+import glob
+import gzip
+import json
+import time
+import datetime
+import xml.etree.ElementTree as ET
+from typing import Dict, List, Any, Tuple, Optional
+from tpt_iterative import estimate_tokens, percentile
+
+# USD per million input and output tokens, matched against the start of the model name
+MODEL_PRICES = {
+    "claude-3-7-sonnet": (3.0, 15.0),
+    "claude-3-5-sonnet": (3.0, 15.0),
+    "claude-3-5-haiku": (0.8, 4.0),
+    "claude-3-haiku": (0.25, 1.25),
+    "claude-3-opus": (15.0, 75.0)
+}
+
+# Message Batches are billed at half the price
+BATCH_DISCOUNT = 0.5
+
+# Bump when the indexed fields change so old indexes are rebuilt
+INDEX_VERSION = 1
+
+def model_price(model: str) -> Optional[Tuple[float, float]]:
+    """
+    Look up the per-million-token prices of a model.
+    
+    Args:
+        model: Model name
+    
+    Returns:
+        Tuple of input and output price, or None for unknown models
+    """
+    for prefix, prices in MODEL_PRICES.items():
+        if model.startswith(prefix):
+            return prices
+    return None
+
+def session_day(session: ET.Element, fallback: float) -> str:
+    """
+    Return the day a session was logged, as YYYY-MM-DD.
+    
+    Args:
+        session: A <session> element
+        fallback: Timestamp used if the session has no readable datetime (the file's mtime)
+    
+    Returns:
+        The day
+    """
+    try:
+        logged_at = datetime.datetime.strptime(session.get("datetime", ""), "%d%b%Y - %H:%M:%S")
+    except ValueError:
+        logged_at = datetime.datetime.fromtimestamp(fallback)
+    return logged_at.strftime("%Y-%m-%d")
+
+def output_tokens(output_elem: Optional[ET.Element]) -> int:
+    """
+    Estimate the tokens of a logged output, using the full length of spilled outputs.
+    """
+    if output_elem is None:
+        return 0
+    if output_elem.get("chars"):
+        return (int(output_elem.get("chars")) + 3) // 4
+    return estimate_tokens(output_elem.text or "")
+
+def is_error_output(output_elem: Optional[ET.Element]) -> bool:
+    """
+    Tell whether an output records a failed call (for logs without a status attribute).
+    """
+    return output_elem is not None and (output_elem.text or "").startswith("Error calling LLM:")
+
+def session_samples(session: ET.Element) -> List[Dict[str, Any]]:
+    """
+    Describe every LLM call recorded in a session of either tool.
+    
+    Args:
+        session: A <session> element from a Templated Prompt Tester, Best of N or load test log
+    
+    Returns:
+        One sample per call with model, backend, status, latency (None if not
+        logged) and input and output tokens (from the API's usage where logged,
+        else estimated)
+    """
+    samples = []
+    # Stages reused from the Best of N stage cache made no calls in this session
+    cached_stages = set(filter(None, session.get("cached_stages", "").split(",")))
+    
+    # Best of N pipeline: one element per stage, each with its own model
+    pipeline = session.find("pipeline")
+    if pipeline is not None:
+        backend = pipeline.findtext("llm_parameters/backend") or "anthropic"
+        for stage in pipeline.findall("stage"):
+            if stage.get("cached") == "true":
+                continue
+            for call in stage:
+                if not call.tag.startswith("call"):
+                    continue
+                output_elem = call.find("output")
+                error = is_error_output(output_elem)
+                latency = call.findtext("latency")
+                samples.append({
+                    "model": stage.get("model") or "unknown",
+                    "backend": backend,
+                    "error": error,
+                    "latency": float(latency) if latency else None,
+                    "input_tokens": estimate_tokens(call.findtext("rendered_prompt") or ""),
+                    "output_tokens": 0 if error else output_tokens(output_elem)
+                })
+        return samples
+    
+    # Best of N: the runs and the evaluation share the session's parameters
+    initial = session.find("initial_prompt")
+    if initial is not None:
+        model = initial.findtext("llm_parameters/model") or "unknown"
+        backend = initial.findtext("llm_parameters/backend") or "anthropic"
+        calls = []
+        if "initial" not in cached_stages:
+            calls = [(run.find("rendered_prompt"), run.find("output"), run.findtext("latency"))
+                     for run in initial.findall("runs/*")]
+        evaluation = session.find("evaluation")
+        if evaluation is not None and "evaluation" not in cached_stages:
+            calls.append((evaluation.find("rendered_prompt"), evaluation.find("output"), evaluation.findtext("latency")))
+        for prompt_elem, output_elem, latency in calls:
+            error = is_error_output(output_elem)
+            samples.append({
+                "model": model,
+                "backend": backend,
+                "error": error,
+                "latency": float(latency) if latency else None,
+                "input_tokens": estimate_tokens(prompt_elem.text or "") if prompt_elem is not None else 0,
+                "output_tokens": 0 if error else output_tokens(output_elem)
+            })
+        return samples
+    
+    # Templated Prompt Tester and load test: one element per input
+    # pack id -> sample of the pack's first member, which carries the pack's latency
+    pack_samples = {}
+    for input_elem in session:
+        if not input_elem.tag.startswith("input"):
+            continue
+        model = input_elem.findtext("model") or input_elem.findtext("variables/llm_parameters/model") or "unknown"
+        backend = input_elem.findtext("variables/llm_parameters/backend") or "anthropic"
+        output_elem = input_elem.find("output")
+        error = input_elem.get("status") == "error" or (input_elem.get("status") is None and is_error_output(output_elem))
+        latency = input_elem.findtext("latency")
+        pack_id = input_elem.get("pack_id")
+        if pack_id in pack_samples:
+            # Packed inputs share one call; count its latency once
+            latency = None
+        samples.append({
+            "model": model,
+            "backend": backend,
+            "error": error,
+            "latency": float(latency) if latency else None,
+            "input_tokens": int(input_elem.get("input_tokens") or estimate_tokens(input_elem.findtext("prompt") or "")),
+            "output_tokens": 0 if error else int(input_elem.get("output_tokens") or output_tokens(output_elem))
+        })
+        if pack_id is not None:
+            # Each member logs its share of the pack's tokens; tokens/sec uses the whole pack's
+            first = pack_samples.setdefault(pack_id, samples[-1])
+            first["timed_output_tokens"] = first.get("timed_output_tokens", 0) + samples[-1]["output_tokens"]
+        
+        # The map and intermediate reduce calls of a map-reduce input
+        for call in input_elem.findall("intermediate/call"):
+            error = call.get("status") == "error"
+            samples.append({
+                "model": model,
+                "backend": backend,
+                "error": error,
+                "latency": float(call.get("latency")) if call.get("latency") else None,
+                "input_tokens": estimate_tokens(call.findtext("prompt") or ""),
+                "output_tokens": 0 if error else estimate_tokens(call.findtext("output") or "")
+            })
+    return samples
+
+def summarize_session(session: ET.Element, tool: str, fallback_time: float) -> List[Dict[str, Any]]:
+    """
+    Aggregate the calls of a session per model and backend, as stored in the index.
+    
+    Args:
+        session: A <session> element
+        tool: Name of the tool that wrote the log (its log directory)
+        fallback_time: Timestamp used if the session has no readable datetime
+    
+    Returns:
+        One group per model and backend with the day, call and error counts,
+        latencies, token totals and cost
+    """
+    day = session_day(session, fallback_time)
+    discount = BATCH_DISCOUNT if session.get("batch_id") else 1.0
+    groups = {}
+    for sample in session_samples(session):
+        group = groups.setdefault((sample["model"], sample["backend"]), {
+            "day": day,
+            "tool": tool,
+            "model": sample["model"],
+            "backend": sample["backend"],
+            "calls": 0,
+            "errors": 0,
+            "latencies": [],
+            "input_tokens": 0,
+            "output_tokens": 0,
+            # Output tokens and seconds of successful calls with a logged latency, for tokens/sec
+            "timed_output_tokens": 0,
+            "timed_seconds": 0.0,
+            "cost": 0.0
+        })
+        group["calls"] += 1
+        group["errors"] += sample["error"]
+        group["input_tokens"] += sample["input_tokens"]
+        group["output_tokens"] += sample["output_tokens"]
+        if sample["latency"] is not None:
+            group["latencies"].append(round(sample["latency"], 3))
+            if not sample["error"]:
+                group["timed_output_tokens"] += sample.get("timed_output_tokens", sample["output_tokens"])
+                group["timed_seconds"] += sample["latency"]
+    
+    for group in groups.values():
+        prices = model_price(group["model"])
+        if prices is not None and group["backend"] in ("anthropic", "record"):
+            group["cost"] = round(discount * (group["input_tokens"] * prices[0]
+                                              + group["output_tokens"] * prices[1]) / 1e6, 6)
+    return list(groups.values())
+
+def session_key(session: ET.Element, ordinal: int) -> str:
+    """
+    Identify a session within its log file.
+    """
+    return session.get("id") or f"{session.get('datetime', '')}#{ordinal}"
+
+def index_log_file(log_path: str, tool: str, previous: Optional[Dict[str, Any]]) -> Tuple[Dict[str, Any], int]:
+    """
+    Index the sessions of a new or changed log file with a streaming parse.
+    
+    Sessions already in the previous entry (same key and "updated" attribute)
+    keep their summary instead of being aggregated again.
+    
+    Args:
+        log_path: Path to the XML log file (gzipped if it ends with .gz, as rotated logs are)
+        tool: Name of the tool that wrote the log
+        previous: The file's previous index entry, or None
+    
+    Returns:
+        Tuple of the file's index entry and the number of sessions summarized anew
+    """
+    stat = os.stat(log_path)
+    old_sessions = (previous or {}).get("sessions", {})
+    sessions = {}
+    summarized = 0
+    root = None
+    depth = 0
+    ordinal = 0
+    opener = gzip.open if log_path.endswith(".gz") else open
+    with opener(log_path, "rb") as source:
+        for event, elem in ET.iterparse(source, events=("start", "end")):
+            if event == "start":
+                if root is None:
+                    root = elem
+                depth += 1
+                continue
+            depth -= 1
+            if depth == 1 and elem.tag == "session":
+                key = session_key(elem, ordinal)
+                ordinal += 1
+                old = old_sessions.get(key)
+                if old is not None and old["updated"] == elem.get("updated", ""):
+                    sessions[key] = old
+                else:
+                    sessions[key] = {"updated": elem.get("updated", ""),
+                                     "groups": summarize_session(elem, tool, stat.st_mtime)}
+                    summarized += 1
+                root.clear()
+    return {"mtime": stat.st_mtime, "size": stat.st_size, "sessions": sessions}, summarized
+
+def load_index(index_path: str) -> Dict[str, Any]:
+    """
+    Load the dashboard index, or return an empty one if it is missing or outdated.
+    """
+    try:
+        with open(index_path, "r", encoding="utf-8") as f:
+            index = json.load(f)
+        if index.get("version") == INDEX_VERSION:
+            return index
+    except (OSError, ValueError):
+        pass
+    return {"version": INDEX_VERSION, "files": {}}
+
+def save_index(index_path: str, index: Dict[str, Any]):
+    """
+    Write the dashboard index, replacing it atomically.
+    """
+    os.makedirs(os.path.dirname(index_path) or ".", exist_ok=True)
+    temp_path = index_path + ".tmp"
+    with open(temp_path, "w", encoding="utf-8") as f:
+        json.dump(index, f)
+    os.replace(temp_path, index_path)
+
+def update_index(index: Dict[str, Any], log_root: str, pattern: str) -> Dict[str, Any]:
+    """
+    Bring the index up to date with the log files, parsing only new or changed files.
+    
+    Args:
+        index: Index from load_index(), updated in place
+        log_root: Directory holding the tools' log directories
+        pattern: Glob pattern of the log directories under log_root
+    
+    Returns:
+        Statistics of the update (files found and parsed, sessions summarized, errors)
+    """
+    stats = {"files": 0, "parsed": 0, "summarized": 0, "errors": []}
+    found = set()
+    for log_dir in sorted(glob.glob(os.path.join(log_root, pattern))):
+        if not os.path.isdir(log_dir):
+            continue
+        tool = os.path.basename(log_dir)
+        for log_path in sorted(glob.glob(os.path.join(log_dir, "**", "*.xml"), recursive=True) +
+                               glob.glob(os.path.join(log_dir, "**", "*.xml.gz"), recursive=True)):
+            found.add(log_path)
+            stats["files"] += 1
+            previous = index["files"].get(log_path)
+            try:
+                stat = os.stat(log_path)
+                if previous and previous["mtime"] == stat.st_mtime and previous["size"] == stat.st_size:
+                    continue
+                index["files"][log_path], summarized = index_log_file(log_path, tool, previous)
+            except (OSError, EOFError, ET.ParseError) as e:
+                # Possibly being written; keep the old entry and try again next time
+                stats["errors"].append(f"{log_path}: {e}")
+                continue
+            stats["parsed"] += 1
+            stats["summarized"] += summarized
+    for log_path in set(index["files"]) - found:
+        del index["files"][log_path]
+    return stats
+
+def aggregate(groups: List[Dict[str, Any]]) -> List[Dict[str, Any]]:
+    """
+    Combine session groups into one row per day and model.
+    
+    Args:
+        groups: Session groups from the index
+    
+    Returns:
+        Rows sorted by day and model with calls, error rate, latency
+        percentiles, tokens per second, token totals and cost
+    """
+    combined = {}
+    for group in groups:
+        row = combined.setdefault((group["day"], group["model"]), {
+            "day": group["day"], "model": group["model"], "calls": 0, "errors": 0, "latencies": [],
+            "input_tokens": 0, "output_tokens": 0, "timed_output_tokens": 0, "timed_seconds": 0.0, "cost": 0.0
+        })
+        for field in ("calls", "errors", "input_tokens", "output_tokens", "timed_output_tokens", "timed_seconds", "cost"):
+            row[field] += group[field]
+        row["latencies"].extend(group["latencies"])
+    
+    rows = []
+    for (day, model), row in sorted(combined.items()):
+        latencies = row.pop("latencies")
+        timed_output_tokens = row.pop("timed_output_tokens")
+        timed_seconds = row.pop("timed_seconds")
+        row["error_rate"] = round(row["errors"] / row["calls"], 4) if row["calls"] else 0.0
+        for p in (50, 90, 99):
+            row[f"p{p}_latency"] = round(percentile(latencies, p), 3) if latencies else None
+        row["tokens_per_second"] = round(timed_output_tokens / timed_seconds, 1) if timed_seconds > 0 else None
+        row["cost"] = round(row["cost"], 4)
+        rows.append(row)
+    return rows
+
+def chart(rows: List[Dict[str, Any]], field: str, title: str, bar: bool = False):
+    """
+    Chart one field of the aggregated rows by day, with a line (or stacked bar) per model.
+    """
+    data = [{"day": row["day"], "model": row["model"], field: row[field]} for row in rows if row[field] is not None]
+    st.subheader(title)
+    if not data:
+        st.caption("No data for the selected sessions.")
+        return
+    if bar:
+        st.bar_chart(data, x="day", y=field, color="model")
+    else:
+        st.line_chart(data, x="day", y=field, color="model")
+
+def main():
+    """
+    Main Streamlit application function.
+    """
+    st.title("Performance Dashboard")
+    st.write("Latency, throughput, error rates and cost by model and by day, from the session logs of all tools.")
+    
+    st.sidebar.header("Logs")
+    log_root = os.path.expanduser(st.sidebar.text_input("Log root", "~/logs"))
+    pattern = st.sidebar.text_input("Log directories", "pvt_*",
+                                    help="Glob pattern of the tools' log directories under the log root")
+    index_path = os.path.expanduser(st.sidebar.text_input("Index file", "~/logs/.pvt_dashboard_index.json",
+                                                          help="Summaries of the indexed sessions; only new or "
+                                                               "changed log files are parsed on each refresh"))
+    rebuild = st.sidebar.button("Rebuild index")
+    
+    # Index new and changed log files
+    index = {"version": INDEX_VERSION, "files": {}} if rebuild else load_index(index_path)
+    start_time = time.perf_counter()
+    with st.spinner("Indexing logs..."):
+        stats = update_index(index, log_root, pattern)
+    if stats["parsed"] or rebuild:
+        try:
+            save_index(index_path, index)
+        except OSError as e:
+            st.warning(f"Could not save the index: {e}")
+    groups = [group for entry in index["files"].values() for session in entry["sessions"].values()
+              for group in session["groups"]]
+    session_count = sum(len(entry["sessions"]) for entry in index["files"].values())
+    st.caption(f"{session_count} sessions in {stats['files']} log files; parsed {stats['parsed']} new or changed "
+               f"file(s) and summarized {stats['summarized']} session(s) in {time.perf_counter() - start_time:.2f}s.")
+    if stats["errors"]:
+        with st.expander(f"{len(stats['errors'])} log file(s) could not be read"):
+            st.text("\n".join(stats["errors"]))
+    if not groups:
+        st.info(f"No sessions found in {os.path.join(log_root, pattern)}.")
+        return
+    
+    # Filter by tool, backend and model; offline backends are excluded by default
+    st.sidebar.markdown("---")
+    st.sidebar.header("Filters")
+    tools = sorted({group["tool"] for group in groups})
+    backends = sorted({group["backend"] for group in groups})
+    models = sorted({group["model"] for group in groups})
+    selected_tools = st.sidebar.multiselect("Tools", tools, tools)
+    selected_backends = st.sidebar.multiselect("Backends", backends,
+                                               [backend for backend in backends if backend not in ("mock", "replay")])
+    selected_models = st.sidebar.multiselect("Models", models, models)
+    rows = aggregate([group for group in groups if group["tool"] in selected_tools
+                      and group["backend"] in selected_backends and group["model"] in selected_models])
+    if not rows:
+        st.info("No sessions match the filters.")
+        return
+    
+    cols = st.columns(4)
+    total_calls = sum(row["calls"] for row in rows)
+    cols[0].metric("Calls", f"{total_calls:,}")
+    cols[1].metric("Error rate", f"{sum(row['errors'] for row in rows) / total_calls:.1%}")
+    cols[2].metric("Output tokens", f"{sum(row['output_tokens'] for row in rows):,}")
+    cols[3].metric("Cost", f"${sum(row['cost'] for row in rows):,.2f}")
+    
+    latency_percentile = st.radio("Latency percentile", ["p50", "p90", "p99"], horizontal=True)
+    chart(rows, f"{latency_percentile}_latency", f"Latency {latency_percentile} (seconds)")
+    chart(rows, "tokens_per_second", "Output tokens per second")
+    chart(rows, "error_rate", "Error rate")
+    chart(rows, "cost", "Cost (USD)", bar=True)
+    st.caption("Token counts come from the API's usage where the log records it and are estimated from text "
+               "length otherwise; cost uses list prices (half for Message Batches) and is only counted for "
+               "the Anthropic API backends.")
+    
+    st.subheader("By Day and Model")
+    st.dataframe(rows, use_container_width=True)
+
+if __name__ == "__main__":
+    main()
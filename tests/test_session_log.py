@@ -0,0 +1,116 @@
+import os
+import gzip
+import shutil
+import tempfile
+import unittest
+import xml.etree.ElementTree as ET
+from typing import Dict, Any
+
+import tpt_iterative as tpt
+
+def make_session(session_id: str, output: str, policy: Dict[str, Any]) -> Dict[str, Any]:
+    """
+    Build a minimal session record as the Templated Prompt Tester logs it (mock backend).
+    """
+    return {
+        "session_id": session_id,
+        "llm_params": {"model": "mock", "backend": "mock"},
+        "inputs": [{
+            "variables": {"doc_path": f"/docs/{session_id}.txt"},
+            "prompt": f"Summarize {session_id}",
+            "status": "ok",
+            "output": output,
+            "latency": 0.01
+        }],
+        "log_policy": policy
+    }
+
+class SessionLogTest(unittest.TestCase):
+    """
+    Sessions written at byte offsets must match what the session index says about them.
+    """
+    
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.log_file = os.path.join(self.directory, "logs", "tests.xml")
+        self.index_file = os.path.join(self.directory, "index.jsonl")
+        self.index = tpt.get_session_index(self.index_file)
+        self.policy = {"index_file": self.index_file}
+    
+    def tearDown(self):
+        shutil.rmtree(self.directory, ignore_errors=True)
+    
+    def assert_index_matches(self, log_file: str):
+        """
+        Re-parse a log file and check every session against its index entry.
+        """
+        opener = gzip.open if log_file.endswith(".gz") else open
+        with opener(log_file, "rb") as f:
+            data = f.read()
+        parsed_ids = [session.get("id") for session in ET.fromstring(data).findall("session")]
+        offsets = tpt.session_offsets(data)
+        entries = {entry["session_id"]: entry for entry in self.index.sessions(log_file)}
+        
+        self.assertEqual(sorted(parsed_ids), sorted(entries))
+        self.assertEqual(len(parsed_ids), len(set(parsed_ids)), "a session is logged twice")
+        for session_id, entry in entries.items():
+            self.assertEqual((entry["offset"], entry["length"]), offsets[session_id])
+            self.assertEqual(entry["compressed"], log_file.endswith(".gz"))
+            self.assertEqual(tpt.read_indexed_session(entry).get("id"), session_id)
+    
+    def output_of(self, session_id: str) -> str:
+        return tpt.read_indexed_session(self.index.find(session_id)).findtext("input1/output")
+    
+    def test_append_records_offsets(self):
+        for session_id in ("a", "b", "c"):
+            tpt.log_session(self.log_file, make_session(session_id, f"output {session_id}", self.policy))
+        
+        with open(self.log_file, "rb") as f:
+            data = f.read()
+        self.assertTrue(data.startswith(tpt.LOG_HEADER))
+        self.assertTrue(data.endswith(tpt.LOG_FOOTER))
+        self.assertEqual(self.index.find("a")["offset"], len(tpt.LOG_HEADER))
+        self.assert_index_matches(self.log_file)
+        self.assertEqual(self.output_of("b"), "output b")
+    
+    def test_replace_last_in_place_and_rewrite_earlier(self):
+        first = make_session("first", "short", self.policy)
+        last = make_session("last", "short", self.policy)
+        tpt.log_session(self.log_file, first)
+        tpt.log_session(self.log_file, last)
+        first_offset = self.index.find("first")["offset"]
+        
+        # The last session is replaced where it is
+        last["inputs"][0]["output"] = "a much longer output than before"
+        tpt.log_session(self.log_file, last)
+        self.assertEqual(self.index.find("first")["offset"], first_offset)
+        self.assert_index_matches(self.log_file)
+        self.assertEqual(self.output_of("last"), "a much longer output than before")
+        
+        # An earlier session cannot be replaced in place, so the file is rewritten
+        session = tpt.session_element(self.log_file, first)
+        self.assertIsNone(tpt.write_session_at(self.log_file, tpt.session_bytes(session), self.index.find("first")))
+        first["inputs"][0]["output"] = "updated first output"
+        tpt.log_session(self.log_file, first)
+        self.assert_index_matches(self.log_file)
+        self.assertEqual(self.output_of("first"), "updated first output")
+        self.assertEqual(self.output_of("last"), "a much longer output than before")
+    
+    def test_update_session_in_gzipped_rotated_log(self):
+        policy = dict(self.policy, max_mb=1e-9, compress=True)
+        rotated = make_session("rotated", "before rotation", policy)
+        tpt.log_session(self.log_file, rotated)
+        tpt.log_session(self.log_file, make_session("current", "after rotation", policy))
+        compressed_file = self.index.find("rotated")["file"]
+        self.assertTrue(compressed_file.endswith(".xml.gz"))
+        
+        rotated["inputs"][0]["output"] = "updated after rotation"
+        tpt.log_session(self.log_file, rotated)
+        self.assertEqual(self.index.find("rotated")["file"], compressed_file)
+        self.assert_index_matches(compressed_file)
+        self.assert_index_matches(self.log_file)
+        self.assertEqual(self.output_of("rotated"), "updated after rotation")
+        self.assertFalse(os.path.exists(compressed_file.removesuffix(".gz")))
+
+if __name__ == "__main__":
+    unittest.main()
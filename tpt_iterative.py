@@ -1,14 +1,360 @@
 import streamlit as st
 import os
 import re
+import csv
 import json
+import math
+import sys
+import hashlib
+import time
 import datetime
+import threading
+import tracemalloc
+import contextlib
+import heapq
+import itertools
+import uuid
+import random
+import gzip
+import html
+import shutil
+import queue
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+from collections import Counter, deque
+from concurrent.futures import ThreadPoolExecutor, wait, FIRST_COMPLETED
 import xml.dom.minidom as md
 import xml.etree.ElementTree as ET
 from typing import Dict, List, Any, Tuple, Optional, Union
 import anthropic
+import httpx
 from pathlib import Path
 
+def split_top_level(text: str, separator: str = ',') -> List[str]:
+    """
+    Split a string on a separator, ignoring separators inside brackets or quotes.
+    
+    A quote only starts a quoted string at the start of a value (after the
+    separator, "=", ":" or an opening bracket), so apostrophes inside
+    unquoted text such as it's are taken literally.
+
+    Args:
+        text: The string to split
+        separator: Single character to split on
+    
+    Returns:
+        List of the parts, stripped of surrounding whitespace (empty parts are dropped)
+    """
+    parts = []
+    current = []
+    depth = 0
+    quote = None
+    previous = None
+    for char in text:
+        if quote:
+            if char == quote:
+                quote = None
+        elif char in ('"', "'") and (previous is None or previous in '=:([{' + separator):
+            quote = char
+        elif char in '([{':
+            depth += 1
+        elif char in ')]}':
+            depth = max(depth - 1, 0)
+        elif char == separator and depth == 0:
+            parts.append(''.join(current).strip())
+            current = []
+            previous = None
+            continue
+        current.append(char)
+        if not char.isspace():
+            previous = char
+    parts.append(''.join(current).strip())
+    return [part for part in parts if part]
+
+def strip_quotes(value: str) -> str:
+    """
+    Remove one pair of matching surrounding quotes, if present.
+    """
+    if len(value) >= 2 and value[0] == value[-1] and value[0] in ('"', "'"):
+        return value[1:-1]
+    return value
+
+def parse_special_args(arg_string: str) -> Tuple[List[str], Dict[str, Any]]:
+    """
+    Parse the arguments of a special variable such as $$dir(path, recursive=True).
+    
+    Args:
+        arg_string: The text between the parentheses
+    
+    Returns:
+        Tuple of positional arguments (as strings) and keyword arguments. Keyword
+        values are parsed as JSON where possible, with True/False accepted as booleans.
+    """
+    positional = []
+    keywords = {}
+    for arg in split_top_level(arg_string):
+        keyword_match = re.match(r'^([a-zA-Z_][a-zA-Z0-9_]*)\s*=\s*(.*)$', arg, re.DOTALL)
+        if keyword_match:
+            raw_value = keyword_match.group(2).strip()
+            if raw_value in ('True', 'False'):
+                value = raw_value == 'True'
+            else:
+                try:
+                    value = json.loads(raw_value)
+                except json.JSONDecodeError:
+                    value = strip_quotes(raw_value)
+            keywords[keyword_match.group(1)] = value
+        else:
+            positional.append(strip_quotes(arg))
+    return positional, keywords
+
+# Comment syntax per file extension: (line comment markers, block comment delimiters, string quotes)
+C_STYLE_COMMENTS = (('//',), (('/*', '*/'),), ('"', "'", '`'))
+HASH_COMMENTS = (('#',), (), ('"', "'"))
+COMMENT_SYNTAX = {
+    **{ext: C_STYLE_COMMENTS for ext in ('.c', '.h', '.cc', '.cpp', '.cxx', '.hpp', '.hh', '.java', '.js', '.jsx',
+                                         '.mjs', '.ts', '.tsx', '.go', '.swift', '.kt', '.kts', '.cs', '.scala',
+                                         '.php', '.dart', '.m', '.mm', '.proto')},
+    # Rust lifetimes ('a) look like unterminated character literals, so only track double quotes
+    '.rs': (('//',), (('/*', '*/'),), ('"',)),
+    '.css': ((), (('/*', '*/'),), ('"', "'")),
+    **{ext: HASH_COMMENTS for ext in ('.py', '.pyi', '.sh', '.bash', '.zsh', '.rb', '.pl', '.r', '.yaml', '.yml',
+                                      '.toml', '.cfg', '.conf', '.cmake', '.mk', '.dockerfile')},
+    '.ini': (('#', ';'), (), ('"', "'")),
+    **{ext: (('--',), (), ('"', "'")) for ext in ('.sql', '.lua', '.hs')},
+    **{ext: ((), (('<!--', '-->'),), ()) for ext in ('.html', '.htm', '.xml', '.xhtml', '.svg', '.vue')}
+}
+COMMENT_SYNTAX_BY_NAME = {'makefile': HASH_COMMENTS, 'dockerfile': HASH_COMMENTS, 'cmakelists.txt': HASH_COMMENTS}
+
+LICENSE_MARKERS = ('copyright', 'license', 'licence', 'spdx-license-identifier', 'permission is hereby granted',
+                   'all rights reserved')
+
+def parse_preprocess_options(params: Dict[str, Any]) -> Dict[str, Any]:
+    """
+    Pick the input preprocessing options out of a special variable's keyword arguments.
+    
+    Args:
+        params: Keyword arguments of $$file(...) or $$dir(...)
+    
+    Returns:
+        Dictionary of enabled preprocessing options (empty if none)
+    """
+    options = {}
+    for name in ('strip_comments', 'collapse_whitespace', 'drop_license'):
+        if params.get(name):
+            options[name] = True
+    if params.get('max_lines'):
+        options['max_lines'] = int(params['max_lines'])
+    return options
+
+def comment_syntax_for(path: str) -> Optional[Tuple]:
+    """
+    Look up the comment syntax for a file based on its name or extension.
+    """
+    name = os.path.basename(path).lower()
+    if name in COMMENT_SYNTAX_BY_NAME:
+        return COMMENT_SYNTAX_BY_NAME[name]
+    return COMMENT_SYNTAX.get(os.path.splitext(name)[1])
+
+def strip_comments(text: str, syntax: Tuple) -> str:
+    """
+    Remove comments from source code, leaving string literals untouched.
+    
+    Lines that only contained a comment are removed entirely.
+    
+    Args:
+        text: Source code
+        syntax: (line comment markers, block comment delimiters, string quotes)
+    
+    Returns:
+        Source code without comments
+    """
+    line_markers, block_markers, quotes = syntax
+    out = []
+    comment_lines = set()  # Output line numbers where a comment was removed
+    i = 0
+    length = len(text)
+    line = 0
+    while i < length:
+        char = text[i]
+        # String literals (Python-style triple quotes may span lines)
+        if char in quotes:
+            delimiter = text[i:i + 3] if text[i:i + 3] == char * 3 else char
+            end = i + len(delimiter)
+            while end < length:
+                if text[end] == '\\':
+                    end += 2
+                    continue
+                if text.startswith(delimiter, end):
+                    end += len(delimiter)
+                    break
+                if text[end] == '\n' and len(delimiter) == 1:
+                    break
+                end += 1
+            segment = text[i:end]
+            line += segment.count('\n')
+            out.append(segment)
+            i = end
+            continue
+        # Line comments run to the end of the line
+        marker = next((m for m in line_markers if text.startswith(m, i)), None)
+        if marker:
+            end = text.find('\n', i)
+            i = length if end == -1 else end
+            comment_lines.add(line)
+            continue
+        # Block comments; keep their newlines so line structure survives
+        block = next((b for b in block_markers if text.startswith(b[0], i)), None)
+        if block:
+            end = text.find(block[1], i + len(block[0]))
+            end = length if end == -1 else end + len(block[1])
+            newlines = text.count('\n', i, end)
+            for offset in range(newlines + 1):
+                comment_lines.add(line + offset)
+            out.append('\n' * newlines)
+            line += newlines
+            i = end
+            continue
+        if char == '\n':
+            line += 1
+        out.append(char)
+        i += 1
+    
+    result_lines = ''.join(out).split('\n')
+    return '\n'.join(l for n, l in enumerate(result_lines) if l.strip() or n not in comment_lines)
+
+def drop_license_header(text: str, syntax: Optional[Tuple]) -> str:
+    """
+    Remove a leading comment block that looks like a license or copyright header.
+    
+    Args:
+        text: File content
+        syntax: Comment syntax of the file, or None if unknown (the file is left unchanged)
+    
+    Returns:
+        File content without the license header
+    """
+    if syntax is None:
+        return text
+    line_markers, block_markers, _ = syntax
+    
+    lines = text.split('\n')
+    start = 0
+    # Keep shebang and encoding lines
+    while start < len(lines) and (lines[start].startswith('#!') or re.match(r'^#.*coding[:=]', lines[start])):
+        start += 1
+    
+    end = start
+    first_line = lines[start].lstrip() if start < len(lines) else ''
+    block = next((b for b in block_markers if first_line.startswith(b[0])), None)
+    if block:
+        # The header is everything up to the line closing the block comment
+        remainder = first_line[len(block[0]):]
+        while end < len(lines) and block[1] not in (remainder if end == start else lines[end]):
+            end += 1
+        end += 1
+    else:
+        # The header is the run of comment (and blank) lines at the top
+        while end < len(lines) and (not lines[end].strip() or
+                                    any(lines[end].lstrip().startswith(m) for m in line_markers)):
+            end += 1
+
+    header = '\n'.join(lines[start:end]).lower()
+    if end > start and any(marker in header for marker in LICENSE_MARKERS):
+        # Also drop blank lines left after the header
+        while end < len(lines) and not lines[end].strip():
+            end += 1
+        return '\n'.join(lines[:start] + lines[end:])
+    return text
+
+def collapse_whitespace(text: str) -> str:
+    """
+    Remove trailing whitespace and collapse runs of blank lines into one.
+    
+    Indentation is kept, since it is significant in some languages.
+    """
+    lines = []
+    for line in text.split('\n'):
+        line = line.rstrip()
+        if line or (lines and lines[-1]):
+            lines.append(line)
+    while lines and not lines[-1]:
+        lines.pop()
+    return '\n'.join(lines)
+
+def estimate_tokens(text: str) -> int:
+    """
+    Roughly estimate the number of tokens in a text (about 4 characters per token).
+    """
+    return (len(text) + 3) // 4
+
+def preprocess_content(content: str, path: str, options: Dict[str, Any]) -> str:
+    """
+    Apply a variable's preprocessing options to the content of one file.
+    
+    Args:
+        content: File content
+        path: File path, used to pick the comment syntax
+        options: Enabled options (strip_comments, collapse_whitespace, drop_license, max_lines)
+    
+    Returns:
+        The preprocessed content
+    """
+    syntax = comment_syntax_for(path)
+    if options.get('drop_license'):
+        content = drop_license_header(content, syntax)
+    if options.get('strip_comments') and syntax:
+        content = strip_comments(content, syntax)
+    if options.get('collapse_whitespace'):
+        content = collapse_whitespace(content)
+    if options.get('max_lines'):
+        lines = content.split('\n')
+        if len(lines) > options['max_lines']:
+            content = '\n'.join(lines[:options['max_lines']]) + \
+                f"\n... [truncated {len(lines) - options['max_lines']} more lines]"
+    return content
+
+def read_input_file(path: str, var_name: str, options: Optional[Dict[str, Any]],
+                    preprocess_stats: Optional[Dict[str, Any]]) -> str:
+    """
+    Read a $$file/$$dir input, applying its preprocessing options.
+    
+    Args:
+        path: File to read
+        var_name: Variable the file belongs to
+        options: Preprocessing options, or None
+        preprocess_stats: Per-variable savings, keyed by variable then path; updated in place
+    
+    Returns:
+        The (preprocessed) file content
+    """
+    with open(path, 'r') as file:
+        content = file.read()
+    if not options:
+        return content
+    
+    processed = preprocess_content(content, path, options)
+    if preprocess_stats is not None:
+        preprocess_stats.setdefault(var_name, {})[path] = (estimate_tokens(content), estimate_tokens(processed))
+    return processed
+
+def summarize_preprocessing(preprocess_stats: Dict[str, Any]) -> Dict[str, Dict[str, int]]:
+    """
+    Summarize the estimated token savings of input preprocessing per variable.
+    
+    Args:
+        preprocess_stats: Per-variable savings collected by read_input_file()
+    
+    Returns:
+        Variable name -> files, tokens before, tokens after and tokens saved
+    """
+    summary = {}
+    for var_name, files in preprocess_stats.items():
+        before = sum(tokens[0] for tokens in files.values())
+        after = sum(tokens[1] for tokens in files.values())
+        summary[var_name] = {"files": len(files), "tokens_before": before, "tokens_after": after,
+                             "tokens_saved": before - after}
+    return summary
+
 def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
     """
     Parse variable definitions from the input string.
@@ -21,34 +367,40 @@ def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
         A dictionary mapping variable names to their values or special handlers
     """
     variables = {}
-    # Match variable definitions using regex
-    pattern = r'([a-zA-Z_][a-zA-Z0-9_]*)\s*=\s*([^,]+)(?:,|$)'
-    matches = re.finditer(pattern, var_definitions)
-    
-    for match in matches:
+    # Split on top-level commas so commas inside $$list([...]) or quotes are kept
+    for definition in split_top_level(var_definitions):
+        match = re.match(r'^([a-zA-Z_][a-zA-Z0-9_]*)\s*=\s*(.*)$', definition, re.DOTALL)
+        if not match:
+            continue
         var_name = match.group(1).strip()
         var_value = match.group(2).strip()
         
         # Handle special variable definitions with $$
         if var_value.startswith('$$'):
             if var_value.startswith('$$file(') and var_value.endswith(')'):
-                # Extract file path
-                file_path = var_value[7:-1].strip()
+                # Extract file path and preprocessing options
+                args, params = parse_special_args(var_value[7:-1])
+                file_path = args[0] if args else ''
                 variables[var_name] = {'type': 'file', 'path': file_path}
-            
+                preprocess = parse_preprocess_options(params)
+                if preprocess:
+                    variables[var_name]['preprocess'] = preprocess
+                if params.get('chunk_tokens'):
+                    variables[var_name]['chunk_tokens'] = int(params['chunk_tokens'])
+
             elif var_value.startswith('$$dir(') and var_value.endswith(')'):
                 # Extract directory path and check for recursive flag
-                dir_content = var_value[6:-1].strip()
-                if ',' in dir_content:
-                    dir_path, params = dir_content.split(',', 1)
-                    dir_path = dir_path.strip()
-                    recursive = 'recursive=True' in params
-                else:
-                    dir_path = dir_content
-                    recursive = False
+                args, params = parse_special_args(var_value[6:-1])
+                dir_path = args[0] if args else ''
+                recursive = bool(params.get('recursive', False))
                 
                 variables[var_name] = {'type': 'dir', 'path': dir_path, 'recursive': recursive}
-            
+                preprocess = parse_preprocess_options(params)
+                if preprocess:
+                    variables[var_name]['preprocess'] = preprocess
+                if params.get('chunk_tokens'):
+                    variables[var_name]['chunk_tokens'] = int(params['chunk_tokens'])
+
             elif var_value.startswith('$$list(') and var_value.endswith(')'):
                 # Extract list elements
                 list_content = var_value[7:-1].strip()
@@ -63,28 +415,153 @@ def parse_variable_definitions(var_definitions: str) -> Dict[str, Any]:
                     list_elements = [elem.strip() for elem in list_content.split(',')]
                 
                 variables[var_name] = {'type': 'list', 'elements': list_elements}
+            
+            elif var_value.startswith('$$lines(') and var_value.endswith(')'):
+                # One value per line of a file, streamed
+                args, params = parse_special_args(var_value[8:-1])
+                variables[var_name] = {
+                    'type': 'lines',
+                    'path': args[0] if args else '',
+                    'skip_blank': bool(params.get('skip_blank', True))
+                }
+            
+            elif var_value.startswith('$$jsonl(') and var_value.endswith(')'):
+                # One record per line of a JSONL file, streamed
+                args, params = parse_special_args(var_value[8:-1])
+                variables[var_name] = {
+                    'type': 'jsonl',
+                    'path': args[0] if args else '',
+                    'columns': params.get('columns')
+                }
+            
+            elif var_value.startswith('$$csv(') and var_value.endswith(')'):
+                # One record per row of a CSV file with a header row, streamed
+                args, params = parse_special_args(var_value[6:-1])
+                variables[var_name] = {
+                    'type': 'csv',
+                    'path': args[0] if args else '',
+                    'columns': params.get('columns'),
+                    'delimiter': str(params.get('delimiter', ','))
+                }
         else:
             # Handle regular variable definitions (strip quotes if present)
-            if (var_value.startswith('"') and var_value.endswith('"')) or \
-               (var_value.startswith("'") and var_value.endswith("'")):
-                var_value = var_value[1:-1]
-            
-            variables[var_name] = var_value
+            variables[var_name] = strip_quotes(var_value)
     
     return variables
 
-def expand_variables(variables: Dict[str, Any]) -> List[Dict[str, str]]:
+def list_dir_files(base_path: str, recursive: bool) -> List[str]:
     """
-    Expand iterative variables into all possible combinations.
+    List the files of a $$dir variable.
     
     Args:
-        variables: Dictionary of parsed variables
+        base_path: Directory to list
+        recursive: Whether to descend into subdirectories
     
     Returns:
-        List of dictionaries, each containing a specific combination of variable values
+        List of file paths
+    """
+    file_paths = []
+    if recursive:
+        # Recursively walk through directories
+        for root, _, files in os.walk(base_path):
+            for file in files:
+                file_paths.append(os.path.join(root, file))
+    else:
+        # Only files in the top directory
+        if os.path.exists(base_path) and os.path.isdir(base_path):
+            file_paths = [os.path.join(base_path, f) for f in os.listdir(base_path) 
+                         if os.path.isfile(os.path.join(base_path, f))]
+    return file_paths
+
+def record_values(var_name: str, record: Dict[str, Any], columns: Optional[List[str]]) -> Dict[str, str]:
+    """
+    Map a JSONL/CSV record to template variables.
+    
+    The variable itself holds the selected columns as JSON, and each selected
+    column is also available as {{var_name.column}}.
+    
+    Args:
+        var_name: Name of the record variable
+        record: The parsed record
+        columns: Columns to select, or None for all columns
+    
+    Returns:
+        Dictionary of template variable names to values
+    """
+    if columns is None:
+        columns = list(record.keys())
+    selected = {column: record.get(column, "") for column in columns}
+    values = {var_name: json.dumps(selected, ensure_ascii=False)}
+    for column, value in selected.items():
+        values[f"{var_name}.{column}"] = value if isinstance(value, str) else json.dumps(value, ensure_ascii=False)
+    return values
+
+def iter_lines(var_name: str, var_value: Dict[str, Any]):
+    """
+    Stream the values of a $$lines variable.
+    """
+    with open(var_value['path'], 'r') as file:
+        for line_number, line in enumerate(file, 1):
+            line = line.rstrip('\r\n')
+            if var_value['skip_blank'] and not line.strip():
+                continue
+            yield {var_name: line, f"{var_name}_path": f"{var_value['path']}:{line_number}"}
+
+def iter_jsonl(var_name: str, var_value: Dict[str, Any]):
+    """
+    Stream the records of a $$jsonl variable. Lines that are not JSON objects are skipped.
+    """
+    with open(var_value['path'], 'r') as file:
+        for line_number, line in enumerate(file, 1):
+            if not line.strip():
+                continue
+            try:
+                record = json.loads(line)
+            except json.JSONDecodeError:
+                continue
+            if not isinstance(record, dict):
+                continue
+            values = record_values(var_name, record, var_value['columns'])
+            values[f"{var_name}_path"] = f"{var_value['path']}:{line_number}"
+            yield values
+
+def iter_csv(var_name: str, var_value: Dict[str, Any]):
+    """
+    Stream the rows of a $$csv variable, using the first row as the header.
+    """
+    with open(var_value['path'], 'r', newline='') as file:
+        reader = csv.DictReader(file, delimiter=var_value['delimiter'])
+        for row in reader:
+            values = record_values(var_name, row, var_value['columns'])
+            values[f"{var_name}_path"] = f"{var_value['path']}:{reader.line_num}"
+            yield values
+
+def iter_combinations(variables: Dict[str, Any], preprocess_stats: Optional[Dict[str, Any]] = None,
+                      notices: Optional[List[Tuple[str, str]]] = None):
     """
-    # First, collect all iterative variables and their values
-    iterative_vars = {}
+    Lazily generate all combinations of iterative variables.
+    
+    File-backed sources ($$dir, $$lines, $$jsonl, $$csv) are re-read for each
+    pass instead of being loaded up front, so memory use does not grow with
+    the size of the inputs.
+    
+    Args:
+        variables: Dictionary of parsed variables
+        preprocess_stats: Optional dictionary collecting the token savings of input preprocessing
+        notices: Optional list collecting ("warning" or "error", message) tuples instead of
+                 showing them on the page; for iterating off the script thread
+    
+    Yields:
+        Dictionaries, each containing a specific combination of variable values
+    """
+    def report(level: str, message: str):
+        if notices is None:
+            getattr(st, level)(message)
+        else:
+            notices.append((level, message))
+
+    # First, collect all iterative variables as factories returning fresh iterators
+    iterative_vars = []
     fixed_vars = {}
     
     for var_name, var_value in variables.items():
@@ -92,71 +569,78 @@ def expand_variables(variables: Dict[str, Any]) -> List[Dict[str, str]]:
             if var_value['type'] == 'file':
                 # Single file - read content
                 try:
-                    with open(var_value['path'], 'r') as file:
-                        fixed_vars[var_name] = file.read()
+                    fixed_vars[var_name] = read_input_file(var_value['path'], var_name,
+                                                           var_value.get('preprocess'), preprocess_stats)
                 except Exception as e:
-                    st.error(f"Error reading file {var_value['path']}: {e}")
+                    report("error", f"Error reading file {var_value['path']}: {e}")
                     fixed_vars[var_name] = f"ERROR: Could not read file {var_value['path']}"
             
             elif var_value['type'] == 'dir':
-                # Directory of files - iterative
-                file_paths = []
-                base_path = var_value['path']
+                # Directory of files - iterative, contents read as they are used
+                file_paths = list_dir_files(var_value['path'], var_value['recursive'])
                 
-                if var_value['recursive']:
-                    # Recursively walk through directories
-                    for root, _, files in os.walk(base_path):
-                        for file in files:
-                            file_paths.append(os.path.join(root, file))
+                if file_paths:
+                    skipped = set()  # Warn about unreadable files only once
+                    def iter_dir(var_name=var_name, file_paths=file_paths, skipped=skipped,
+                                 options=var_value.get('preprocess')):
+                        for path in file_paths:
+                            try:
+                                content = read_input_file(path, var_name, options, preprocess_stats)
+                            except Exception as e:
+                                if path not in skipped:
+                                    skipped.add(path)
+                                    report("warning", f"Skipping file {path}: {e}")
+                                continue
+                            yield {var_name: content, f"{var_name}_path": path}
+                    iterative_vars.append(iter_dir)
                 else:
-                    # Only files in the top directory
-                    if os.path.exists(base_path) and os.path.isdir(base_path):
-                        file_paths = [os.path.join(base_path, f) for f in os.listdir(base_path) 
-                                     if os.path.isfile(os.path.join(base_path, f))]
-                
-                # Read content of each file
-                file_contents = []
-                file_path_display = []  # Keep track of file paths for display
-                for path in file_paths:
-                    try:
-                        with open(path, 'r') as file:
-                            file_contents.append(file.read())
-                            file_path_display.append(path)
-                    except Exception as e:
-                        st.warning(f"Skipping file {path}: {e}")
-                
-                if file_contents:
-                    iterative_vars[var_name] = {"values": file_contents, "paths": file_path_display}
-                else:
-                    st.warning(f"No readable files found in directory: {base_path}")
-                    fixed_vars[var_name] = f"No files found in {base_path}"
+                    report("warning", f"No readable files found in directory: {var_value['path']}")
+                    fixed_vars[var_name] = f"No files found in {var_value['path']}"
             
             elif var_value['type'] == 'list':
                 # List of elements - iterative
-                iterative_vars[var_name] = {"values": var_value['elements'], "paths": var_value['elements']}
+                def iter_list(var_name=var_name, elements=var_value['elements']):
+                    for element in elements:
+                        yield {var_name: element, f"{var_name}_path": element}
+                iterative_vars.append(iter_list)
+            
+            elif var_value['type'] in ('lines', 'jsonl', 'csv'):
+                # Line/record sources - iterative, streamed from the file
+                if os.path.isfile(var_value['path']):
+                    source = {'lines': iter_lines, 'jsonl': iter_jsonl, 'csv': iter_csv}[var_value['type']]
+                    iterative_vars.append(lambda var_name=var_name, var_value=var_value, source=source:
+                                          source(var_name, var_value))
+                else:
+                    report("error", f"Error reading file {var_value['path']}: file not found")
+                    fixed_vars[var_name] = f"ERROR: Could not read file {var_value['path']}"
         else:
             # Regular variable - fixed
             fixed_vars[var_name] = var_value
     
-    # Generate all combinations of iterative variables
-    combinations = [{}]
+    # Generate the cartesian product, first variable varying slowest
+    def product(index: int, combo: Dict[str, Any]):
+        if index == len(iterative_vars):
+            result = combo.copy()
+            # Add fixed variables to every combination
+            result.update(fixed_vars)
+            yield result
+            return
+        for values in iterative_vars[index]():
+            yield from product(index + 1, {**combo, **values})
     
-    for var_name, var_data in iterative_vars.items():
-        new_combinations = []
-        for combo in combinations:
-            for i, value in enumerate(var_data["values"]):
-                new_combo = combo.copy()
-                new_combo[var_name] = value
-                new_combo[f"{var_name}_path"] = var_data["paths"][i]
-                new_combinations.append(new_combo)
-        combinations = new_combinations
+    yield from product(0, {})
+
+def expand_variables(variables: Dict[str, Any]) -> List[Dict[str, str]]:
+    """
+    Expand iterative variables into all possible combinations.
     
-    # Add fixed variables to all combinations
-    for combo in combinations:
-        for var_name, value in fixed_vars.items():
-            combo[var_name] = value
+    Args:
+        variables: Dictionary of parsed variables
     
-    return combinations
+    Returns:
+        List of dictionaries, each containing a specific combination of variable values
+    """
+    return list(iter_combinations(variables))
 
 def render_template(template: str, variables: Dict[str, str]) -> str:
     """
@@ -183,22 +667,343 @@ def render_template(template: str, variables: Dict[str, str]) -> str:
     
     return result
 
-def call_llm(prompt: str, llm_params: Dict[str, Any]) -> str:
+# Fixture files loaded for replay, keyed by path. Streamlit re-executes the script on
+# every run, so each session replays recordings from the beginning.
+_fixture_lock = threading.Lock()
+_replay_fixtures = {}
+
+def fixture_key(prompt: str, llm_params: Dict[str, Any]) -> str:
     """
-    Call the LLM with the given prompt and parameters.
+    Compute the key identifying a request in a fixture file.
+    
+    Args:
+        prompt: The prompt sent to the LLM
+        llm_params: Dictionary of LLM parameters
+    
+    Returns:
+        Hex digest of the request parameters that affect the response
+    """
+    request = {
+        "model": llm_params.get("model", "claude-3-7-sonnet-latest"),
+        "max_tokens": llm_params.get("max_tokens", 1024),
+        "temperature": llm_params.get("temperature", 0.7),
+        "top_p": llm_params.get("top_p", 1.0),
+        "system": llm_params.get("system_prompt", ""),
+        "prompt": prompt
+    }
+    return hashlib.sha256(json.dumps(request, sort_keys=True).encode("utf-8")).hexdigest()
+
+def record_llm_call(prompt: str, llm_params: Dict[str, Any], response: str, latency: float, error: bool = False,
+                    error_type: Optional[str] = None):
+    """
+    Append a request/response pair to the fixture file.
+    
+    Args:
+        prompt: The prompt sent to the LLM
+        llm_params: Dictionary of LLM parameters, including fixture_path
+        response: The response text (or error message)
+        latency: Seconds the call took
+        error: Whether the call failed
+        error_type: Category of the failure (see classify_error())
+    """
+    fixture_path = os.path.expanduser(llm_params["fixture_path"])
+    entry = {
+        "key": fixture_key(prompt, llm_params),
+        "model": llm_params.get("model", "claude-3-7-sonnet-latest"),
+        "prompt": prompt,
+        "response": response,
+        "error": error,
+        "error_type": error_type,
+        "latency": latency,
+        "recorded_at": datetime.datetime.now().isoformat()
+    }
+    with _fixture_lock:
+        os.makedirs(os.path.dirname(fixture_path) or ".", exist_ok=True)
+        with open(fixture_path, "a", encoding="utf-8") as f:
+            f.write(json.dumps(entry) + "\n")
+
+def load_fixtures(fixture_path: str) -> Dict[str, Any]:
+    """
+    Load a fixture file for replay, grouping recordings by request key.
+    
+    Args:
+        fixture_path: Path to the JSONL fixture file
+    
+    Returns:
+        Dictionary with the recordings per key and how many times each key was served
+    """
+    fixture_path = os.path.expanduser(fixture_path)
+    with _fixture_lock:
+        if fixture_path not in _replay_fixtures:
+            entries = {}
+            with open(fixture_path, "r", encoding="utf-8") as f:
+                for line in f:
+                    if line.strip():
+                        entry = json.loads(line)
+                        entries.setdefault(entry["key"], []).append(entry)
+            _replay_fixtures[fixture_path] = {"entries": entries, "served": Counter()}
+        return _replay_fixtures[fixture_path]
+
+class OutputSink:
+    """
+    Collects a response as it streams in, spilling it to a file once it gets large.
+    
+    Until the response exceeds the threshold it is kept in memory. After that
+    the text so far and every further chunk are written to a new file in
+    spill_dir, and only a preview of the beginning stays in memory.
+    """
+    
+    # Characters of a spilled output kept in memory for display and the log
+    PREVIEW_CHARS = 2000
+    
+    def __init__(self, spill_dir: Optional[str] = None, threshold: int = 0):
+        """
+        Args:
+            spill_dir: Directory for spilled outputs, or None to keep everything in memory
+            threshold: Output size in characters above which the output is spilled (0 disables)
+        """
+        self.spill_dir = spill_dir
+        self.threshold = threshold
+        self.chunks = []
+        self.chars = 0
+        self.file = None
+        self.path = None
+    
+    def write(self, text: str):
+        """
+        Append a chunk of the response.
+        """
+        self.chars += len(text)
+        if self.file is not None:
+            self.file.write(text)
+            return
+        self.chunks.append(text)
+        if self.spill_dir and self.threshold and self.chars > self.threshold:
+            os.makedirs(self.spill_dir, exist_ok=True)
+            self.path = os.path.join(self.spill_dir, f"{uuid.uuid4().hex}.txt")
+            self.file = open(self.path, "w", encoding="utf-8")
+            text_so_far = "".join(self.chunks)
+            self.file.write(text_so_far)
+            self.chunks = [text_so_far[:self.PREVIEW_CHARS]]
+    
+    def discard(self):
+        """
+        Drop the collected output, deleting its spill file if there is one.
+        """
+        if self.file is not None:
+            self.file.close()
+            self.file = None
+            try:
+                os.remove(self.path)
+            except OSError:
+                pass
+        self.chunks = []
+    
+    def close(self) -> Dict[str, Any]:
+        """
+        Finish the output.
+        
+        Returns:
+            Dictionary with "output" (the full text, or a preview if spilled),
+            "output_file" (path of the spilled output, or None) and "output_chars"
+        """
+        if self.file is not None:
+            self.file.close()
+            self.file = None
+        return {"output": "".join(self.chunks), "output_file": self.path, "output_chars": self.chars}
+
+def read_output(input_data: Dict[str, Any]) -> str:
+    """
+    Return the full output of a result or input record, reading it back from its spill file if needed.
+    """
+    if input_data.get("output_file"):
+        with open(input_data["output_file"], "r", encoding="utf-8") as f:
+            return f.read()
+    return input_data["output"]
+
+def remove_output_file(input_data: Dict[str, Any]):
+    """
+    Delete the spill file of a result or input record that is no longer used.
+    """
+    if input_data.get("output_file"):
+        try:
+            os.remove(input_data["output_file"])
+        except OSError:
+            pass
+
+def spill_sink(llm_params: Dict[str, Any]) -> OutputSink:
+    """
+    Create the OutputSink configured by the "spill_dir" and "spill_threshold" LLM parameters.
+    """
+    return OutputSink(llm_params.get("spill_dir"), llm_params.get("spill_threshold", 0))
+
+def replay_llm_call(prompt: str, llm_params: Dict[str, Any], cancel_event: Optional[threading.Event] = None) -> Dict[str, Any]:
+    """
+    Serve a recorded response for the request instead of calling the API.
+    
+    Identical requests recorded several times are served in recording order,
+    wrapping around once all recordings have been used.
+    
+    Args:
+        prompt: The prompt to send to the LLM
+        llm_params: Dictionary of LLM parameters, including fixture_path and replay_latency
+        cancel_event: Optional event that ends the simulated latency early
+    
+    Returns:
+        Result dictionary as returned by call_llm_detailed(), with "cache" set to
+        "hit" or "miss" once the fixtures are loaded
+    """
+    model = llm_params.get("model", "claude-3-7-sonnet-latest")
+    try:
+        fixtures = load_fixtures(llm_params["fixture_path"])
+    except Exception as e:
+        return {"output": f"Error calling LLM: could not load fixtures: {str(e)}", "error_type": "other", "model": model}
+    
+    key = fixture_key(prompt, llm_params)
+    with _fixture_lock:
+        recordings = fixtures["entries"].get(key)
+        if not recordings:
+            return {"output": f"Error calling LLM: no recorded response for this request in {llm_params['fixture_path']}",
+                    "error_type": "other", "model": model, "cache": "miss"}
+        entry = recordings[fixtures["served"][key] % len(recordings)]
+        fixtures["served"][key] += 1
+    
+    if llm_params.get("replay_latency", False):
+        if cancel_event is not None:
+            if cancel_event.wait(entry.get("latency", 0.0)):
+                return {"output": "Error calling LLM: request cancelled", "error_type": "cancelled", "model": model,
+                        "cache": "hit"}
+        else:
+            time.sleep(entry.get("latency", 0.0))
+    
+    if entry.get("error", False):
+        return {"output": f"Error calling LLM: {entry['response']}", "error_type": entry.get("error_type") or "other",
+                "model": model, "cache": "hit"}
+    sink = spill_sink(llm_params)
+    sink.write(entry["response"])
+    return dict(sink.close(), error_type=None, model=model, cache="hit")
+
+def mock_llm_call(prompt: str, llm_params: Dict[str, Any], cancel_event: Optional[threading.Event] = None) -> Dict[str, Any]:
+    """
+    Produce a synthetic response locally, streamed in chunks like a real call.
+    
+    The response length and duration come from "mock_output_chars" and
+    "mock_latency" (seconds), varied by up to +/-20% per prompt so latencies
+    are not all identical; the variation is derived from the prompt, so
+    repeated runs behave the same.
+    
+    Args:
+        prompt: The prompt to send to the LLM
+        llm_params: Dictionary of LLM parameters, including mock_latency and mock_output_chars
+        cancel_event: Optional event that cancels the call when set
+    
+    Returns:
+        Result dictionary as returned by call_llm_detailed()
+    """
+    model = llm_params.get("model", "claude-3-7-sonnet-latest")
+    jitter = 0.8 + 0.4 * (int(hashlib.sha256(prompt.encode("utf-8")).hexdigest()[:8], 16) / 0xFFFFFFFF)
+    latency = llm_params.get("mock_latency", 1.0) * jitter
+    output_chars = max(int(llm_params.get("mock_output_chars", 2000) * jitter), 1)
+    # Like the API, stop at max_tokens (about 4 characters per token)
+    stop_reason = "end_turn"
+    if output_chars > llm_params.get("max_tokens", 1024) * 4:
+        output_chars = llm_params.get("max_tokens", 1024) * 4
+        stop_reason = "max_tokens"
+    
+    chunk_chars = 100
+    chunk_count = math.ceil(output_chars / chunk_chars)
+    text = ("lorem ipsum dolor sit amet " * (chunk_chars // 27 + 1))[:chunk_chars]
+    sink = spill_sink(llm_params)
+    for chunk in range(chunk_count):
+        if cancel_event is not None:
+            if cancel_event.wait(latency / chunk_count):
+                sink.discard()
+                return {"output": "Error calling LLM: request cancelled", "error_type": "cancelled", "model": model}
+        else:
+            time.sleep(latency / chunk_count)
+        sink.write(text[:min(chunk_chars, output_chars - chunk * chunk_chars)])
+    return dict(sink.close(), error_type=None, model=model, stop_reason=stop_reason)
+
+def classify_error(error: Exception) -> str:
+    """
+    Categorize an exception raised by an API call.
+    
+    Args:
+        error: The exception
+    
+    Returns:
+        One of "timeout", "connection", "rate_limited", "overloaded", "server_error" or "other"
+    """
+    if isinstance(error, anthropic.APITimeoutError):
+        return "timeout"
+    if isinstance(error, anthropic.APIConnectionError):
+        return "connection"
+    if isinstance(error, anthropic.APIStatusError):
+        if error.status_code == 429:
+            return "rate_limited"
+        if error.status_code in (503, 529) or "overloaded" in str(error).lower():
+            return "overloaded"
+        if error.status_code >= 500:
+            return "server_error"
+    elif "overloaded" in str(error).lower():
+        # Overload can also be reported as an error event in the middle of a stream
+        return "overloaded"
+    return "other"
+
+def call_llm_detailed(prompt: str, llm_params: Dict[str, Any],
+                      cancel_event: Optional[threading.Event] = None) -> Dict[str, Any]:
+    """
+    Call the LLM and describe the outcome, including the kind of failure if any.
+    
+    The "backend" parameter selects where the response comes from: "anthropic"
+    (default) calls the API, "record" calls the API and appends the exchange to
+    the fixture file, "replay" serves responses from the fixture file, and
+    "mock" generates synthetic responses locally (see mock_llm_call()).
+    
+    The response is streamed, so a call can be abandoned part-way by setting
+    cancel_event (closing the connection stops generation on the server). A
+    CancelEvent also closes the connection from the cancelling thread, so a
+    call still waiting for its first token is abandoned too.
+    "connect_timeout" and "read_timeout" (seconds; the read timeout applies
+    between streamed chunks) bound how long a call may hang. Responses longer
+    than "spill_threshold" characters are written to a file in "spill_dir" as
+    they arrive (see OutputSink).
     
     Args:
         prompt: The prompt to send to the LLM
         llm_params: Dictionary of LLM parameters (temperature, etc.)
+        cancel_event: Optional event that cancels the call when set
     
     Returns:
-        The LLM's response
+        Dictionary with "output" (the response, or an "Error calling LLM: ..."
+        message), "error_type" (None on success) and "model"; successful results
+        also have "output_file" and "output_chars", and "input_tokens",
+        "output_tokens" and "stop_reason" ("max_tokens" if the output was cut
+        off by the limit) when the backend reports them
     """
+    backend = llm_params.get("backend", "anthropic")
+    if backend == "replay":
+        return replay_llm_call(prompt, llm_params, cancel_event)
+    if backend == "mock":
+        return mock_llm_call(prompt, llm_params, cancel_event)
+
+    model = llm_params.get("model", "claude-3-7-sonnet-latest")
+    start_time = time.perf_counter()
+    sink = spill_sink(llm_params)
     try:
-        client = anthropic.Anthropic(api_key=llm_params.get("api_key", ""))
+        # Retries are up to the caller (failover, circuit breakers, AIMD); the
+        # SDK's own would hide overload errors from them
+        client = anthropic.Anthropic(
+            api_key=llm_params.get("api_key", ""),
+            max_retries=0,
+            timeout=httpx.Timeout(llm_params.get("read_timeout", 600.0),
+                                  connect=llm_params.get("connect_timeout", 10.0))
+        )
+        if isinstance(cancel_event, CancelEvent):
+            cancel_event.add_callback(client.close)
         
-        message = client.messages.create(
-            model=llm_params.get("model", "claude-3-7-sonnet-latest"),
+        with client.messages.stream(
+            model=model,
             max_tokens=llm_params.get("max_tokens", 1024),
             temperature=llm_params.get("temperature", 0.7),
             top_p=llm_params.get("top_p", 1.0),
@@ -206,11 +1011,57 @@ def call_llm(prompt: str, llm_params: Dict[str, Any]) -> str:
             messages=[
                 {"role": "user", "content": prompt}
             ]
-        )
+        ) as stream:
+            if isinstance(cancel_event, CancelEvent):
+                cancel_event.add_callback(stream.close)
+            for text in stream.text_stream:
+                if cancel_event is not None and cancel_event.is_set():
+                    # Leaving the stream context closes the connection
+                    sink.discard()
+                    return {"output": "Error calling LLM: request cancelled", "error_type": "cancelled", "model": model}
+                sink.write(text)
+            final_message = stream.get_final_message()
         
-        return message.content[0].text
+        result = dict(sink.close(), input_tokens=final_message.usage.input_tokens,
+                      output_tokens=final_message.usage.output_tokens, stop_reason=final_message.stop_reason)
+        response = result["output"]
+        error_type = None
     except Exception as e:
-        return f"Error calling LLM: {str(e)}"
+        sink.discard()
+        if cancel_event is not None and cancel_event.is_set():
+            # The connection was closed by the cancelling thread
+            return {"output": "Error calling LLM: request cancelled", "error_type": "cancelled", "model": model}
+        response = str(e)
+        error_type = classify_error(e)
+    
+    if backend == "record":
+        try:
+            if error_type is None:
+                # Fixtures always hold the full response
+                response = read_output(result)
+            record_llm_call(prompt, llm_params, response, time.perf_counter() - start_time,
+                            error=error_type is not None, error_type=error_type)
+        except Exception as e:
+            # A fixture write failure must not hide the actual response
+            print(f"Could not record fixture: {e}", file=sys.stderr)
+    
+    if error_type is not None:
+        return {"output": f"Error calling LLM: {response}", "error_type": error_type, "model": model}
+    return dict(result, error_type=None, model=model)
+
+def call_llm(prompt: str, llm_params: Dict[str, Any], cancel_event: Optional[threading.Event] = None) -> str:
+    """
+    Call the LLM with the given prompt and parameters.
+    
+    Args:
+        prompt: The prompt to send to the LLM
+        llm_params: Dictionary of LLM parameters (temperature, etc.)
+        cancel_event: Optional event that cancels the call when set
+    
+    Returns:
+        The LLM's response
+    """
+    return read_output(call_llm_detailed(prompt, llm_params, cancel_event))
 
 def get_log_filename(base_path: str, append_datetime: bool) -> str:
     """
@@ -221,8 +1072,9 @@ def get_log_filename(base_path: str, append_datetime: bool) -> str:
         append_datetime: Whether to append the current datetime to the filename
         
     Returns:
-        The final log file path
+        The final log file path, with "~" expanded
     """
+    base_path = os.path.expanduser(base_path)
     if not append_datetime:
         return base_path
         
@@ -246,67 +1098,3295 @@ def log_session(log_file: str, session_data: Dict[str, Any]):
     """
     Log the session data to an XML file.
     
+    A new session is written in place before the closing </sessions> tag,
+    so appending does not get slower as the file grows. If session_data has
+    a "session_id" that is already in the file, that session is replaced:
+    in place if it is the last one in the file, else by rewriting the file.
+    session_data is marked as "logged", so later calls know it is an update.
+    
+    With a "log_policy" (see rotate_log()), the file is rotated and old logs
+    are deleted before a new session is appended, and the session is
+    recorded in the policy's session index, which also tells where an
+    updated session is without scanning the file.
+    
     Args:
         log_file: Path to the log file
         session_data: Dictionary containing session information
     """
-    # Create root element for the session
-    timestamp = datetime.datetime.now().strftime("%d%b%Y - %H:%M:%S")
+    policy = session_data.get("log_policy") or {}
+    index = get_session_index(policy["index_file"]) if policy.get("index_file") else None
+    session_id = session_data.get("session_id")
+    os.makedirs(os.path.dirname(log_file), exist_ok=True)
+    updating = session_data.get("logged", False)
+    session_data["logged"] = True
     
-    # Check if the file exists
-    try:
-        if os.path.exists(log_file):
-            # Parse existing file
-            tree = ET.parse(log_file)
-            root = tree.getroot()
+    # Find the earlier record of this session, if it is being updated
+    entry = index.find(session_id) if index is not None and session_id else None
+    if entry is not None and entry["file"] != log_file:
+        if not os.path.exists(entry["file"]):
+            entry = None
+        elif entry.get("compressed"):
+            rewrite_compressed_log(entry, session_data, index)
+            return
         else:
-            # Create new root element
-            root = ET.Element("sessions")
-    except Exception as e:
-        st.warning(f"Error opening log file: {e}. Creating new log.")
-        root = ET.Element("sessions")
+            # The session was rotated out of the current file; update it where it is
+            log_file = entry["file"]
+    exists = entry is not None
+    if entry is None and session_id and os.path.exists(log_file) and (index is None or updating):
+        # Not in the index (or there is none): a byte search of the file is still much cheaper
+        # than parsing it. With an index this only happens if the index lost the session, e.g.
+        # the index file was deleted; new sessions are appended without reading the file.
+        with open(log_file, "rb") as f:
+            exists = re.search(rb'<session [^>]*? id="' + re.escape(session_id.encode("utf-8")) + rb'"',
+                               f.read()) is not None
     
-    # Create session element
-    session = ET.SubElement(root, "session")
-    session.set("datetime", timestamp)
+    if not exists:
+        if policy:
+            rotate_log(log_file, policy, index)
+        session = session_element(log_file, session_data)
+        data = session_bytes(session)
+        try:
+            offset = write_session_at(log_file, data)
+        except ValueError:
+            offset = None
+        if offset is not None:
+            if index is not None and session_id:
+                index.record([index_entry(log_file, session, session_data, offset, len(data))])
+            return
+    elif entry is not None:
+        session = session_element(log_file, session_data, entry.get("datetime"))
+        data = session_bytes(session)
+        try:
+            offset = write_session_at(log_file, data, entry)
+        except ValueError:
+            offset = None
+        if offset is not None:
+            index.record([index_entry(log_file, session, session_data, offset, len(data))])
+            return
+    
+    # Otherwise rewrite the whole file, replacing the earlier record of the session
+    rewrite_log(log_file, session_data, index)
+
+def session_element(log_file: str, session_data: Dict[str, Any], created: Optional[str] = None) -> ET.Element:
+    """
+    Build the <session> element of a session.
+    
+    Args:
+        log_file: Path to the log file (spilled outputs are referenced relative to it)
+        session_data: Dictionary containing session information
+        created: "datetime" of the earlier record if the session is being updated
+    
+    Returns:
+        The <session> element
+    """
+    timestamp = datetime.datetime.now().strftime("%d%b%Y - %H:%M:%S")
+    session_id = session_data.get("session_id")
+    
+    session = ET.Element("session")
+    if created:
+        session.set("datetime", created)
+        session.set("updated", timestamp)
+    else:
+        session.set("datetime", timestamp)
+    if session_id:
+        session.set("id", session_id)
+    
+    # Add session-level metrics
+    if session_data.get("metrics"):
+        metrics_elem = ET.SubElement(session, "metrics")
+        for metric_name, value in session_data["metrics"].items():
+            metric = ET.SubElement(metrics_elem, metric_name)
+            if isinstance(value, list):
+                # Time series are written as one <point> per entry
+                for point in value:
+                    point_elem = ET.SubElement(metric, "point")
+                    for attr_name, attr_value in point.items():
+                        point_elem.set(attr_name, str(attr_value))
+            else:
+                metric.text = str(value)
+
+    # Add the template variants of a template sweep
+    if session_data.get("templates"):
+        templates_elem = ET.SubElement(session, "templates")
+        for template in session_data["templates"]:
+            template_elem = ET.SubElement(templates_elem, "template")
+            template_elem.set("id", template["id"])
+            template_elem.text = template["template"]
+    
+    # Add the templates of a template experiment and how calls were allocated between them
+    if session_data.get("experiment"):
+        experiment = session_data["experiment"]
+        experiment_elem = ET.SubElement(session, "experiment")
+        for attr_name in ("scorer", "confidence", "min_calls", "looks", "stopped_early", "winner"):
+            if experiment.get(attr_name) is not None:
+                experiment_elem.set(attr_name, str(experiment[attr_name]))
+        for template in experiment["templates"]:
+            template_elem = ET.SubElement(experiment_elem, "template")
+            for attr_name, value in template.items():
+                if attr_name != "template" and value is not None:
+                    template_elem.set(attr_name, str(value))
+            template_elem.text = template["template"]
+        allocation_elem = ET.SubElement(experiment_elem, "allocation")
+        for event in experiment["history"]:
+            event_elem = ET.SubElement(allocation_elem, "event")
+            for attr_name, value in event.items():
+                event_elem.set(attr_name, str(value))
+    
+    # Add estimated token savings of input preprocessing
+    if session_data.get("preprocessing"):
+        preprocessing_elem = ET.SubElement(session, "preprocessing")
+        for var_name, stats in session_data["preprocessing"].items():
+            var_elem = ET.SubElement(preprocessing_elem, var_name)
+            for stat_name, value in stats.items():
+                var_elem.set(stat_name, str(value))
+
+    # Add each input
+    for i, input_data in enumerate(session_data["inputs"]):
+        input_elem = ET.SubElement(session, f"input{i+1}")
+        input_elem.set("status", input_data.get("status", "ok"))
+        if input_data.get("error_type"):
+            input_elem.set("error_type", input_data["error_type"])
+        if input_data.get("pack"):
+            # Answered as part of a packed request; the latency is that of the whole pack
+            input_elem.set("pack_id", str(input_data["pack"]["id"]))
+            input_elem.set("pack_size", str(input_data["pack"]["size"]))
+        if input_data.get("template_id"):
+            input_elem.set("template_id", input_data["template_id"])
+        if input_data.get("score") is not None:
+            input_elem.set("score", f"{input_data['score']:.3f}")
+        if input_data.get("output_tokens") is not None:
+            # Token usage reported by the API
+            input_elem.set("input_tokens", str(input_data["input_tokens"]))
+            input_elem.set("output_tokens", str(input_data["output_tokens"]))
+        if input_data.get("template_hash"):
+            # Identifies the template across sessions, for max_tokens sizing
+            input_elem.set("template_hash", input_data["template_hash"])
+        if input_data.get("max_tokens"):
+            input_elem.set("max_tokens", str(input_data["max_tokens"]))
+        if input_data.get("stop_reason"):
+            input_elem.set("stop_reason", input_data["stop_reason"])
+
+        # Add variables
+        vars_elem = ET.SubElement(input_elem, "variables")
+        # Add variable information
+        for var_name, var_value in input_data["variables"].items():
+            if var_name.endswith("_path"):
+                var_elem = ET.SubElement(vars_elem, var_name)
+                var_elem.text = str(var_value)
+        
+        # Add LLM parameters
+        params_elem = ET.SubElement(vars_elem, "llm_parameters")
+        for param_name, param_value in session_data["llm_params"].items():
+            if param_name != "api_key":  # Skip API key for security
+                param = ET.SubElement(params_elem, param_name)
+                param.text = str(param_value)
+        
+        # Add prompt
+        prompt_elem = ET.SubElement(input_elem, "prompt")
+        prompt_elem.text = input_data["prompt"]
+        
+        # Add output (only a preview if it was spilled to a file, referenced relative to the log)
+        output_elem = ET.SubElement(input_elem, "output")
+        output_elem.text = input_data["output"]
+        if input_data.get("output_file"):
+            output_elem.set("file", os.path.relpath(input_data["output_file"], os.path.dirname(log_file)))
+            output_elem.set("chars", str(input_data["output_chars"]))
+        
+        # Add call duration
+        if "latency" in input_data:
+            latency_elem = ET.SubElement(input_elem, "latency")
+            latency_elem.text = f"{input_data['latency']:.3f}"
+        
+        # Add the map and intermediate reduce calls of a map-reduce input
+        if input_data.get("intermediate") is not None:
+            input_elem.set("map_reduce", "true")
+            intermediate_elem = ET.SubElement(input_elem, "intermediate")
+            for call in input_data["intermediate"]:
+                call_elem = ET.SubElement(intermediate_elem, "call")
+                for attr_name in ("stage", "level", "part", "status", "latency"):
+                    call_elem.set(attr_name, str(call[attr_name]))
+                ET.SubElement(call_elem, "prompt").text = call["prompt"]
+                ET.SubElement(call_elem, "output").text = call["output"]
+        
+        # Add the model that answered and any failovers on the way
+        if input_data.get("failovers"):
+            model_elem = ET.SubElement(input_elem, "model")
+            model_elem.text = input_data.get("model", "")
+            failovers_elem = ET.SubElement(input_elem, "failovers")
+            for failover in input_data["failovers"]:
+                failover_elem = ET.SubElement(failovers_elem, "failover")
+                for attr_name, value in failover.items():
+                    failover_elem.set(attr_name, str(value))
+    
+    return session
+
+# Start and end of a log file as written by log_session()
+LOG_HEADER = b'<?xml version="1.0" ?>\n<sessions>\n'
+LOG_FOOTER = b'</sessions>\n'
+
+def session_bytes(session: ET.Element) -> bytes:
+    """
+    Pretty-print a <session> element exactly as it appears inside a log file's <sessions> element.
+    """
+    wrapper = ET.Element("sessions")
+    wrapper.append(session)
+    pretty_xml = md.parseString(ET.tostring(wrapper, encoding="utf-8")).toprettyxml(indent="  ")
+    return pretty_xml.split("<sessions>\n", 1)[1].rsplit("</sessions>", 1)[0].encode("utf-8")
+
+def write_session_at(log_file: str, data: bytes, replace: Optional[Dict[str, Any]] = None) -> Optional[int]:
+    """
+    Write a session into a log file without rewriting the sessions before it.
+    
+    Args:
+        log_file: Path to the log file (created if missing)
+        data: The session from session_bytes()
+        replace: Index entry of the session's earlier record, or None to append
+    
+    Returns:
+        Byte offset the session was written at, or None if the earlier record is not
+        (or no longer) the last session
+    
+    Raises:
+        ValueError: If the file does not end with </sessions>
+    """
+    if not os.path.exists(log_file) or os.path.getsize(log_file) == 0:
+        with open(log_file, "wb") as f:
+            f.write(LOG_HEADER + data + LOG_FOOTER)
+        return len(LOG_HEADER)
+    
+    with open(log_file, "r+b") as f:
+        # The closing tag is near the end; only the tail of the file is read
+        f.seek(0, os.SEEK_END)
+        tail_start = max(f.tell() - 4096, 0)
+        f.seek(tail_start)
+        footer = f.read().rfind(b"</sessions>")
+        if footer < 0:
+            raise ValueError(f"{log_file} does not end with </sessions>")
+        footer += tail_start
+        offset = footer
+        if replace is not None:
+            if replace["offset"] + replace["length"] != footer:
+                return None
+            # Make sure the file was not changed behind the index's back
+            f.seek(replace["offset"])
+            head = f.read(min(replace["length"], 1024))
+            if not re.match(rb'  <session [^>]*? id="' + re.escape(replace["session_id"].encode("utf-8")) + rb'"', head):
+                return None
+            offset = replace["offset"]
+        f.seek(offset)
+        f.write(data + LOG_FOOTER)
+        f.truncate()
+    return offset
+
+def session_offsets(data: bytes) -> Dict[str, Tuple[int, int]]:
+    """
+    Locate the sessions in the bytes of a log file written by log_session().
+    
+    Returns:
+        Dictionary mapping session IDs to (offset, length)
+    """
+    starts = [match.start() for match in re.finditer(rb'^  <session[ >/]', data, re.MULTILINE)]
+    footer = data.rfind(b"</sessions>")
+    offsets = {}
+    for start, end in zip(starts, starts[1:] + [footer]):
+        match = re.match(rb'  <session[^>]*? id="([^"]*)"', data[start:end])
+        if match:
+            offsets[match.group(1).decode("utf-8")] = (start, end - start)
+    return offsets
+
+def rewrite_log(log_file: str, session_data: Dict[str, Any], index: Optional["SessionIndex"]):
+    """
+    Write a session by parsing and rewriting the whole log file, replacing its earlier record if any.
+    
+    Used when a session that is not the last one in the file is updated, or
+    the file is not in the format log_session() appends to.
+    """
+    # Check if the file exists
+    try:
+        if os.path.exists(log_file):
+            # Parse existing file
+            tree = ET.parse(log_file)
+            root = tree.getroot()
+        else:
+            # Create new root element
+            root = ET.Element("sessions")
+    except Exception as e:
+        st.warning(f"Error opening log file: {e}. Creating new log.")
+        root = ET.Element("sessions")
+    
+    # Drop the indentation whitespace of the parsed file so it is not doubled when re-indented
+    for elem in root.iter():
+        if elem.text is not None and not elem.text.strip():
+            elem.text = None
+        if elem.tail is not None and not elem.tail.strip():
+            elem.tail = None
+    
+    # Find the earlier record of this session, if it is being updated
+    existing_session = None
+    session_id = session_data.get("session_id")
+    if session_id:
+        for elem in root.findall("session"):
+            if elem.get("id") == session_id:
+                existing_session = elem
+                break
+    
+    if existing_session is not None:
+        session = session_element(log_file, session_data, existing_session.get("datetime"))
+        root[list(root).index(existing_session)] = session
+    else:
+        session = session_element(log_file, session_data)
+        root.append(session)
+    
+    # Write to file with pretty formatting
+    xml_str = ET.tostring(root, encoding='utf-8')
+    pretty_xml = md.parseString(xml_str).toprettyxml(indent="  ").encode("utf-8")
+    with open(log_file, "wb") as f:
+        f.write(pretty_xml)
+    
+    # Sessions after the replaced one have moved
+    if index is not None:
+        offsets = session_offsets(pretty_xml)
+        entries = [dict(entry, offset=offsets[entry["session_id"]][0], length=offsets[entry["session_id"]][1])
+                   for entry in index.sessions(log_file) if entry["session_id"] in offsets]
+        if session_id in offsets:
+            entries.append(index_entry(log_file, session, session_data, *offsets[session_id]))
+        index.record(entries)
+
+def rewrite_compressed_log(entry: Dict[str, Any], session_data: Dict[str, Any], index: "SessionIndex"):
+    """
+    Update a session in a gzipped rotated log where it is, so it is not logged again in the current file.
+    
+    The log is decompressed next to itself, rewritten by rewrite_log() (its
+    index entries point at the plain file meanwhile, so their offsets are
+    updated) and compressed again. Its modification time is kept, so the
+    update does not change which old logs retention deletes.
+    """
+    compressed_file = entry["file"]
+    plain_file = compressed_file.removesuffix(".gz")
+    modified = os.path.getmtime(compressed_file)
+    with gzip.open(compressed_file, "rb") as source, open(plain_file, "wb") as target:
+        shutil.copyfileobj(source, target)
+    index.move_file(compressed_file, plain_file)
+    rewrite_log(plain_file, session_data, index)
+    with open(plain_file, "rb") as source, gzip.open(f"{compressed_file}.tmp", "wb") as target:
+        shutil.copyfileobj(source, target)
+    os.replace(f"{compressed_file}.tmp", compressed_file)
+    os.remove(plain_file)
+    os.utime(compressed_file, (modified, modified))
+    index.move_file(plain_file, compressed_file, compressed=True)
+
+def index_entry(log_file: str, session: ET.Element, session_data: Dict[str, Any],
+                offset: int, length: int) -> Dict[str, Any]:
+    """
+    Describe a logged session for the session index.
+    """
+    return {
+        "session_id": session_data["session_id"],
+        "file": log_file,
+        "offset": offset,
+        "length": length,
+        "datetime": session.get("datetime"),
+        "timestamp": datetime.datetime.now().isoformat(timespec="seconds"),
+        "model": (session_data.get("llm_params") or {}).get("model"),
+        "template_hashes": sorted({input_data["template_hash"] for input_data in session_data.get("inputs", [])
+                                   if input_data.get("template_hash")}),
+        "inputs": len(session_data.get("inputs", [])),
+        "compressed": False
+    }
+
+class SessionIndex:
+    """
+    Global index of logged sessions: which file each one is in, at which byte range, and what it ran.
+    
+    Entries are appended to a JSON lines file, so recording a session costs
+    one short write; a later line for a session replaces the earlier one,
+    and a line with "deleted" removes it. The file is re-read incrementally,
+    so sessions logged by other processes show up, and it is rewritten with
+    only the current entries when logs are rotated or deleted.
+    """
+    
+    def __init__(self, path: str):
+        """
+        Args:
+            path: Path to the index file
+        """
+        self.path = os.path.expanduser(path)
+        self.lock = threading.Lock()
+        self.entries = {}
+        self.position = 0
+    
+    def _refresh(self):
+        try:
+            size = os.path.getsize(self.path)
+        except OSError:
+            self.entries = {}
+            self.position = 0
+            return
+        if size < self.position:
+            # Rewritten (compacted) since it was last read
+            self.entries = {}
+            self.position = 0
+        with open(self.path, "rb") as f:
+            f.seek(self.position)
+            for line in f:
+                if not line.endswith(b"\n"):
+                    # Still being written
+                    break
+                self.position += len(line)
+                try:
+                    entry = json.loads(line)
+                except ValueError:
+                    continue
+                if entry.get("deleted"):
+                    self.entries.pop(entry["session_id"], None)
+                else:
+                    self.entries[entry["session_id"]] = entry
+    
+    def find(self, session_id: str) -> Optional[Dict[str, Any]]:
+        """
+        Return the index entry of a session, or None if it is not indexed.
+        """
+        with self.lock:
+            self._refresh()
+            entry = self.entries.get(session_id)
+            return dict(entry) if entry else None
+    
+    def sessions(self, log_file: Optional[str] = None, directory: Optional[str] = None) -> List[Dict[str, Any]]:
+        """
+        Return the entries of the sessions in a log file or directory (default all), newest first.
+        """
+        with self.lock:
+            self._refresh()
+            entries = [dict(entry) for entry in self.entries.values()
+                       if (log_file is None or entry["file"] == log_file) and
+                       (directory is None or os.path.dirname(entry["file"]) == directory)]
+        return sorted(entries, key=lambda entry: entry["timestamp"], reverse=True)
+    
+    def record(self, entries: List[Dict[str, Any]]):
+        """
+        Add or update entries.
+        """
+        if not entries:
+            return
+        with self.lock:
+            os.makedirs(os.path.dirname(self.path), exist_ok=True)
+            with open(self.path, "a", encoding="utf-8") as f:
+                f.write("".join(json.dumps(entry) + "\n" for entry in entries))
+    
+    def move_file(self, old_file: str, new_file: Optional[str], compressed: bool = False):
+        """
+        Point the entries of a rotated log file at its new path, or drop them if new_file is None (deleted).
+        """
+        with self.lock:
+            self._refresh()
+            for session_id, entry in list(self.entries.items()):
+                if entry["file"] != old_file:
+                    continue
+                if new_file is None:
+                    del self.entries[session_id]
+                else:
+                    entry.update(file=new_file, compressed=compressed)
+            
+            # Compact the index, written atomically so readers never see a partial file
+            temp_path = f"{self.path}.tmp"
+            with open(temp_path, "w", encoding="utf-8") as f:
+                f.write("".join(json.dumps(entry) + "\n" for entry in self.entries.values()))
+            os.replace(temp_path, self.path)
+            self.position = os.path.getsize(self.path)
+
+@st.cache_resource
+def get_session_index(path: str) -> SessionIndex:
+    """
+    Return the process-wide session index stored at a path.
+    """
+    return SessionIndex(path)
+
+def read_indexed_session(entry: Dict[str, Any]) -> ET.Element:
+    """
+    Parse one session of a log file from its index entry, without reading the sessions before it.
+    """
+    opener = gzip.open if entry.get("compressed") else open
+    with opener(entry["file"], "rb") as f:
+        f.seek(entry["offset"])
+        return ET.fromstring(f.read(entry["length"]))
+
+def spilled_output_files(log_path: str) -> List[str]:
+    """
+    Return the spilled output files referenced by a log file, gzipped or not.
+    """
+    opener = gzip.open if log_path.endswith(".gz") else open
+    with opener(log_path, "rb") as f:
+        data = f.read()
+    return [os.path.join(os.path.dirname(log_path), html.unescape(match.group(1).decode("utf-8")))
+            for match in re.finditer(rb'<output [^>]*?file="([^"]*)"', data)]
+
+# Suffixes of rotated logs (file.20250406-103045.xml) and of logs with the datetime appended
+# (file_06Apr2025_10-30-45.xml), which belong to the same log for retention
+ROTATED_SUFFIX = r'\.\d{8}-\d{6}(?:-\d+)?'
+DATETIME_SUFFIX = r'_\d{2}[A-Za-z]{3}\d{4}_\d{2}-\d{2}-\d{2}'
+
+def rotate_log(log_file: str, policy: Dict[str, Any], index: Optional[SessionIndex]) -> Optional[str]:
+    """
+    Rotate a log file that is too large or too old, and delete old logs of the same name.
+    
+    The rotated file gets a timestamp suffix and is optionally gzipped; the
+    next session starts a new file. Retention applies to the rotated files
+    and the datetime-suffixed files of the log, never to the current file.
+    Outputs spilled by the sessions of a deleted log are deleted with it.
+    
+    Args:
+        log_file: Path to the log file about to get a new session
+        policy: "max_mb" (size to rotate at), "max_age_days" (age of the first session to rotate at),
+                "compress", "keep" (number of old logs to keep) and "retention_days" (age of old
+                logs to delete at); 0 disables each limit
+        index: The session index to update, or None
+    
+    Returns:
+        Path of the rotated file, or None if the log was not rotated
+    """
+    rotated = None
+    if os.path.exists(log_file):
+        too_large = policy.get("max_mb") and os.path.getsize(log_file) >= policy["max_mb"] * 1024 * 1024
+        too_old = False
+        if policy.get("max_age_days"):
+            with open(log_file, "rb") as f:
+                match = re.search(rb'<session [^>]*?datetime="([^"]+)"', f.read(4096))
+            if match:
+                started = datetime.datetime.strptime(match.group(1).decode("utf-8"), "%d%b%Y - %H:%M:%S")
+                too_old = datetime.datetime.now() - started > datetime.timedelta(days=policy["max_age_days"])
+        if too_large or too_old:
+            stem, suffix = os.path.splitext(log_file)
+            rotated = f"{stem}.{datetime.datetime.now():%Y%m%d-%H%M%S}{suffix}"
+            counter = itertools.count(1)
+            while os.path.exists(rotated) or os.path.exists(f"{rotated}.gz"):
+                # Rotated twice within a second
+                rotated = f"{stem}.{datetime.datetime.now():%Y%m%d-%H%M%S}-{next(counter)}{suffix}"
+            os.replace(log_file, rotated)
+            if policy.get("compress"):
+                with open(rotated, "rb") as source, gzip.open(f"{rotated}.gz", "wb") as target:
+                    shutil.copyfileobj(source, target)
+                os.remove(rotated)
+                rotated = f"{rotated}.gz"
+            if index is not None:
+                index.move_file(log_file, rotated, compressed=rotated.endswith(".gz"))
+    
+    if policy.get("keep") or policy.get("retention_days"):
+        directory = os.path.dirname(log_file) or "."
+        stem, suffix = os.path.splitext(os.path.basename(log_file))
+        stem = re.sub(DATETIME_SUFFIX + "$", "", stem)
+        pattern = re.compile(re.escape(stem) + f"(?:{ROTATED_SUFFIX}|{DATETIME_SUFFIX})" + re.escape(suffix) + r'(?:\.gz)?$')
+        old_logs = [os.path.join(directory, name) for name in os.listdir(directory)
+                    if pattern.match(name) and os.path.join(directory, name) != log_file]
+        old_logs.sort(key=os.path.getmtime, reverse=True)
+        for position, path in enumerate(old_logs):
+            age_days = (time.time() - os.path.getmtime(path)) / 86400
+            if (policy.get("keep") and position >= policy["keep"]) or \
+                    (policy.get("retention_days") and age_days > policy["retention_days"]):
+                try:
+                    # Rotated logs share the current log's directory of spilled outputs
+                    spilled = spilled_output_files(path)
+                except (OSError, EOFError):
+                    spilled = []
+                os.remove(path)
+                for output_file in spilled:
+                    with contextlib.suppress(OSError):
+                        os.remove(output_file)
+                # Datetime-stamped logs have their own directory of spilled outputs
+                outputs_dir = os.path.splitext(path.removesuffix(".gz"))[0] + "_outputs"
+                if os.path.isdir(outputs_dir):
+                    shutil.rmtree(outputs_dir)
+                if index is not None:
+                    index.move_file(path, None)
+    return rotated
+
+def combination_key(combo: Dict[str, Any]) -> Tuple:
+    """
+    Identify a combination by the paths/values of its iterative variables.
+    
+    Args:
+        combo: A combination of variable values
+    
+    Returns:
+        Hashable key that stays the same when only file contents change
+    """
+    return tuple(sorted((name, str(value)) for name, value in combo.items() if name.endswith("_path")))
+
+def occurrence_key(key: Tuple, seen: Counter) -> Tuple:
+    """
+    Tell apart combinations with the same combination key by their order of occurrence.
+    
+    Combinations without file variables (key ()) or with repeated $$list
+    elements share a key; the n-th one after the first gets ("#", n) appended.
+    
+    Args:
+        key: Result of combination_key()
+        seen: Counter of the keys seen so far in the sweep, updated in place
+    
+    Returns:
+        Key unique within the sweep
+    """
+    seen[key] += 1
+    return key if seen[key] == 1 else key + (("#", seen[key]),)
+
+def display_combination(index: int, combo: Dict[str, Any], rendered_prompt: str,
+                        response: Optional[str], widget_ids, output_file: Optional[str] = None,
+                        output_chars: Optional[int] = None, template_id: Optional[str] = None):
+    """
+    Display one combination's variables, rendered prompt and (once available) response.
+    
+    Args:
+        index: Zero-based index of the combination
+        combo: The combination of variable values
+        rendered_prompt: The rendered prompt
+        response: The LLM response (or its preview if spilled), or None while the call is pending
+        widget_ids: Shared itertools.count() used to give every widget a unique key
+        output_file: File holding the full response if it was spilled to disk
+        output_chars: Length of the full response
+        template_id: ID of the template variant the prompt was rendered from, if there are several
+    """
+    # Display variable combination (for files, show path instead of content)
+    display_vars = {}
+    for var_name, var_value in combo.items():
+        if var_name.endswith("_path"):
+            display_vars[var_name] = var_value
+        else:
+            # For display purposes, truncate large content
+            if isinstance(var_value, str) and len(var_value) > 100:
+                display_vars[var_name] = var_value[:100] + "..."
+            else:
+                display_vars[var_name] = var_value
+    
+    st.subheader(f"Combination {index+1}" + (f" · template {template_id}" if template_id else ""))
+    st.write("Variables:")
+    st.json(display_vars)
+    
+    # Display the rendered template
+    with st.expander("Rendered Prompt"):
+        st.text_area("", rendered_prompt, height=150, key=f"prompt_{next(widget_ids)}")
+    
+    # Display the LLM's response
+    if response is not None:
+        st.write("LLM Response:")
+        st.text_area("", response, height=200, key=f"response_{next(widget_ids)}")
+        if output_file:
+            st.caption(f"Showing the first {len(response):,} of {output_chars:,} characters. "
+                       f"Full output: {output_file}")
+
+def load_output_history(log_dir: str, max_files: int = 20, index: Optional["SessionIndex"] = None,
+                        max_sessions: int = 200) -> Dict[str, Any]:
+    """
+    Collect the output lengths of earlier sessions from the logs in a directory.
+    
+    With a session index, the most recent indexed sessions in the directory
+    are read, each from its own byte range (compressed logs included). The
+    most recently modified log files without indexed sessions (written with
+    the index disabled, or before it existed) are read whole, using a
+    streaming parse.
+    
+    Args:
+        log_dir: Directory containing the XML session logs
+        max_files: Maximum number of log files to read
+        index: The session index, or None
+        max_sessions: Maximum number of indexed sessions to read
+    
+    Returns:
+        Dictionary with the mean estimated output tokens per combination key
+        ("by_key"), the median over all outputs ("median"), and the sorted
+        output tokens per (template hash, model) ("by_template"; reported
+        token counts where the log has them, which for packed inputs are the
+        member's share of the pack). Outputs cut off by max_tokens are left
+        out of "by_template": their length says only that the output needed
+        at least that many tokens.
+    """
+    def logged_inputs():
+        entries = index.sessions(directory=log_dir) if index is not None else []
+        for entry in entries[:max_sessions]:
+            try:
+                yield from (elem for elem in read_indexed_session(entry) if elem.tag.startswith("input"))
+            except (ET.ParseError, OSError, EOFError):
+                continue
+        
+        indexed_files = {entry["file"] for entry in entries}
+        try:
+            log_files = [os.path.join(log_dir, name) for name in os.listdir(log_dir)
+                         if name.endswith(".xml") and os.path.join(log_dir, name) not in indexed_files]
+        except OSError:
+            log_files = []
+        log_files.sort(key=os.path.getmtime, reverse=True)
+        for log_path in log_files[:max_files]:
+            try:
+                for _, elem in ET.iterparse(log_path):
+                    if elem.tag.startswith("input"):
+                        yield elem
+                        elem.clear()
+            except (ET.ParseError, OSError):
+                continue
+    
+    totals = {}
+    all_outputs = []
+    by_template = {}
+    for elem in logged_inputs():
+        if elem.find("output") is None:
+            continue
+        vars_elem = elem.find("variables")
+        key = tuple(sorted((var.tag, var.text or "") for var in (vars_elem if vars_elem is not None else [])
+                           if var.tag.endswith("_path")))
+        output_elem = elem.find("output")
+        if output_elem.get("chars"):
+            # Spilled output: only a preview is in the log
+            output_tokens = (int(output_elem.get("chars")) + 3) // 4
+        else:
+            output_tokens = estimate_tokens(output_elem.text or "")
+        totals.setdefault(key, []).append(output_tokens)
+        all_outputs.append(output_tokens)
+        if elem.get("template_hash") and elem.get("status", "ok") == "ok":
+            sample = int(elem.get("output_tokens") or output_tokens)
+            if elem.get("stop_reason"):
+                truncated = elem.get("stop_reason") == "max_tokens"
+            else:
+                truncated = bool(elem.get("max_tokens")) and sample >= int(elem.get("max_tokens"))
+            if not truncated:
+                model = elem.findtext("model") or elem.findtext("variables/llm_parameters/model") or ""
+                by_template.setdefault((elem.get("template_hash"), model), []).append(sample)
+    
+    return {
+        "by_key": {key: sum(values) / len(values) for key, values in totals.items()},
+        "median": sorted(all_outputs)[len(all_outputs) // 2] if all_outputs else None,
+        "by_template": {key: sorted(values) for key, values in by_template.items()}
+    }
+
+def template_hash(template: str) -> str:
+    """
+    Identify a template by its text, so its outputs can be found in later sessions.
+    """
+    return hashlib.sha256(template.encode("utf-8")).hexdigest()[:12]
+
+def auto_max_tokens(output_history: Optional[Dict[str, Any]], hash_value: str,
+                    token_sizing: Dict[str, Any]) -> Tuple[int, int]:
+    """
+    Size max_tokens for a template from the output lengths it produced before.
+    
+    The limit is a high percentile of the earlier output tokens of the same
+    template and model, plus a safety margin, capped by the configured
+    maximum. Templates with too few earlier outputs get the maximum.
+    
+    Args:
+        output_history: Result of load_output_history(), or None
+        hash_value: template_hash() of the template
+        token_sizing: Settings: "model", "percentile" (0-100), "margin" (fraction
+                      added on top), "min_samples" and "ceiling" (the configured max_tokens)
+    
+    Returns:
+        Tuple of (max_tokens, number of earlier outputs it is based on)
+    """
+    samples = ((output_history or {}).get("by_template") or {}).get((hash_value, token_sizing["model"]), [])
+    if len(samples) < token_sizing["min_samples"]:
+        return token_sizing["ceiling"], len(samples)
+    position = min(math.ceil(len(samples) * token_sizing["percentile"] / 100.0) - 1, len(samples) - 1)
+    limit = math.ceil(samples[max(position, 0)] * (1.0 + token_sizing["margin"]))
+    return min(max(limit, 1), token_sizing["ceiling"]), len(samples)
+
+def hit_token_limit(input_data: Dict[str, Any], default_max_tokens: int) -> bool:
+    """
+    Tell whether a successful output was cut off by max_tokens.
+    
+    Uses the stop reason when the backend reports one; otherwise the output
+    length is compared with the limit.
+    """
+    if input_data.get("stop_reason"):
+        return input_data["stop_reason"] == "max_tokens"
+    output_tokens = input_data.get("output_tokens")
+    if output_tokens is None:
+        output_tokens = ((input_data.get("output_chars") or len(input_data.get("output") or "")) + 3) // 4
+    return output_tokens >= (input_data.get("max_tokens") or default_max_tokens)
+
+def summarize_token_limits(inputs: List[Dict[str, Any]], default_max_tokens: int) -> List[Dict[str, Any]]:
+    """
+    Report per template how often successful outputs hit max_tokens.
+    
+    Args:
+        inputs: Input records of the session
+        default_max_tokens: max_tokens of inputs that were not sized individually
+    
+    Returns:
+        One row per template with its calls, max_tokens range, hits, hit rate and output token percentiles
+    """
+    groups = {}
+    for input_data in inputs:
+        if input_data["status"] != "ok" or input_data.get("intermediate") is not None:
+            continue
+        groups.setdefault(input_data.get("template_id") or input_data.get("template_hash") or "", []).append(input_data)
+    
+    rows = []
+    for template, group in groups.items():
+        limits = [input_data.get("max_tokens") or default_max_tokens for input_data in group]
+        lengths = sorted(input_data.get("output_tokens") or
+                         ((input_data.get("output_chars") or len(input_data["output"])) + 3) // 4 for input_data in group)
+        hits = sum(1 for input_data in group if hit_token_limit(input_data, default_max_tokens))
+        rows.append({
+            "template": template,
+            "calls": len(group),
+            "max_tokens": f"{min(limits)}" if min(limits) == max(limits) else f"{min(limits)}-{max(limits)}",
+            "hits": hits,
+            "hit_rate": round(hits / len(group), 4),
+            "p50_output_tokens": lengths[len(lengths) // 2],
+            "p95_output_tokens": lengths[min(math.ceil(len(lengths) * 0.95) - 1, len(lengths) - 1)]
+        })
+    return rows
+
+def estimate_request_cost(prompt: str, key: Tuple, output_history: Optional[Dict[str, Any]], max_tokens: int) -> float:
+    """
+    Estimate how long a request will take, in seconds.
+    
+    Prompt processing is cheap compared to generating output, so the estimate
+    is dominated by the expected output length: the mean of earlier outputs for
+    the same combination, else the median of all earlier outputs, else a guess
+    bounded by max_tokens.
+    
+    Args:
+        prompt: The rendered prompt
+        key: Combination key of the request
+        output_history: Result of load_output_history(), or None
+        max_tokens: Maximum output tokens of the request
+    
+    Returns:
+        Estimated duration in seconds
+    """
+    expected_output = None
+    if output_history:
+        expected_output = output_history["by_key"].get(key, output_history["median"])
+    if expected_output is None:
+        expected_output = min(max_tokens, 500)
+    expected_output = min(expected_output, max_tokens)
+    return 0.5 + estimate_tokens(prompt) / 5000.0 + expected_output / 50.0
+
+# Scheduling policies map a pending request to a priority; lower runs first
+SCHEDULING_POLICIES = {
+    "natural": lambda request: request["index"],
+    "longest_first": lambda request: -request["estimated_cost"],
+    "shortest_first": lambda request: request["estimated_cost"]
+}
+
+def simulate_makespan(latencies: List[float], concurrency: int) -> float:
+    """
+    Compute the makespan of running calls in the given order on a fixed number of workers.
+    
+    Args:
+        latencies: Call durations in dispatch order
+        concurrency: Number of calls in flight at once
+    
+    Returns:
+        Time until the last call finishes
+    """
+    workers = [0.0] * max(concurrency, 1)
+    for latency in latencies:
+        start = heapq.heappop(workers)
+        heapq.heappush(workers, start + latency)
+    return max(workers)
+
+class CancelEvent(threading.Event):
+    """
+    Event that also runs registered callbacks when set.
+    
+    A call blocked on the network (e.g. waiting for its first token) never
+    gets to check the event; the callbacks close its stream or client from
+    the cancelling thread so it returns at once.
+    """
+    
+    def __init__(self):
+        super().__init__()
+        self._callback_lock = threading.Lock()
+        self._callbacks = []
+    
+    def add_callback(self, callback):
+        """
+        Run callback when the event is set (at once if it already is).
+        """
+        with self._callback_lock:
+            if not self.is_set():
+                self._callbacks.append(callback)
+                return
+        callback()
+    
+    def set(self):
+        with self._callback_lock:
+            super().set()
+            callbacks, self._callbacks = self._callbacks, []
+        for callback in callbacks:
+            try:
+                callback()
+            except Exception as e:
+                print(f"Could not abort cancelled call: {e}", file=sys.stderr)
+
+def discard_attempt(future):
+    """
+    Done callback of a cancelled call attempt: delete its spilled output, if any.
+    """
+    if not future.cancelled() and future.exception() is None:
+        remove_output_file(future.result())
+
+def percentile(values: List[float], pct: float) -> float:
+    """
+    Return the pct-th percentile (0-100) of a non-empty list, using the nearest rank.
+    """
+    ordered = sorted(values)
+    rank = min(max(math.ceil(pct / 100.0 * len(ordered)) - 1, 0), len(ordered) - 1)
+    return ordered[rank]
+
+# Errors that count towards opening a model's circuit breaker
+BREAKER_ERROR_TYPES = ("overloaded", "server_error")
+# Errors that make the adaptive concurrency limit back off
+BACKOFF_ERROR_TYPES = ("rate_limited", "overloaded")
+# Errors after which a call is retried on the next fallback model
+FAILOVER_ERROR_TYPES = ("overloaded", "server_error", "timeout", "connection")
+
+class CircuitBreaker:
+    """
+    Stops sending calls to a model after repeated overload errors.
+    
+    After `threshold` consecutive overload errors the breaker opens and no
+    calls are allowed for `cooldown` seconds. Once the cooldown has passed a
+    single trial call is let through (half-open): success closes the breaker,
+    another overload error opens it again. Used from several worker threads.
+    """
+    
+    def __init__(self, threshold: int = 5, cooldown: float = 30.0):
+        """
+        Args:
+            threshold: Consecutive overload errors that open the breaker
+            cooldown: Seconds the breaker stays open before a trial call
+        """
+        self.threshold = max(int(threshold), 1)
+        self.cooldown = cooldown
+        self.failures = 0
+        self.opened_at = None
+        self.trial_running = False
+        self.trips = 0
+        self.lock = threading.Lock()
+    
+    def retry_at(self) -> float:
+        """
+        Return the perf_counter() time from which calls may be attempted again.
+        """
+        with self.lock:
+            if self.opened_at is None:
+                return 0.0
+            return self.opened_at + self.cooldown
+    
+    def allow(self) -> Optional[str]:
+        """
+        Return whether a call may be made now, claiming the trial call when half-open.
+        
+        Returns:
+            None if the call may not be made, "trial" for the half-open trial
+            call, otherwise "call"; pass it on to record()
+        """
+        with self.lock:
+            if self.opened_at is None:
+                return "call"
+            if self.trial_running or time.perf_counter() < self.opened_at + self.cooldown:
+                return None
+            self.trial_running = True
+            return "trial"
+    
+    def record(self, error_type: Optional[str], permit: str = "call"):
+        """
+        Record the outcome of a call allowed by allow().
+        
+        Calls that were started before the breaker opened may finish while
+        the trial call runs; only the trial call itself can reopen the
+        breaker or release the trial.
+        
+        Args:
+            error_type: Error category of the call, or None on success
+            permit: What allow() returned for the call
+        """
+        with self.lock:
+            was_trial = permit == "trial"
+            if was_trial:
+                self.trial_running = False
+            if error_type in BREAKER_ERROR_TYPES:
+                self.failures += 1
+                if was_trial or (self.opened_at is None and self.failures >= self.threshold):
+                    if self.opened_at is None:
+                        self.trips += 1
+                    self.opened_at = time.perf_counter()
+            elif error_type != "cancelled":
+                self.failures = 0
+                self.opened_at = None
+
+def key_fingerprint(api_key: str) -> str:
+    """
+    Identify an API key without storing it.
+    """
+    return hashlib.sha256(api_key.encode("utf-8")).hexdigest()[:16]
+
+class ApiGovernor:
+    """
+    Shares the request capacity of one API key between all sessions of the server process.
+    
+    Every call first acquires a slot. At most max_concurrency calls run at
+    once, and while several clients are waiting each gets an equal share of
+    the slots: a client already at its share lets the others go first. The
+    estimated prompt tokens of new calls plus the output tokens of finished
+    ones are also kept under tokens_per_minute over a sliding minute. A limit
+    of 0 disables it. Used from the worker threads of all sessions, and of the
+    other tools (Best of N, load tests) running in the same server.
+    """
+    
+    # Clients that have been idle this long are dropped from the status panel
+    IDLE_SECONDS = 600
+    
+    def __init__(self):
+        self.max_concurrency = 0
+        self.tokens_per_minute = 0
+        self.configured_by = None
+        self.clients = {}
+        self.token_log = deque()
+        self.condition = threading.Condition()
+    
+    def configure(self, max_concurrency: int, tokens_per_minute: int, client_label: str):
+        """
+        Set the shared limits; they apply to every session using the key.
+        """
+        with self.condition:
+            self.max_concurrency = int(max_concurrency)
+            self.tokens_per_minute = int(tokens_per_minute)
+            self.configured_by = client_label
+            self.condition.notify_all()
+    
+    def register(self, client_id: str, label: str):
+        """
+        Add or refresh a client (a browser session) shown in the status panel.
+        """
+        with self.condition:
+            client = self._client(client_id)
+            client["label"] = label
+    
+    def _client(self, client_id: str) -> Dict[str, Any]:
+        # Clients dropped from the status panel while idle come back on their next call
+        client = self.clients.setdefault(client_id, {"label": client_id, "in_flight": 0, "waiting": 0,
+                                                     "calls": 0, "tokens": 0})
+        client["last_seen"] = time.time()
+        return client
+
+    def _tokens_last_minute(self, now: float) -> int:
+        while self.token_log and self.token_log[0][0] < now - 60.0:
+            self.token_log.popleft()
+        return sum(tokens for _, _, tokens in self.token_log)
+    
+    def _can_start(self, client: Dict[str, Any], tokens: int) -> bool:
+        if self.max_concurrency:
+            in_flight = sum(other["in_flight"] for other in self.clients.values())
+            if in_flight >= self.max_concurrency:
+                return False
+            contending = [other for other in self.clients.values() if other["waiting"] or other["in_flight"]]
+            share = max(self.max_concurrency // max(len(contending), 1), 1)
+            if client["in_flight"] >= share and any(other is not client and other["waiting"] and other["in_flight"] < share
+                                                    for other in contending):
+                return False
+        if self.tokens_per_minute:
+            used = self._tokens_last_minute(time.time())
+            # A single call larger than the budget may still run once the minute is clear
+            if used and used + tokens > self.tokens_per_minute:
+                return False
+        return True
+    
+    def acquire(self, client_id: str, tokens: int, cancel_event: Optional[threading.Event] = None) -> bool:
+        """
+        Wait for a slot for a call with the given estimated prompt tokens.
+        
+        Args:
+            client_id: Client making the call
+            tokens: Estimated prompt tokens
+            cancel_event: Optional event that abandons the wait when set
+        
+        Returns:
+            True once the slot is held, False if the wait was cancelled
+        """
+        with self.condition:
+            client = self._client(client_id)
+            client["waiting"] += 1
+            try:
+                while not self._can_start(client, tokens):
+                    if cancel_event is not None and cancel_event.is_set():
+                        return False
+                    # Time out regularly: the token window slides even without releases
+                    self.condition.wait(timeout=0.5)
+                client["in_flight"] += 1
+                client["calls"] += 1
+                client["tokens"] += tokens
+                client["last_seen"] = time.time()
+                self.token_log.append((time.time(), client_id, tokens))
+                return True
+            finally:
+                client["waiting"] -= 1
+    
+    def release(self, client_id: str, output_tokens: int, input_correction: int = 0):
+        """
+        Return a slot, counting the output tokens of the finished call.
+        
+        Args:
+            client_id: Client that made the call
+            output_tokens: Output tokens of the call
+            input_correction: Prompt tokens the API reported minus the estimate charged
+                              by acquire(), so the token budget follows real usage
+        """
+        with self.condition:
+            client = self._client(client_id)
+            client["in_flight"] -= 1
+            client["tokens"] += output_tokens + input_correction
+            self.token_log.append((time.time(), client_id, output_tokens + input_correction))
+            self.condition.notify_all()
+    
+    def status(self) -> List[Dict[str, Any]]:
+        """
+        Describe the current clients, dropping those that have been idle for a while.
+        
+        Returns:
+            One row per client with its calls in flight, waiting calls and token use
+        """
+        with self.condition:
+            now = time.time()
+            for client_id in [client_id for client_id, client in self.clients.items()
+                              if not client["in_flight"] and not client["waiting"]
+                              and now - client["last_seen"] > self.IDLE_SECONDS]:
+                del self.clients[client_id]
+            self._tokens_last_minute(now)
+            recent = Counter()
+            for _, client_id, tokens in self.token_log:
+                recent[client_id] += tokens
+            return [{
+                "session": client["label"],
+                "in flight": client["in_flight"],
+                "waiting": client["waiting"],
+                "calls": client["calls"],
+                "tokens (last minute)": recent[client_id],
+                "tokens (total)": client["tokens"],
+                "last active": datetime.datetime.fromtimestamp(client["last_seen"]).strftime("%H:%M:%S")
+            } for client_id, client in self.clients.items()]
+
+@st.cache_resource
+def get_api_governor(fingerprint: str) -> ApiGovernor:
+    """
+    Return the process-wide governor for the API key with the given fingerprint.
+    """
+    return ApiGovernor()
+
+class SweepMonitor:
+    """
+    Counters, gauges and latency histograms of the sweeps run by this server, for monitoring systems.
+    
+    One monitor is shared by all sessions of the server process (see
+    get_sweep_monitor()), and every series is labelled with the session label.
+    Counters only grow for the lifetime of the process, as scrapers expect.
+    Gauges are read at scrape time from callbacks registered by running
+    sweeps. render() produces the Prometheus text exposition format.
+    """
+    
+    # Upper bounds (seconds) of the request latency histogram buckets
+    LATENCY_BUCKETS = (0.5, 1.0, 2.0, 5.0, 10.0, 30.0, 60.0, 120.0, 300.0, 600.0)
+    
+    COUNTERS = {
+        "pvt_requests_started_total": "LLM calls started, including hedge duplicates",
+        "pvt_requests_completed_total": "Requests completed, by status",
+        "pvt_requests_failed_total": "Failed requests, by error type",
+        "pvt_tokens_total": "Tokens sent and received (estimated when the backend does not report usage)",
+        "pvt_cache_lookups_total": "Response lookups in replay fixtures, by result"
+    }
+    GAUGES = {
+        "pvt_queue_depth": "Items waiting in each stage of a running sweep",
+        "pvt_concurrency_limit": "Current in-flight limit of a running sweep"
+    }
+    
+    def __init__(self):
+        self.lock = threading.Lock()
+        # (metric name, sorted label items) -> value
+        self.counters = {}
+        # sorted label items -> (bucket counts, sum, count)
+        self.latencies = {}
+        # sweep key -> (session label, callable returning (metric name, labels, value) tuples)
+        self.gauge_sources = {}
+    
+    def inc(self, name: str, value: float = 1, **labels):
+        """
+        Add to a counter.
+        """
+        key = (name, tuple(sorted(labels.items())))
+        with self.lock:
+            self.counters[key] = self.counters.get(key, 0) + value
+    
+    def observe_latency(self, seconds: float, **labels):
+        """
+        Add a request latency to the histogram.
+        """
+        key = tuple(sorted(labels.items()))
+        with self.lock:
+            buckets, total, count = self.latencies.get(key, ([0] * len(self.LATENCY_BUCKETS), 0.0, 0))
+            for position, bound in enumerate(self.LATENCY_BUCKETS):
+                if seconds <= bound:
+                    buckets[position] += 1
+            self.latencies[key] = (buckets, total + seconds, count + 1)
+    
+    def record_result(self, session: str, prompt: str, result: Dict[str, Any]):
+        """
+        Count a completed request: its status, tokens, latency and fixture lookup.
+        
+        Args:
+            session: Session label
+            prompt: The prompt that was sent
+            result: Result from the dispatcher
+        """
+        status = "error" if result["error_type"] else "ok"
+        self.inc("pvt_requests_completed_total", session=session, status=status)
+        if result["error_type"]:
+            self.inc("pvt_requests_failed_total", session=session, error_type=result["error_type"])
+        else:
+            self.inc("pvt_tokens_total", result.get("output_tokens") or (result.get("output_chars") or 0) // 4,
+                     session=session, direction="out")
+        self.inc("pvt_tokens_total", result.get("input_tokens") or estimate_tokens(prompt),
+                 session=session, direction="in")
+        self.observe_latency(result["latency"], session=session)
+        if result.get("cache"):
+            self.inc("pvt_cache_lookups_total", session=session, result=result["cache"])
+    
+    def track(self, key: str, session: str, source):
+        """
+        Report the gauges of a running sweep.
+        
+        Args:
+            key: Identifies the sweep (several sweeps may share a session label)
+            session: Session label
+            source: Callable returning (metric name, labels, value) tuples; called at scrape time
+        """
+        with self.lock:
+            self.gauge_sources[key] = (session, source)
+    
+    def untrack(self, key: str):
+        """
+        Stop reporting the gauges of a sweep that has ended.
+        """
+        with self.lock:
+            self.gauge_sources.pop(key, None)
+    
+    def render(self) -> str:
+        """
+        Return every metric in the Prometheus text exposition format.
+        """
+        def format_labels(items) -> str:
+            if not items:
+                return ""
+            escaped = (str(value).replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n")
+                       for _, value in items)
+            return "{" + ",".join(f'{name}="{value}"' for (name, _), value in zip(items, escaped)) + "}"
+        
+        with self.lock:
+            counters = dict(self.counters)
+            latencies = dict(self.latencies)
+            sources = dict(self.gauge_sources)
+        # Sweeps with the same session label are added up
+        gauge_values = Counter()
+        for session, source in sources.values():
+            try:
+                for name, labels, value in source():
+                    gauge_values[(name, tuple(sorted(dict(labels, session=session).items())))] += value
+            except Exception:
+                continue  # A sweep that is shutting down
+        gauges = [(name, labels, value) for (name, labels), value in gauge_values.items()]
+        
+        lines = []
+        for name, help_text in self.COUNTERS.items():
+            lines.append(f"# HELP {name} {help_text}")
+            lines.append(f"# TYPE {name} counter")
+            lines.extend(f"{name}{format_labels(labels)} {value}"
+                         for (metric, labels), value in sorted(counters.items()) if metric == name)
+        for name, help_text in self.GAUGES.items():
+            lines.append(f"# HELP {name} {help_text}")
+            lines.append(f"# TYPE {name} gauge")
+            lines.extend(f"{name}{format_labels(labels)} {value}"
+                         for metric, labels, value in sorted(gauges) if metric == name)
+        name = "pvt_request_latency_seconds"
+        lines.append(f"# HELP {name} Request latency, from the first attempt's start to the result")
+        lines.append(f"# TYPE {name} histogram")
+        for labels, (buckets, total, count) in sorted(latencies.items()):
+            for bound, bucket_count in zip(self.LATENCY_BUCKETS, buckets):
+                lines.append(f"{name}_bucket{format_labels(labels + (('le', bound),))} {bucket_count}")
+            lines.append(f"{name}_bucket{format_labels(labels + (('le', '+Inf'),))} {count}")
+            lines.append(f"{name}_sum{format_labels(labels)} {round(total, 6)}")
+            lines.append(f"{name}_count{format_labels(labels)} {count}")
+        return "\n".join(lines) + "\n"
+    
+    def write_file(self, path: str):
+        """
+        Write the metrics to a file, replacing it atomically (for textfile collectors).
+        """
+        path = os.path.expanduser(path)
+        os.makedirs(os.path.dirname(path) or ".", exist_ok=True)
+        temp_path = path + ".tmp"
+        with open(temp_path, "w", encoding="utf-8") as f:
+            f.write(self.render())
+        os.replace(temp_path, path)
+
+@st.cache_resource
+def get_sweep_monitor() -> SweepMonitor:
+    """
+    Return the process-wide sweep monitor.
+    """
+    return SweepMonitor()
+
+class MetricsServer:
+    """
+    Serves a SweepMonitor's metrics over HTTP at /metrics from a background thread.
+    """
+    
+    def __init__(self, monitor: SweepMonitor, port: int, host: str = "127.0.0.1"):
+        """
+        Args:
+            monitor: The monitor to expose
+            port: TCP port to listen on
+            host: Address to bind (local only by default)
+        
+        Raises:
+            OSError: If the port cannot be bound
+        """
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self):
+                if self.path.split("?")[0] not in ("/metrics", "/"):
+                    self.send_error(404)
+                    return
+                body = monitor.render().encode("utf-8")
+                self.send_response(200)
+                self.send_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+            
+            def log_message(self, format, *args):
+                pass  # Scrapes would flood the console otherwise
+        
+        self.port = port
+        self.server = ThreadingHTTPServer((host, port), Handler)
+        self.server.daemon_threads = True
+        self.thread = threading.Thread(target=self.server.serve_forever, name="pvt-metrics-http", daemon=True)
+        self.thread.start()
+    
+    def stop(self):
+        """
+        Stop serving and free the port.
+        """
+        self.server.shutdown()
+        self.server.server_close()
+        self.thread.join()
+
+class MetricsFileWriter:
+    """
+    Rewrites a metrics file from a background thread at a fixed interval.
+    """
+    
+    def __init__(self, monitor: SweepMonitor, path: str, interval: float):
+        """
+        Args:
+            monitor: The monitor to write out
+            path: Path of the metrics file
+            interval: Seconds between rewrites
+        """
+        self.monitor = monitor
+        self.path = path
+        self.interval = interval
+        self.stop_event = threading.Event()
+        self.thread = threading.Thread(target=self._run, name="pvt-metrics-file", daemon=True)
+        self.thread.start()
+    
+    def _run(self):
+        while not self.stop_event.is_set():
+            try:
+                self.monitor.write_file(self.path)
+            except OSError as e:
+                print(f"Could not write metrics file: {e}", file=sys.stderr)
+            self.stop_event.wait(self.interval)
+    
+    def stop(self):
+        """
+        Stop rewriting the file (it is left in place).
+        """
+        self.stop_event.set()
+        self.thread.join()
+
+class MetricsExporters:
+    """
+    The metrics server and file writer of the server process.
+    
+    There is at most one of each; applying new settings stops the ones that
+    no longer match and starts their replacements. Settings come from
+    whichever session changed them last, like the shared API limits.
+    """
+    
+    def __init__(self, monitor: SweepMonitor):
+        self.monitor = monitor
+        self.server = None
+        self.writer = None
+        self.lock = threading.Lock()
+    
+    def apply(self, port: int, path: str, interval: float):
+        """
+        Serve metrics on port (0 stops the server) and write them to path (empty stops the writer).
+        
+        Raises:
+            OSError: If the port cannot be bound; the previous server is stopped regardless
+        """
+        with self.lock:
+            if self.writer is not None and (self.writer.path, self.writer.interval) != (path, interval):
+                self.writer.stop()
+                self.writer = None
+            if path and self.writer is None:
+                self.writer = MetricsFileWriter(self.monitor, path, interval)
+            if self.server is not None and self.server.port != port:
+                self.server.stop()
+                self.server = None
+            if port and self.server is None:
+                self.server = MetricsServer(self.monitor, port)
+
+@st.cache_resource
+def get_metrics_exporters() -> MetricsExporters:
+    """
+    Return the process-wide metrics exporters.
+    """
+    return MetricsExporters(get_sweep_monitor())
+
+class RequestDispatcher:
+    """
+    Dispatches LLM calls to a pool of worker threads.
+    
+    Pending requests are started in the order given by the scheduling policy,
+    with at most `concurrency` calls in flight. Results are yielded as calls
+    complete, so the caller (the Streamlit script thread) can update the page.
+    
+    With hedging enabled, a call that has been running longer than the given
+    percentile of observed latencies gets a duplicate, even while all
+    `concurrency` slots are busy; whichever attempt finishes first
+    successfully is used and the other is cancelled and no longer waited
+    for. The number of duplicates is capped at a fraction of the requests.
+    
+    Each model has a circuit breaker. A call that fails with an overload,
+    server, timeout or connection error (or whose model's breaker is open)
+    fails over to the next fallback model; while the breakers of all models
+    are open, no new calls are dispatched.
+    
+    With a governor, every call also waits for a slot shared with the other
+    sessions using the same API key.
+    
+    With adaptive concurrency, the in-flight limit is tuned by AIMD between 1
+    and `concurrency`: it grows by one after a full window of successful
+    calls while latency stays near the best observed, and is halved on a
+    rate-limit or overload response (at most once per window).
+    """
+    
+    # Completed calls needed before the latency percentile is trusted for hedging
+    HEDGE_MIN_SAMPLES = 5
+    # Recent calls whose median latency is compared against the best median seen
+    AIMD_LATENCY_WINDOW = 10
+    # Median latency, relative to the best median seen, above which the limit stops growing
+    AIMD_LATENCY_TOLERANCE = 1.5
+    
+    def __init__(self, llm_params: Dict[str, Any], concurrency: int = 1, policy: str = "natural",
+                 hedge_percentile: Optional[float] = None, hedge_budget: float = 0.1,
+                 fallback_models: Optional[List[str]] = None, breaker_threshold: int = 5,
+                 breaker_cooldown: float = 30.0, adaptive: bool = False,
+                 governor: Optional[ApiGovernor] = None, client_id: Optional[str] = None,
+                 lookahead: Optional[int] = None, monitor: Optional[SweepMonitor] = None,
+                 session_label: str = ""):
+        """
+        Args:
+            llm_params: Dictionary of LLM parameters
+            concurrency: Maximum number of calls in flight
+            policy: Name of a SCHEDULING_POLICIES entry
+            hedge_percentile: Latency percentile after which a call is duplicated, or None to disable hedging
+            hedge_budget: Maximum number of duplicate calls as a fraction of the requests
+            fallback_models: Models to fail over to, in order
+            breaker_threshold: Consecutive overload errors that open a model's circuit breaker
+            breaker_cooldown: Seconds a circuit breaker stays open
+            adaptive: Tune the in-flight limit with AIMD, using concurrency as the maximum
+            governor: Process-wide ApiGovernor of the API key, or None
+            client_id: Client ID of this session with the governor
+            lookahead: Maximum requests pulled from the source ahead of dispatch (the window
+                       the scheduling policy orders), or None to pull all available requests
+            monitor: SweepMonitor that calls and results are reported to, or None
+            session_label: Session label of the reported metrics
+        """
+        self.llm_params = llm_params
+        self.concurrency = max(int(concurrency), 1)
+        self.policy = policy
+        self.priority = SCHEDULING_POLICIES[policy]
+        self.hedge_percentile = hedge_percentile
+        self.hedge_budget = hedge_budget
+        primary = llm_params.get("model", "claude-3-7-sonnet-latest")
+        self.models = [primary] + [model for model in (fallback_models or []) if model != primary]
+        self.breakers = {model: CircuitBreaker(breaker_threshold, breaker_cooldown) for model in self.models}
+        self.adaptive = adaptive
+        self.governor = governor
+        self.client_id = client_id
+        self.lookahead = lookahead
+        self.monitor = monitor
+        self.session_label = session_label
+        self.live = {"pending": 0, "in_flight": 0, "limit": self.concurrency}
+        self.metrics = {}
+    
+    def call(self, request: Dict[str, Any]) -> Dict[str, Any]:
+        """
+        Make a single call outside of run(), e.g. from a scoring thread.
+        
+        The call goes through the governor, the circuit breakers and failover
+        and is counted by the monitor, but is not scheduled, hedged or tuned.
+        
+        Args:
+            request: Request dictionary with "prompt" (and optionally "max_tokens")
+        
+        Returns:
+            The call's result
+        """
+        if self.monitor is not None:
+            self.monitor.inc("pvt_requests_started_total", session=self.session_label)
+        result = self._call(request, CancelEvent())
+        if self.monitor is not None:
+            self.monitor.record_result(self.session_label, request["prompt"], result)
+        return result
+    
+    def _call(self, request: Dict[str, Any], cancel_event: threading.Event) -> Dict[str, Any]:
+        call_start = time.perf_counter()
+        if self.governor is None:
+            return self._call_with_failover(request, cancel_event, call_start)
+        
+        estimated_tokens = estimate_tokens(request["prompt"])
+        if not self.governor.acquire(self.client_id, estimated_tokens, cancel_event):
+            return {"output": "Error calling LLM: request cancelled", "error_type": "cancelled",
+                    "model": self.models[0], "failovers": [], "latency": time.perf_counter() - call_start}
+        result = None
+        try:
+            result = self._call_with_failover(request, cancel_event, call_start)
+            return result
+        finally:
+            # Charge the usage the API reported where there is one, else estimates
+            result = result or {}
+            output_tokens = result.get("output_tokens") or (result.get("output_chars") or 0) // 4
+            input_correction = result["input_tokens"] - estimated_tokens if result.get("input_tokens") else 0
+            self.governor.release(self.client_id, output_tokens, input_correction)
+    
+    def _call_with_failover(self, request: Dict[str, Any], cancel_event: threading.Event,
+                            call_start: float) -> Dict[str, Any]:
+        result = None
+        failovers = []
+        reason = None
+        for model in self.models:
+            permit = self.breakers[model].allow()
+            if permit is None:
+                reason = reason or "circuit_open"
+                continue
+            if result is not None:
+                failovers.append({"from": result["model"], "to": model, "reason": reason})
+            elif reason is not None:
+                failovers.append({"from": self.models[0], "to": model, "reason": reason})
+            params = dict(self.llm_params, model=model)
+            if request.get("max_tokens"):
+                # Sized for this request's template (see auto_max_tokens())
+                params["max_tokens"] = request["max_tokens"]
+            result = call_llm_detailed(request["prompt"], params, cancel_event)
+            self.breakers[model].record(result["error_type"], permit)
+            if result["error_type"] not in FAILOVER_ERROR_TYPES or cancel_event.is_set():
+                break
+            reason = result["error_type"]
+        
+        if result is None:
+            result = {"output": "Error calling LLM: circuit breaker open for all models",
+                      "error_type": "circuit_open", "model": self.models[0]}
+        result["failovers"] = failovers
+        result["latency"] = time.perf_counter() - call_start
+        return result
+    
+    def _adjust_limit(self, limit: int, result: Dict[str, Any], aimd: Dict[str, Any]) -> int:
+        """
+        Apply one AIMD step for a completed call.
+        
+        Backing off relies on 429 and overload responses reaching the
+        dispatcher, which is why call_llm_detailed() turns off the SDK's own
+        retries (max_retries=0).
+        
+        Args:
+            limit: Current in-flight limit
+            result: Result of the completed call
+            aimd: State kept between steps (successes in the window, recent latencies,
+                  best median latency, calls to wait for after a decrease)
+        
+        Returns:
+            The new in-flight limit
+        """
+        backoff = result["error_type"] in BACKOFF_ERROR_TYPES or any(
+            failover["reason"] in BACKOFF_ERROR_TYPES for failover in result.get("failovers", []))
+        if backoff:
+            aimd["successes"] = 0
+            if aimd["hold"] > 0:
+                # Calls started before the last decrease do not trigger another one
+                aimd["hold"] -= 1
+                return limit
+            aimd["hold"] = limit
+            return max(limit // 2, 1)
+        
+        aimd["hold"] = max(aimd["hold"] - 1, 0)
+        if result["error_type"] is not None:
+            return limit
+        recent = aimd["latencies"]
+        recent.append(result["latency"])
+        del recent[:-self.AIMD_LATENCY_WINDOW]
+        median = percentile(recent, 50)
+        if len(recent) == self.AIMD_LATENCY_WINDOW:
+            aimd["best_median"] = min(aimd["best_median"] or median, median)
+        if aimd["best_median"] and median > aimd["best_median"] * self.AIMD_LATENCY_TOLERANCE:
+            aimd["successes"] = 0
+            return limit
+        aimd["successes"] += 1
+        if aimd["successes"] >= limit and limit < self.concurrency:
+            aimd["successes"] = 0
+            return limit + 1
+        return limit
+    
+    def _resume_at(self) -> Optional[float]:
+        """
+        Return when dispatch may resume if every model's circuit breaker is open, else None.
+        """
+        now = time.perf_counter()
+        retry_times = [breaker.retry_at() for breaker in self.breakers.values()]
+        if any(retry_time <= now for retry_time in retry_times):
+            return None
+        return min(retry_times)
+    
+    def run(self, requests):
+        """
+        Run the requests and yield (request, result) pairs as they complete.
+        
+        Requests are pulled from the iterable as the lookahead window allows, so
+        it can be a stream fed by another thread; it yields None while no
+        request is ready yet.
+        
+        Args:
+            requests: Iterable of request dictionaries with "index", "prompt" and "estimated_cost"
+        
+        Yields:
+            Tuples of the request and a result with "output", "error_type", "model",
+            "failovers", "latency" (from the first attempt's start) and "hedged"
+        """
+        source = iter(requests)
+        source_done = False
+        pending = []
+        peak_pending = 0
+        # future -> (request, attempt start time, is hedge)
+        in_flight = {}
+        # request index -> state shared by its attempts
+        attempts = {}
+        observed = []
+        start_order = []
+        latencies = {}
+        hedges_issued = 0
+        hedges_won = 0
+        paused = 0.0
+        failover_count = 0
+        # Adaptive runs start low and grow towards the configured maximum
+        limit = min(2, self.concurrency) if self.adaptive else self.concurrency
+        aimd = {"successes": 0, "latencies": [], "best_median": None, "hold": 0}
+        timeline = [{"t": 0.0, "limit": limit}]
+        max_hedges = 0
+        run_start = time.perf_counter()
+        
+        # Hedges run on top of the in-flight limit, in spare workers
+        executor = ThreadPoolExecutor(max_workers=self.concurrency * (2 if self.hedge_percentile else 1),
+                                      thread_name_prefix="pvt-call")
+        try:
+            while pending or in_flight or not source_done:
+                # Pull requests into the scheduling window
+                while not source_done and (self.lookahead is None or len(pending) < self.lookahead):
+                    try:
+                        request = next(source)
+                    except StopIteration:
+                        source_done = True
+                        break
+                    if request is None:
+                        break  # Nothing ready yet
+                    heapq.heappush(pending, (self.priority(request), request["index"], request))
+                peak_pending = max(peak_pending, len(pending))
+
+                # Hold back new calls while every model's circuit breaker is open
+                resume_at = self._resume_at() if pending else None
+                if resume_at is not None and not in_flight:
+                    delay = max(resume_at - time.perf_counter(), 0.0)
+                    time.sleep(delay)
+                    paused += delay
+                    continue
+                # The limit counts requests; a request and its hedge take one slot
+                requests_in_flight = len({request["index"] for request, _ in in_flight.values()})
+                while pending and resume_at is None and requests_in_flight < limit:
+                    _, _, request = heapq.heappop(pending)
+                    requests_in_flight += 1
+                    state = {"cancel": CancelEvent(), "start": time.perf_counter(), "running": 1, "hedged": False}
+                    attempts[request["index"]] = state
+                    start_order.append(request["index"])
+                    in_flight[executor.submit(self._call, request, state["cancel"])] = (request, False)
+                    if self.monitor is not None:
+                        self.monitor.inc("pvt_requests_started_total", session=self.session_label)
+                self.live = {"pending": len(pending), "in_flight": len(in_flight), "limit": limit}
+                
+                # The hedge budget grows with the number of requests started
+                if self.hedge_percentile:
+                    max_hedges = int(len(start_order) * self.hedge_budget)
+                
+                if not in_flight:
+                    if not pending and not source_done:
+                        time.sleep(0.01)  # Waiting for the source
+                    continue
+                
+                # Wake up periodically while hedging, paused or waiting for the source
+                timeout = None
+                if hedges_issued < max_hedges or resume_at is not None or not source_done:
+                    timeout = 0.05
+                done, _ = wait(in_flight, timeout=timeout, return_when=FIRST_COMPLETED)
+                
+                for future in done:
+                    if future not in in_flight:
+                        continue  # Dropped when another attempt won
+                    request, is_hedge = in_flight.pop(future)
+                    state = attempts[request["index"]]
+                    state["running"] -= 1
+                    result = future.result()
+                    if self.adaptive:
+                        new_limit = self._adjust_limit(limit, result, aimd)
+                        if new_limit != limit:
+                            limit = new_limit
+                            timeline.append({"t": round(time.perf_counter() - run_start, 3), "limit": limit})
+                    if result["error_type"] is not None and state["running"] > 0:
+                        continue  # Let the remaining attempt finish instead
+                    
+                    # First usable attempt wins; cancel the other one and stop waiting for it
+                    state["cancel"].set()
+                    for other, (other_request, _) in list(in_flight.items()):
+                        if other_request["index"] == request["index"]:
+                            del in_flight[other]
+                            other.add_done_callback(discard_attempt)
+                    result["latency"] = time.perf_counter() - state["start"]
+                    result["hedged"] = state["hedged"]
+                    if is_hedge:
+                        hedges_won += 1
+                    observed.append(result["latency"])
+                    latencies[request["index"]] = result["latency"]
+                    failover_count += len(result["failovers"])
+                    if self.monitor is not None:
+                        self.monitor.record_result(self.session_label, request["prompt"], result)
+                    yield request, result
+                
+                # Duplicate calls running longer than the latency percentile
+                if hedges_issued < max_hedges and len(observed) >= self.HEDGE_MIN_SAMPLES:
+                    threshold = percentile(observed, self.hedge_percentile)
+                    now = time.perf_counter()
+                    for request, is_hedge in list(in_flight.values()):
+                        state = attempts[request["index"]]
+                        if state["hedged"] or now - state["start"] < threshold or hedges_issued >= max_hedges:
+                            continue
+                        state["hedged"] = True
+                        state["running"] += 1
+                        hedges_issued += 1
+                        in_flight[executor.submit(self._call, request, state["cancel"])] = (request, True)
+                        if self.monitor is not None:
+                            self.monitor.inc("pvt_requests_started_total", session=self.session_label)
+        finally:
+            # The consumer may stop early (the script was stopped or rerun); calls still
+            # running are cancelled so they stop streaming and release their governor slots
+            for future, (request, _) in in_flight.items():
+                attempts[request["index"]]["cancel"].set()
+                future.add_done_callback(discard_attempt)
+            executor.shutdown(wait=False, cancel_futures=True)
+        
+        # Compare the chosen order with natural order, replaying the observed latencies
+        makespan = time.perf_counter() - run_start
+        simulated_concurrency = self.concurrency
+        if self.adaptive:
+            # Replay with the time-weighted average of the adapted limit
+            timeline.append({"t": round(makespan, 3), "limit": limit})
+            weighted = sum((after["t"] - before["t"]) * before["limit"] for before, after in zip(timeline, timeline[1:]))
+            simulated_concurrency = max(round(weighted / makespan), 1) if makespan > 0 else limit
+        self.metrics = {
+            "policy": self.policy,
+            "concurrency": self.concurrency,
+            "requests": len(latencies),
+            "makespan": round(makespan, 3),
+            "peak_lookahead": peak_pending,
+            "simulated_makespan": round(simulate_makespan(
+                [latencies[index] for index in start_order if index in latencies], simulated_concurrency), 3),
+            "natural_order_makespan": round(simulate_makespan(
+                [latencies[index] for index in sorted(latencies)], simulated_concurrency), 3)
+        }
+        if self.hedge_percentile:
+            self.metrics["hedge_percentile"] = self.hedge_percentile
+            self.metrics["hedges_issued"] = hedges_issued
+            self.metrics["hedges_won"] = hedges_won
+        if len(self.models) > 1 or any(breaker.trips for breaker in self.breakers.values()):
+            self.metrics["failovers"] = failover_count
+            self.metrics["breaker_trips"] = sum(breaker.trips for breaker in self.breakers.values())
+            self.metrics["breaker_paused_seconds"] = round(paused, 3)
+        if self.adaptive:
+            self.metrics["mean_concurrency"] = simulated_concurrency
+            self.metrics["final_concurrency"] = limit
+            self.metrics["concurrency_timeline"] = timeline
+
+def build_request(index: int, combo: Dict[str, Any], prompt_template: str,
+                  output_history: Optional[Dict[str, Any]], max_tokens: int,
+                  token_sizing: Optional[Dict[str, Any]] = None) -> Dict[str, Any]:
+    """
+    Render a combination and describe it as a request for the dispatcher.
+    
+    Args:
+        index: Zero-based index of the combination
+        combo: The combination of variable values
+        prompt_template: The prompt template
+        output_history: Result of load_output_history() for cost estimates (and sizing), or None
+        max_tokens: Maximum output tokens per call
+        token_sizing: Settings for auto_max_tokens(), or None to use max_tokens for every call
+    
+    Returns:
+        Request dictionary with the rendered prompt, template hash, estimated cost
+        and, with token_sizing, the request's own "max_tokens". "combination" is
+        the combination's index; "index" starts out the same but identifies the
+        request, so callers renumber it when a combination makes several requests
+    """
+    rendered_prompt = render_template(prompt_template, combo)
+    key = combination_key(combo)
+    hash_value = template_hash(prompt_template)
+    request_max_tokens = None
+    if token_sizing is not None:
+        request_max_tokens = auto_max_tokens(output_history, hash_value, token_sizing)[0]
+        max_tokens = request_max_tokens
+    return {
+        "index": index,
+        "combination": index,
+        "key": key,
+        "combo": combo,
+        "prompt": rendered_prompt,
+        "template_hash": hash_value,
+        "max_tokens": request_max_tokens,
+        "estimated_cost": estimate_request_cost(rendered_prompt, key, output_history, max_tokens)
+    }
+
+def plan_request(index: int, combo: Dict[str, Any], prompt_template: str, placeholder, widget_ids,
+                 output_history: Optional[Dict[str, Any]], max_tokens: int,
+                 token_sizing: Optional[Dict[str, Any]] = None) -> Dict[str, Any]:
+    """
+    Render and display a combination, and describe it as a request for the dispatcher.
+    
+    Args:
+        index: Zero-based index of the combination
+        combo: The combination of variable values
+        prompt_template: The prompt template
+        placeholder: st.empty() slot the combination is displayed in
+        widget_ids: Shared itertools.count() for unique widget keys
+        output_history: Result of load_output_history() for cost estimates, or None
+        max_tokens: Maximum output tokens per call
+        token_sizing: Settings for auto_max_tokens(), or None to use max_tokens for every call
+    
+    Returns:
+        Request dictionary with the rendered prompt and estimated cost
+    """
+    request = build_request(index, combo, prompt_template, output_history, max_tokens, token_sizing)
+    with placeholder.container():
+        display_combination(index, combo, request["prompt"], None, widget_ids)
+    return request
+
+class PlanPipeline:
+    """
+    Feeds the dispatcher from expansion and rendering threads connected by bounded queues.
+    
+    The expansion thread reads combinations (and the files behind them) into
+    the expand queue, and the render thread turns them into requests in the
+    render queue, which the dispatcher pulls from as its lookahead window
+    allows. A full queue blocks the stage feeding it, so the number of
+    combinations held ahead of the API calls is capped by the queue depths
+    rather than by the size of the sweep. Combinations that need map-reduce
+    are set aside for the script thread. With several template variants,
+    each combination is expanded once and rendered with every variant.
+    
+    Only the work ahead of the calls is bounded: completed results are kept
+    by the caller until the session is logged. The time each stage spends
+    working (not waiting on its queues) is kept in `busy`, and with a
+    profiler each thread reports its own stage, so expansion is measured
+    apart from the calls it overlaps with.
+    """
+    
+    _END = object()
+    
+    def __init__(self, combinations, prompt_template: Union[str, List[Tuple[str, str]], None],
+                 map_reduce: Optional[Dict[str, Any]],
+                 output_history: Optional[Dict[str, Any]], max_tokens: int, expand_depth: int, render_depth: int,
+                 token_sizing: Optional[Dict[str, Any]] = None, profiler: Optional["SessionProfiler"] = None):
+        """
+        Args:
+            combinations: Iterable of combinations (read lazily by the expansion thread)
+            prompt_template: The prompt template, a list of (template ID, template) variants to
+                             render every combination with (request i * variants + j is
+                             combination i with variant j), or None to pass (index, combination)
+                             tuples through unrendered (a TemplateExperiment renders them)
+            map_reduce: Map-reduce settings for oversized variables, or None
+            output_history: Result of load_output_history() for cost estimates, or None
+            max_tokens: Maximum output tokens per call
+            expand_depth: Capacity of the queue between expansion and rendering
+            render_depth: Capacity of the queue between rendering and dispatch
+            token_sizing: Settings for auto_max_tokens(), or None
+            profiler: Active SessionProfiler, which gets an expand and a render stage, or None
+        """
+        self.combinations = combinations
+        self.prompt_template = prompt_template
+        self.map_reduce = map_reduce
+        self.output_history = output_history
+        self.max_tokens = max_tokens
+        self.token_sizing = token_sizing
+        self.profiler = profiler
+        self.expand_queue = queue.Queue(maxsize=max(int(expand_depth), 1))
+        self.render_queue = queue.Queue(maxsize=max(int(render_depth), 1))
+        self.map_reduce_combos = []
+        self.stop_event = threading.Event()
+        self.error = None
+        self.expanded = 0
+        self.rendered = 0
+        self.peaks = {"expand": 0, "render": 0}
+        self.busy = {"expand": 0.0, "render": 0.0}
+        self.threads = [threading.Thread(target=self._expand, name="pvt-expand", daemon=True),
+                        threading.Thread(target=self._render, name="pvt-render", daemon=True)]
+    
+    def start(self):
+        """
+        Start the expansion and rendering threads.
+        """
+        for thread in self.threads:
+            thread.start()
+    
+    def stop(self):
+        """
+        Make the stage threads exit, e.g. when the run ends early, and wait for them.
+        """
+        self.stop_event.set()
+        for thread in self.threads:
+            if thread.is_alive():
+                thread.join()
+    
+    def _put(self, stage: str, stage_queue: queue.Queue, item) -> bool:
+        # Block while the queue is full (backpressure), unless the pipeline is stopped
+        while not self.stop_event.is_set():
+            try:
+                stage_queue.put(item, timeout=0.1)
+                self.peaks[stage] = max(self.peaks[stage], stage_queue.qsize())
+                return True
+            except queue.Full:
+                continue
+        return False
+    
+    def _get(self, stage_queue: queue.Queue):
+        while not self.stop_event.is_set():
+            try:
+                return stage_queue.get(timeout=0.1)
+            except queue.Empty:
+                continue
+        return self._END
+    
+    def _expand(self):
+        try:
+            with profile_thread_stage(self.profiler, "expand") as note_memory:
+                combinations = iter(self.combinations)
+                for index in itertools.count():
+                    start = time.perf_counter()
+                    combo = next(combinations, self._END)
+                    self.busy["expand"] += time.perf_counter() - start
+                    if combo is self._END:
+                        break
+                    note_memory()
+                    if not self._put("expand", self.expand_queue, (index, combo)):
+                        return
+                    self.expanded += 1
+        except Exception as e:
+            self.error = e
+        finally:
+            self._put("expand", self.expand_queue, self._END)
+    
+    def _render(self):
+        try:
+            with profile_thread_stage(self.profiler, "render") as note_memory:
+                while True:
+                    item = self._get(self.expand_queue)
+                    if item is self._END:
+                        break
+                    index, combo = item
+                    start = time.perf_counter()
+                    chunk_var = chunked_variable(combo, self.map_reduce) if self.map_reduce else None
+                    if chunk_var:
+                        self.map_reduce_combos.append((index, combo, chunk_var))
+                        self.busy["render"] += time.perf_counter() - start
+                        continue
+                    if self.prompt_template is None:
+                        requests = [(index, combo)]
+                    elif isinstance(self.prompt_template, str):
+                        requests = [build_request(index, combo, self.prompt_template, self.output_history,
+                                                  self.max_tokens, self.token_sizing)]
+                    else:
+                        requests = []
+                        variants = len(self.prompt_template)
+                        for position, (template_id, template) in enumerate(self.prompt_template):
+                            request = build_request(index, combo, template, self.output_history, self.max_tokens,
+                                                    self.token_sizing)
+                            request["index"] = index * variants + position
+                            request["template_id"] = template_id
+                            requests.append(request)
+                    self.busy["render"] += time.perf_counter() - start
+                    for request in requests:
+                        if not self._put("render", self.render_queue, request):
+                            return
+                        self.rendered += 1
+                    note_memory()
+        except Exception as e:
+            self.error = self.error or e
+        finally:
+            self._put("render", self.render_queue, self._END)
+    
+    def requests(self):
+        """
+        Yield rendered requests for the dispatcher, or None while none is ready.
+        
+        Raises:
+            The exception that stopped the expansion or rendering thread, if any
+        """
+        while True:
+            try:
+                item = self.render_queue.get_nowait()
+            except queue.Empty:
+                yield None
+                continue
+            if item is self._END:
+                if self.error is not None:
+                    raise self.error
+                return
+            yield item
+    
+    def depths(self) -> Dict[str, int]:
+        """
+        Return the current number of items in each queue.
+        """
+        return {"expand_queue": self.expand_queue.qsize(), "render_queue": self.render_queue.qsize()}
+
+def complete_request(request: Dict[str, Any], result: Dict[str, Any], placeholder, widget_ids) -> Dict[str, Any]:
+    """
+    Display a finished request and turn it into an input record.
+    
+    Args:
+        request: Request dictionary from build_request()
+        result: Result from the dispatcher
+        placeholder: st.empty() slot the combination is displayed in
+        widget_ids: Shared itertools.count() for unique widget keys
+    
+    Returns:
+        The input record for session_data["inputs"]
+    """
+    with placeholder.container():
+        display_combination(request.get("combination", request["index"]), request["combo"], request["prompt"],
+                            result["output"], widget_ids, result.get("output_file"), result.get("output_chars"),
+                            request.get("template_id"))
+    
+    return {
+        "variables": request["combo"],
+        "prompt": request["prompt"],
+        "status": "error" if result["error_type"] else "ok",
+        "error_type": result["error_type"],
+        "output": result["output"],
+        "output_file": result.get("output_file"),
+        "output_chars": result.get("output_chars"),
+        "latency": result["latency"],
+        "pack": result.get("pack"),
+        "intermediate": result.get("intermediate"),
+        "model": result.get("model"),
+        "failovers": result.get("failovers", []),
+        "input_tokens": result.get("input_tokens"),
+        "output_tokens": result.get("output_tokens"),
+        "template_id": request.get("template_id"),
+        "template_hash": request.get("template_hash"),
+        "max_tokens": request.get("max_tokens"),
+        "stop_reason": result.get("stop_reason")
+    }
+
+PACK_INSTRUCTIONS = (
+    "You will be given {count} independent tasks. Complete each task on its own, as if it were the only one. "
+    "Write the answer to each task between <result id=\"N\"> and </result> tags, where N is the task's id, "
+    "in order, with nothing outside the tags."
+)
+
+def make_pack(group: List[Dict[str, Any]]) -> Dict[str, Any]:
+    """
+    Combine a group of requests into one packed request; a group of one is returned unchanged.
+    """
+    if len(group) == 1:
+        return group[0]
+    tasks = "\n\n".join(f"<task id=\"{position}\">\n{member['prompt']}\n</task>"
+                         for position, member in enumerate(group, 1))
+    return {
+        # Member indexes are unique, so the first one identifies the pack
+        "index": group[0]["index"],
+        "key": ("pack", group[0]["index"]),
+        "members": group,
+        "prompt": PACK_INSTRUCTIONS.format(count=len(group)) + "\n\n" + tasks,
+        "estimated_cost": sum(member["estimated_cost"] for member in group)
+    }
+
+def pack_requests(requests, token_budget: int, max_items: int):
+    """
+    Group consecutive requests into packs whose prompts together fit a token budget.
+    
+    Args:
+        requests: Iterable of requests from build_request(); None entries (nothing
+                  ready yet) are passed through
+        token_budget: Maximum estimated prompt tokens of a pack
+        max_items: Maximum number of requests in a pack
+    
+    Yields:
+        Requests to dispatch: packs have "members" (the original requests) and
+        a combined prompt; requests that do not share a pack are unchanged
+    """
+    current = []
+    current_tokens = 0
+    for request in requests:
+        if request is None:
+            yield None
+            continue
+        tokens = estimate_tokens(request["prompt"])
+        if current and (current_tokens + tokens > token_budget or len(current) >= max_items):
+            yield make_pack(current)
+            current, current_tokens = [], 0
+        current.append(request)
+        current_tokens += tokens
+    if current:
+        yield make_pack(current)
+
+def split_packed_output(output: str, count: int) -> Optional[List[str]]:
+    """
+    Split the response to a pack into the answers to its tasks.
+    
+    Args:
+        output: The response to the packed prompt
+        count: Number of tasks in the pack
+    
+    Returns:
+        The answers in task order, or None unless every task has exactly one answer
+    """
+    answers = {}
+    for match in re.finditer(r'<result id="(\d+)">(.*?)</result>', output, re.DOTALL):
+        position = int(match.group(1))
+        if position in answers or not 1 <= position <= count:
+            return None
+        answers[position] = match.group(2).strip()
+    if len(answers) != count:
+        return None
+    return [answers[position] for position in range(1, count + 1)]
+
+def split_tokens(total: Optional[int], weights: List[float]) -> List[Optional[int]]:
+    """
+    Split a pack call's token count between its members in proportion to weights.
+    
+    The shares are whole numbers that add up to total (largest remainder), so
+    summing the members of a pack gives the pack's usage.
+    
+    Args:
+        total: Token count of the pack call, or None if unknown
+        weights: One weight per member (e.g. its prompt or answer length)
+    
+    Returns:
+        One token count per member, or Nones if total is None
+    """
+    if total is None:
+        return [None] * len(weights)
+    if not sum(weights):
+        weights = [1] * len(weights)
+    shares = [total * weight / sum(weights) for weight in weights]
+    counts = [int(share) for share in shares]
+    by_remainder = sorted(range(len(shares)), key=lambda position: shares[position] - counts[position], reverse=True)
+    for position in by_remainder[:total - sum(counts)]:
+        counts[position] += 1
+    return counts
+
+def dispatch_packed(dispatcher: RequestDispatcher, requests, token_budget: int, max_items: int):
+    """
+    Dispatch requests with small prompts packed together, yielding results per original request.
+    
+    A pack whose response cannot be split into one answer per task is
+    re-dispatched as individual requests once all packs have completed. A
+    failed pack call fails all of its members, which can then be retried.
+    
+    Args:
+        dispatcher: The request dispatcher
+        requests: Iterable of requests from build_request()
+        token_budget: Maximum estimated prompt tokens of a pack
+        max_items: Maximum number of requests in a pack
+    
+    Yields:
+        Tuples of an original request and its result, which has a "pack" entry
+        (pack id and size) if its answer came from a pack. The pack call's
+        token usage is split between its members (see split_tokens()), so the
+        members add up to the call.
+    """
+    fallback = []
+    packed_calls = 0
+    packed_inputs = 0
+    for request, result in dispatcher.run(pack_requests(requests, token_budget, max_items)):
+        if "members" not in request:
+            yield request, result
+            continue
+        
+        members = request["members"]
+        packed_calls += 1
+        packed_inputs += len(members)
+        pack = {"id": request["index"], "size": len(members)}
+        prompt_weights = [estimate_tokens(member["prompt"]) for member in members]
+        input_tokens = split_tokens(result.get("input_tokens"), prompt_weights)
+        if result["error_type"] is not None:
+            output_tokens = split_tokens(result.get("output_tokens"), prompt_weights)
+            for member, member_input, member_output in zip(members, input_tokens, output_tokens):
+                yield member, dict(result, pack=pack, input_tokens=member_input, output_tokens=member_output)
+            continue
+        
+        answers = split_packed_output(read_output(result), len(members))
+        remove_output_file(result)
+        if answers is None:
+            fallback.extend(members)
+            continue
+        output_tokens = split_tokens(result.get("output_tokens"), [len(answer) for answer in answers])
+        for member, answer, member_input, member_output in zip(members, answers, input_tokens, output_tokens):
+            sink = spill_sink(dispatcher.llm_params)
+            sink.write(answer)
+            yield member, dict(result, **sink.close(), pack=pack, input_tokens=member_input, output_tokens=member_output)
+    
+    metrics = dict(dispatcher.metrics)
+    metrics["packed_calls"] = packed_calls
+    metrics["packed_inputs"] = packed_inputs
+    metrics["pack_fallbacks"] = len(fallback)
+    if fallback:
+        # Fall back to one request per input for packs whose response could not be split
+        yield from dispatcher.run(fallback)
+        metrics["fallback_makespan"] = dispatcher.metrics.get("makespan")
+    dispatcher.metrics = metrics
+
+def split_into_chunks(text: str, chunk_tokens: int) -> List[str]:
+    """
+    Split a document into chunks of at most chunk_tokens estimated tokens, at line boundaries where possible.
+    
+    Args:
+        text: The document
+        chunk_tokens: Maximum estimated tokens per chunk
+    
+    Returns:
+        List of chunks that together make up the document
+    """
+    max_chars = max(chunk_tokens, 1) * 4
+    chunks = []
+    current = []
+    current_chars = 0
+    for line in text.splitlines(keepends=True):
+        # Lines longer than a chunk are cut into pieces
+        pieces = [line[start:start + max_chars] for start in range(0, len(line), max_chars)] or [line]
+        for piece in pieces:
+            if current and current_chars + len(piece) > max_chars:
+                chunks.append("".join(current))
+                current, current_chars = [], 0
+            current.append(piece)
+            current_chars += len(piece)
+    if current:
+        chunks.append("".join(current))
+    return chunks
+
+def chunked_variable(combo: Dict[str, Any], map_reduce: Dict[str, Any]) -> Optional[str]:
+    """
+    Find the variable of a combination that is too large for one call.
+    
+    Args:
+        combo: The combination of variable values
+        map_reduce: Map-reduce settings with "chunk_tokens" per variable
+    
+    Returns:
+        Name of the largest variable over its chunk_tokens limit, or None
+    """
+    oversized = [(estimate_tokens(combo[var_name]), var_name) for var_name, chunk_tokens in map_reduce["chunk_tokens"].items()
+                 if isinstance(combo.get(var_name), str) and estimate_tokens(combo[var_name]) > chunk_tokens]
+    return max(oversized)[1] if oversized else None
+
+def plan_map_reduce(index: int, combo: Dict[str, Any], chunk_var: str, map_reduce: Dict[str, Any],
+                    placeholder, widget_ids) -> Dict[str, Any]:
+    """
+    Split a combination's oversized variable into chunks and display it as pending.
+    
+    Args:
+        index: Zero-based index of the combination
+        combo: The combination of variable values
+        chunk_var: Name of the variable to split
+        map_reduce: Map-reduce settings
+        placeholder: st.empty() slot the combination is displayed in
+        widget_ids: Shared itertools.count() for unique widget keys
     
-    # Add each input
-    for i, input_data in enumerate(session_data["inputs"]):
-        input_elem = ET.SubElement(session, f"input{i+1}")
+    Returns:
+        Map-reduce job dictionary
+    """
+    chunk_tokens = map_reduce["chunk_tokens"][chunk_var]
+    chunks = split_into_chunks(combo[chunk_var], chunk_tokens)
+    with placeholder.container():
+        display_combination(index, combo, f"(map-reduce over {len(chunks)} chunks of {chunk_var})", None, widget_ids)
+    return {
+        "index": index,
+        "key": combination_key(combo),
+        "combo": combo,
+        "chunk_var": chunk_var,
+        "chunk_tokens": chunk_tokens,
+        "chunks": chunks
+    }
+
+def render_partials(outputs: List[str]) -> str:
+    """
+    Wrap partial outputs in numbered <partial> tags for a reduce prompt.
+    """
+    return "\n".join(f"<partial id=\"{i}\">\n{output}\n</partial>" for i, output in enumerate(outputs, 1))
+
+def group_partials(outputs: List[str], chunk_tokens: int) -> List[List[str]]:
+    """
+    Group partial outputs so each group fits in chunk_tokens; every group has at least two outputs
+    so that repeated reduce rounds always make progress.
+    """
+    groups = []
+    current = []
+    current_tokens = 0
+    for output in outputs:
+        tokens = estimate_tokens(output)
+        if len(current) >= 2 and current_tokens + tokens > chunk_tokens:
+            groups.append(current)
+            current, current_tokens = [], 0
+        current.append(output)
+        current_tokens += tokens
+    if len(current) == 1 and groups:
+        groups[-1].append(current[0])
+    elif current:
+        groups.append(current)
+    return groups
+
+def run_map_reduce(jobs: List[Dict[str, Any]], dispatcher: RequestDispatcher, map_reduce: Dict[str, Any]):
+    """
+    Process oversized combinations by map-reduce, in rounds that run the calls of all jobs in parallel.
+    
+    The map template runs on every chunk (with {{chunk}}, {{chunk_index}} and
+    {{chunk_count}} added to the combination's variables). The reduce template
+    combines the partial outputs ({{partials}}, {{partial_count}}); while they
+    are too large for one call they are reduced in groups, round after round,
+    until a single final reduce produces the result.
+    
+    Args:
+        jobs: Jobs from plan_map_reduce()
+        dispatcher: The request dispatcher
+        map_reduce: Map-reduce settings with "map_template" and "reduce_template"
+    
+    Yields:
+        Tuples of a job (with "prompt" set to its final reduce prompt) and its
+        result, which has an "intermediate" list describing every call made
+    """
+    start_time = time.perf_counter()
+    calls = {job["index"]: [] for job in jobs}
+    done = set()
+
+    # Each round maps request ids to (job, stage, level, part, is_final)
+    round_requests = []
+    request_ids = itertools.count()
+    for job in jobs:
+        for part, chunk in enumerate(job["chunks"], 1):
+            prompt = render_template(map_reduce["map_template"],
+                                     dict(job["combo"], chunk=chunk, chunk_index=str(part), chunk_count=str(len(job["chunks"]))))
+            round_requests.append((job, "map", 0, part, False, prompt))
+    
+    level = 0
+    while round_requests:
+        requests = []
+        lookup = {}
+        for job, stage, call_level, part, is_final, prompt in round_requests:
+            request_id = next(request_ids)
+            lookup[request_id] = (job, stage, call_level, part, is_final)
+            requests.append({"index": request_id, "key": job["key"], "prompt": prompt, "estimated_cost": 0.0})
         
-        # Add variables
-        vars_elem = ET.SubElement(input_elem, "variables")
-        # Add variable information
-        for var_name, var_value in input_data["variables"].items():
-            if var_name.endswith("_path"):
-                var_elem = ET.SubElement(vars_elem, var_name)
-                var_elem.text = str(var_value)
+        outputs = {}
+        failed = {}
+        finals = {}
+        for request, result in dispatcher.run(requests):
+            job, stage, call_level, part, is_final = lookup[request["index"]]
+            full_output = result["output"] if is_final else read_output(result)
+            calls[job["index"]].append({
+                "stage": stage,
+                "level": call_level,
+                "part": part,
+                "status": "error" if result["error_type"] else "ok",
+                "latency": round(result["latency"], 3),
+                "prompt": request["prompt"],
+                "output": full_output
+            })
+            if result["error_type"] is not None:
+                failed.setdefault(job["index"], (request["prompt"], result))
+            elif is_final:
+                finals[job["index"]] = (request["prompt"], result)
+            else:
+                remove_output_file(result)
+                outputs.setdefault(job["index"], {})[part] = full_output
         
-        # Add LLM parameters
-        params_elem = ET.SubElement(vars_elem, "llm_parameters")
-        for param_name, param_value in session_data["llm_params"].items():
-            if param_name != "api_key":  # Skip API key for security
-                param = ET.SubElement(params_elem, param_name)
-                param.text = str(param_value)
+        level += 1
+        round_requests = []
+        for job in jobs:
+            index = job["index"]
+            if index in done:
+                continue
+            job_calls = sorted(calls[index], key=lambda call: (call["level"], call["part"]))
+            if index in failed or index in finals:
+                # A failed call ends the job; otherwise the final reduce is the input's own call
+                job["prompt"], result = failed[index] if index in failed else finals[index]
+                result = dict(result, latency=time.perf_counter() - start_time)
+                result["intermediate"] = job_calls if index in failed else \
+                    [call for call in job_calls if call["stage"] != "reduce_final"]
+                done.add(index)
+                yield job, result
+                continue
+
+            job_outputs = [outputs[index][part] for part in sorted(outputs.get(index, {}))]
+            groups = group_partials(job_outputs, job["chunk_tokens"])
+            is_final = len(groups) == 1
+            for part, group in enumerate(groups, 1):
+                prompt = render_template(map_reduce["reduce_template"],
+                                         dict(job["combo"], partials=render_partials(group), partial_count=str(len(group))))
+                round_requests.append((job, "reduce_final" if is_final else "reduce", level, part, is_final, prompt))
+
+# A line "===" or "=== name ===" separates template variants in the prompt template
+TEMPLATE_SEPARATOR = re.compile(r'^===[ \t]*(?:([A-Za-z0-9_.-]+)[ \t]*===)?[ \t]*$', re.MULTILINE)
+
+def split_templates(text: str) -> List[Tuple[str, str]]:
+    """
+    Split a prompt template holding several variants.
+    
+    A "=== name ===" line names the variant that follows it; variants after
+    a bare "===" line (and before the first separator) are called t1, t2, ...
+    by position. Text without separators is a single variant.
+    
+    Args:
+        text: The prompt template field
+    
+    Returns:
+        List of (template ID, template) tuples
+    
+    Raises:
+        ValueError: If two variants have the same name
+    """
+    matches = list(TEMPLATE_SEPARATOR.finditer(text))
+    if not matches:
+        return [("t1", text)]
+    sections = [(None, text[:matches[0].start()])]
+    for match, following in zip(matches, matches[1:] + [None]):
+        sections.append((match.group(1), text[match.end():following.start() if following else len(text)]))
+    
+    templates = []
+    for name, body in sections:
+        body = body.strip("\n")
+        if not body.strip():
+            continue
+        template_id = name or f"t{len(templates) + 1}"
+        if any(existing_id == template_id for existing_id, _ in templates):
+            raise ValueError(f"Two template variants are named {template_id}")
+        templates.append((template_id, body))
+    return templates
+
+# A prompt template field of the form $$templates(path) reads one template per file in a directory
+TEMPLATE_DIRECTORY = re.compile(r'^\$\$templates\((.+)\)$')
+
+def load_templates(text: str) -> List[Tuple[str, str]]:
+    """
+    Load the template variants of the prompt template field.
+    
+    The field is either $$templates(path), naming a directory whose files
+    (hidden files excluded, sorted by name) are the variants with their file
+    names without extension as IDs, or text split by split_templates().
+    
+    Args:
+        text: The prompt template field
+    
+    Returns:
+        List of (template ID, template) tuples
+    
+    Raises:
+        ValueError: If the directory holds no templates, or two variants have the same ID
+        OSError: If the directory cannot be read
+    """
+    match = TEMPLATE_DIRECTORY.match(text.strip())
+    if not match:
+        return split_templates(text)
+    
+    directory = os.path.expanduser(match.group(1).strip().strip('"\''))
+    templates = []
+    for name in sorted(os.listdir(directory)):
+        path = os.path.join(directory, name)
+        if name.startswith(".") or not os.path.isfile(path):
+            continue
+        template_id = Path(name).stem
+        if any(existing_id == template_id for existing_id, _ in templates):
+            raise ValueError(f"Two template files are named {template_id}")
+        with open(path, "r", encoding="utf-8") as f:
+            templates.append((template_id, f.read()))
+    if not templates:
+        raise ValueError(f"No template files found in {directory}")
+    return templates
+
+# Scorers for template experiments; scores are in [0, 1]
+SCORERS = {
+    "contains": "Output contains the expected text",
+    "regex": "Output matches a regular expression",
+    "json": "Output is valid JSON",
+    "llm_judge": "An LLM rates the output from 0 to 10"
+}
+
+def score_output(scorer: Dict[str, Any], output: str, combo: Dict[str, Any], prompt: str,
+                 judge: Optional["RequestDispatcher"] = None) -> Optional[float]:
+    """
+    Score an output for a template experiment.
+    
+    Args:
+        scorer: Scorer settings: "type" (a SCORERS key) and "expected" (a template
+                rendered with the combination), "pattern" or "judge_template" and "judge_model"
+        output: The full output
+        combo: The combination of variable values
+        prompt: The rendered prompt
+        judge: Dispatcher of the judge model, for "llm_judge"
+    
+    Returns:
+        Score between 0 and 1, or None if the judge gave no usable rating
+    """
+    if scorer["type"] == "contains":
+        expected = render_template(scorer["expected"], combo).strip()
+        return 1.0 if expected and expected.lower() in output.lower() else 0.0
+    if scorer["type"] == "regex":
+        return 1.0 if re.search(scorer["pattern"], output, re.DOTALL) else 0.0
+    if scorer["type"] == "json":
+        # Allow the JSON to be wrapped in a Markdown code block
+        text = re.sub(r'^```(?:json)?\s*|\s*```$', '', output.strip())
+        try:
+            json.loads(text)
+            return 1.0
+        except ValueError:
+            return 0.0
+    
+    judge_prompt = render_template(scorer["judge_template"], dict(combo, prompt=prompt, output=output))
+    result = judge.call({"index": 0, "key": (), "prompt": judge_prompt, "estimated_cost": 0.0})
+    match = re.search(r'\d+(?:\.\d+)?', result["output"]) if result["error_type"] is None else None
+    if match is None:
+        return None
+    return min(max(float(match.group()) / 10.0, 0.0), 1.0)
+
+class TemplateBandit:
+    """
+    Allocates calls between competing templates and eliminates those unlikely to be best.
+    
+    Every template first gets min_calls calls in turn. After that, each call
+    goes to the template with the highest Thompson sample from the Beta
+    posterior of its scores, so better templates get more of the budget
+    while weaker ones are still explored. Once every active template has
+    min_calls scores, a template whose posterior probability of being the
+    best falls below a threshold is eliminated.
+    
+    Checking after every score would peek at the data again and again, and
+    each look is another chance to drop the best template by bad luck. So the
+    posterior is only checked each time the number of scores doubles, and the
+    k-th check uses the threshold (1 - confidence) * 6 / (pi^2 k^2): the
+    thresholds of all checks add up to at most 1 - confidence.
+    """
+    
+    # Posterior samples used to estimate each template's probability of being best (at least;
+    # more are drawn when the threshold is small, so it stays well above the resolution)
+    P_BEST_SAMPLES = 2000
+    
+    def __init__(self, template_ids: List[str], confidence: float = 0.95, min_calls: int = 5, seed: int = 0):
+        """
+        Args:
+            template_ids: IDs of the competing templates
+            confidence: Probability of being best below which (as 1 - confidence) a template is eliminated
+            min_calls: Calls (and scores) each template gets before allocation and elimination start
+            seed: Seed of the random number generator, so allocations are reproducible
+        """
+        self.lock = threading.Lock()
+        self.random = random.Random(seed)
+        self.confidence = confidence
+        self.min_calls = max(int(min_calls), 1)
+        self.stats = {template_id: {"calls": 0, "scored": 0, "total": 0.0, "status": "active",
+                                    "p_best": None, "eliminated_after": None} for template_id in template_ids}
+        self.history = []
+        self.looks = 0
+        self.next_look = self.min_calls * len(template_ids)
+    
+    def active(self) -> List[str]:
+        """
+        Return the IDs of the templates that have not been eliminated.
+        """
+        with self.lock:
+            return [template_id for template_id, stats in self.stats.items() if stats["status"] == "active"]
+    
+    def choose(self) -> str:
+        """
+        Pick the template for the next call and count the call.
+        """
+        with self.lock:
+            active = [template_id for template_id, stats in self.stats.items() if stats["status"] == "active"]
+            warming_up = [template_id for template_id in active if self.stats[template_id]["calls"] < self.min_calls]
+            if warming_up:
+                choice = min(warming_up, key=lambda template_id: self.stats[template_id]["calls"])
+            else:
+                choice = max(active, key=self._sample)
+            self.stats[choice]["calls"] += 1
+            self.history.append({"type": "dispatch", "template": choice, "calls": self.stats[choice]["calls"]})
+            return choice
+    
+    def _sample(self, template_id: str) -> float:
+        stats = self.stats[template_id]
+        return self.random.betavariate(1.0 + stats["total"], 1.0 + stats["scored"] - stats["total"])
+    
+    def record(self, template_id: str, score: Optional[float]):
+        """
+        Record the score of a call (None if it could not be scored) and eliminate clear losers.
+        """
+        with self.lock:
+            if score is None:
+                self.history.append({"type": "unscored", "template": template_id})
+                return
+            stats = self.stats[template_id]
+            stats["scored"] += 1
+            stats["total"] += score
+            self.history.append({"type": "score", "template": template_id, "score": round(score, 3)})
+            self._eliminate()
+    
+    def _eliminate(self):
+        active = [template_id for template_id, stats in self.stats.items() if stats["status"] == "active"]
+        if len(active) < 2 or any(self.stats[template_id]["scored"] < self.min_calls for template_id in active):
+            return
+        scored = sum(stats["scored"] for stats in self.stats.values())
+        if scored < self.next_look:
+            return
+        self.looks += 1
+        self.next_look = scored * 2
+        threshold = (1.0 - self.confidence) * 6.0 / (math.pi ** 2 * self.looks ** 2)
+        samples = max(self.P_BEST_SAMPLES, int(20 / threshold))
+        wins = Counter(max(active, key=self._sample) for _ in range(samples))
+        best = max(active, key=lambda template_id: wins[template_id])
+        for template_id in active:
+            stats = self.stats[template_id]
+            stats["p_best"] = round(wins[template_id] / samples, 6)
+            if template_id != best and stats["p_best"] < threshold:
+                stats["status"] = "eliminated"
+                stats["eliminated_after"] = stats["scored"]
+                self.history.append({"type": "eliminate", "template": template_id, "p_best": stats["p_best"],
+                                     "threshold": round(threshold, 5),
+                                     "mean_score": round(stats["total"] / stats["scored"], 3), "best": best})
+
+class TemplateExperiment:
+    """
+    Runs competing templates over one combination stream, with a TemplateBandit choosing the template per call.
+    
+    The template is chosen when the dispatcher pulls the next combination, so
+    allocation uses every score available at that moment. Outputs are scored
+    on worker threads, since an LLM judge makes calls of its own (through its
+    own dispatcher, so they count against the shared limits and metrics).
+    """
+    
+    def __init__(self, templates: List[Tuple[str, str]], scorer: Dict[str, Any], judge: Optional["RequestDispatcher"],
+                 bandit: TemplateBandit, output_history: Optional[Dict[str, Any]], max_tokens: int,
+                 workers: int, stop_early: bool = True, token_sizing: Optional[Dict[str, Any]] = None):
+        """
+        Args:
+            templates: (template ID, template) tuples from split_templates()
+            scorer: Scorer settings (see score_output())
+            judge: Dispatcher of the judge model for "llm_judge", or None
+            bandit: The allocator
+            output_history: Result of load_output_history() for cost estimates, or None
+            max_tokens: Maximum output tokens per call
+            workers: Number of scoring threads
+            stop_early: End the experiment once a single template remains
+            token_sizing: Settings for auto_max_tokens(), or None
+        """
+        self.templates = dict(templates)
+        self.scorer = scorer
+        self.judge = judge
+        self.bandit = bandit
+        self.output_history = output_history
+        self.max_tokens = max_tokens
+        self.stop_early = stop_early
+        self.token_sizing = token_sizing
+        self.stopped_early = False
+        self.executor = ThreadPoolExecutor(max_workers=max(int(workers), 1), thread_name_prefix="pvt-score")
+        self.futures = []
+    
+    def requests(self, source):
+        """
+        Turn (index, combination) tuples from a PlanPipeline into requests, choosing a template for each.
         
-        # Add prompt
-        prompt_elem = ET.SubElement(input_elem, "prompt")
-        prompt_elem.text = input_data["prompt"]
+        Args:
+            source: PlanPipeline.requests() of a pipeline without a prompt template
         
-        # Add output
-        output_elem = ET.SubElement(input_elem, "output")
-        output_elem.text = input_data["output"]
+        Yields:
+            Requests with a "template_id", or None while no combination is ready
+        """
+        for item in source:
+            if item is None:
+                yield None
+                continue
+            if self.stop_early and len(self.bandit.active()) == 1:
+                self.stopped_early = True
+                return
+            index, combo = item
+            template_id = self.bandit.choose()
+            request = build_request(index, combo, self.templates[template_id], self.output_history, self.max_tokens,
+                                    self.token_sizing)
+            request["template_id"] = template_id
+            yield request
     
-    # Write to file with pretty formatting
-    tree = ET.ElementTree(root)
-    xml_str = ET.tostring(root, encoding='utf-8')
-    pretty_xml = md.parseString(xml_str).toprettyxml(indent="  ")
+    def score(self, request: Dict[str, Any], result: Dict[str, Any], record: Dict[str, Any]):
+        """
+        Score a completed call in the background, updating its input record and the bandit.
+        
+        Failed calls are not scored, so errors such as rate limits do not count against a template.
+        """
+        template_id = request["template_id"]
+        if result["error_type"] is not None:
+            self.bandit.record(template_id, None)
+            return
+        output = read_output(result)
+        
+        def run():
+            try:
+                record["score"] = score_output(self.scorer, output, request["combo"], request["prompt"], self.judge)
+            except Exception as e:
+                print(f"Could not score output: {e}", file=sys.stderr)
+                record["score"] = None
+            self.bandit.record(template_id, record["score"])
+        
+        self.futures.append(self.executor.submit(run))
     
-    # Create directory if it doesn't exist
-    os.makedirs(os.path.dirname(log_file), exist_ok=True)
+    def finish(self) -> Dict[str, Any]:
+        """
+        Wait for the outstanding scores and summarize the experiment.
+        
+        Returns:
+            Dictionary with the scorer settings, per-template results, the winner and the allocation history
+        """
+        wait(self.futures)
+        self.executor.shutdown()
+        templates = []
+        for template_id, stats in self.bandit.stats.items():
+            templates.append({
+                "id": template_id,
+                "calls": stats["calls"],
+                "scored": stats["scored"],
+                "mean_score": round(stats["total"] / stats["scored"], 3) if stats["scored"] else None,
+                "p_best": stats["p_best"],
+                "status": stats["status"],
+                "eliminated_after": stats["eliminated_after"],
+                "template": self.templates[template_id]
+            })
+        scored = [template for template in templates if template["status"] == "active" and template["scored"]]
+        return {
+            "scorer": self.scorer["type"],
+            "confidence": self.bandit.confidence,
+            "min_calls": self.bandit.min_calls,
+            "looks": self.bandit.looks,
+            "stopped_early": self.stopped_early,
+            "winner": max(scored, key=lambda template: template["mean_score"])["id"] if scored else None,
+            "templates": templates,
+            "history": self.bandit.history
+        }
+
+def watched_files(variables: Dict[str, Any]) -> List[str]:
+    """
+    List the files referenced by the variable definitions.
     
-    with open(log_file, "w", encoding="utf-8") as f:
-        f.write(pretty_xml)
+    Directories are listed again on every call, so added and removed files are picked up.
+    
+    Args:
+        variables: Dictionary of parsed variables
+    
+    Returns:
+        List of file paths
+    """
+    paths = []
+    for var_value in variables.values():
+        if isinstance(var_value, dict):
+            if var_value['type'] in ('file', 'lines', 'jsonl', 'csv'):
+                paths.append(var_value['path'])
+            elif var_value['type'] == 'dir':
+                paths.extend(list_dir_files(var_value['path'], var_value['recursive']))
+    return paths
+
+def detect_changed_files(variables: Dict[str, Any], file_hashes: Dict[str, Tuple]) -> List[str]:
+    """
+    Find watched files whose content changed since the previous check.
+    
+    Files are only re-hashed when their modification time or size changed, and
+    a file only counts as changed when its content hash differs.
+    
+    Args:
+        variables: Dictionary of parsed variables
+        file_hashes: Path -> (mtime_ns, size, sha256) from the previous check; updated in place
+    
+    Returns:
+        Paths that were added, removed or modified
+    """
+    changed = []
+    current_paths = set()
+    for path in watched_files(variables):
+        current_paths.add(path)
+        try:
+            stat = os.stat(path)
+        except OSError:
+            continue
+        previous = file_hashes.get(path)
+        if previous and previous[0] == stat.st_mtime_ns and previous[1] == stat.st_size:
+            continue
+        try:
+            with open(path, 'rb') as file:
+                digest = hashlib.sha256(file.read()).hexdigest()
+        except OSError:
+            continue
+        file_hashes[path] = (stat.st_mtime_ns, stat.st_size, digest)
+        if previous is None or previous[2] != digest:
+            changed.append(path)
+    
+    for path in list(file_hashes):
+        if path not in current_paths:
+            del file_hashes[path]
+            changed.append(path)
+    
+    return changed
+
+def watch_inputs(variables: Dict[str, Any], prompt_template: str, dispatcher: RequestDispatcher,
+                 max_iterations: int, session_data: Dict[str, Any], map_reduce: Optional[Dict[str, Any]],
+                 placeholders: Dict[Tuple, Any],
+                 log_file: str, poll_interval: float, widget_ids,
+                 output_history: Optional[Dict[str, Any]] = None, token_sizing: Optional[Dict[str, Any]] = None):
+    """
+    Poll the watched files and re-run only the combinations affected by a change.
+    
+    Changed files trigger a re-expansion of the variables; combinations whose
+    rendered prompt is unchanged keep their result, new or changed ones are
+    dispatched again, and combinations whose files disappeared are dropped.
+    The session view and its record in the log are updated in place. Runs
+    until the Streamlit script is stopped.
+    
+    Args:
+        variables: Dictionary of parsed variables
+        prompt_template: The prompt template
+        dispatcher: Dispatcher used for the re-runs
+        max_iterations: Maximum number of combinations
+        session_data: Session record, updated in place
+        map_reduce: Map-reduce settings for oversized variables, or None
+        placeholders: occurrence_key() -> st.empty() slot holding its display
+        log_file: Log file the session was written to
+        poll_interval: Seconds between checks
+        widget_ids: Shared itertools.count() for unique widget keys
+        output_history: Result of load_output_history() the session was planned with, or None;
+                        re-runs are ordered and sized from it like the first run
+        token_sizing: Settings for auto_max_tokens(), or None to use max_tokens for every call
+    """
+    file_hashes = {}
+    detect_changed_files(variables, file_hashes)
+    seen = Counter()
+    prompt_hashes = {
+        occurrence_key(combination_key(input_data["variables"]), seen):
+            hashlib.sha256(render_template(prompt_template, input_data["variables"]).encode("utf-8")).hexdigest()
+        for input_data in session_data["inputs"]
+    }
+    
+    status = st.empty()
+    status.info(f"Watching {len(file_hashes)} files for changes. Stop the app to end watch mode.")
+    
+    while True:
+        time.sleep(poll_interval)
+        changed = detect_changed_files(variables, file_hashes)
+        if not changed:
+            continue
+        
+        status.info(f"{len(changed)} file(s) changed at {datetime.datetime.now():%H:%M:%S}, re-running affected combinations...")
+        seen = Counter()
+        inputs_by_key = {occurrence_key(combination_key(input_data["variables"]), seen): input_data
+                         for input_data in session_data["inputs"]}
+        seen = Counter()
+        seen_keys = set()
+        requests = []
+        map_reduce_jobs = []
+        positions = {key: position for position, key in enumerate(placeholders)}
+        
+        for combo in itertools.islice(iter_combinations(variables), max_iterations):
+            key = occurrence_key(combination_key(combo), seen)
+            seen_keys.add(key)
+            prompt_hash = hashlib.sha256(render_template(prompt_template, combo).encode("utf-8")).hexdigest()
+            if prompt_hashes.get(key) == prompt_hash:
+                continue
+            
+            if key not in placeholders:
+                placeholders[key] = st.empty()
+                positions[key] = len(positions)
+            index = positions[key]
+            chunk_var = chunked_variable(combo, map_reduce) if map_reduce else None
+            if chunk_var:
+                map_reduce_jobs.append(plan_map_reduce(index, combo, chunk_var, map_reduce, placeholders[key], widget_ids))
+                map_reduce_jobs[-1]["key"] = key
+            else:
+                requests.append(plan_request(index, combo, prompt_template, placeholders[key], widget_ids,
+                                             output_history, dispatcher.llm_params.get("max_tokens", 1024),
+                                             token_sizing))
+                requests[-1]["key"] = key
+            prompt_hashes[key] = prompt_hash
+        
+        results = dispatcher.run(requests)
+        if map_reduce_jobs:
+            results = itertools.chain(results, run_map_reduce(map_reduce_jobs, dispatcher, map_reduce))
+        for request, result in results:
+            remove_output_file(inputs_by_key.get(request["key"], {}))
+            inputs_by_key[request["key"]] = complete_request(request, result, placeholders[request["key"]], widget_ids)
+        rerun_count = len(requests) + len(map_reduce_jobs)
+
+        # Drop combinations whose inputs no longer exist
+        for key in list(placeholders):
+            if key not in seen_keys:
+                placeholders.pop(key).empty()
+                remove_output_file(inputs_by_key.pop(key, {}))
+                prompt_hashes.pop(key, None)
+        
+        session_data["inputs"] = [inputs_by_key[key] for key in placeholders]
+        try:
+            log_session(log_file, session_data)
+        except Exception as e:
+            st.error(f"Error logging session: {e}")
+        status.info(f"Re-ran {rerun_count} combination(s) at {datetime.datetime.now():%H:%M:%S}. "
+                    f"Watching {len(file_hashes)} files for changes.")
+
+def queue_failed_inputs(session_data: Dict[str, Any], llm_params: Dict[str, Any],
+                        dispatcher_args: Dict[str, Any], log_file: str) -> int:
+    """
+    Keep a session's failed combinations in the retry queue of the Streamlit session.
+    
+    Args:
+        session_data: Session record whose inputs carry a status
+        llm_params: LLM parameters used for the calls
+        dispatcher_args: Keyword arguments the RequestDispatcher was created with
+        log_file: Log file the session was written to
+    
+    Returns:
+        Number of failed combinations
+    """
+    # Map-reduce inputs are not retried on their own; re-run the session for those
+    failed = [index for index, input_data in enumerate(session_data["inputs"])
+              if input_data.get("status") == "error" and input_data.get("intermediate") is None]
+    st.session_state["retry_queue"] = {
+        "session_data": session_data,
+        "llm_params": llm_params,
+        "dispatcher_args": dispatcher_args,
+        "log_file": log_file,
+        "failed": failed
+    }
+    return len(failed)
+
+def retry_failed_inputs(retry_queue: Dict[str, Any], widget_ids):
+    """
+    Re-dispatch only the failed combinations of a session and patch the results into its record.
+    
+    The session keeps its id, so log_session() replaces its earlier record in
+    the log. Combinations that fail again stay in the queue. Each retry keeps
+    the max_tokens its combination was sized with.
+    
+    Args:
+        retry_queue: Retry queue created by queue_failed_inputs(), updated in place
+        widget_ids: Shared itertools.count() for unique widget keys
+    """
+    session_data = retry_queue["session_data"]
+    dispatcher = RequestDispatcher(retry_queue["llm_params"], **retry_queue["dispatcher_args"])
+    
+    st.subheader("Retried Combinations")
+    slots = {}
+    requests = []
+    for index in retry_queue["failed"]:
+        input_data = session_data["inputs"][index]
+        slots[index] = st.empty()
+        with slots[index].container():
+            display_combination(index, input_data["variables"], input_data["prompt"], None, widget_ids)
+        requests.append({
+            "index": index,
+            "key": combination_key(input_data["variables"]),
+            "combo": input_data["variables"],
+            "prompt": input_data["prompt"],
+            "estimated_cost": 0.0,
+            "template_id": input_data.get("template_id"),
+            "template_hash": input_data.get("template_hash"),
+            "max_tokens": input_data.get("max_tokens")
+        })
+    
+    with st.spinner(f"Retrying {len(requests)} failed combination(s)..."):
+        for request, result in dispatcher.run(requests):
+            session_data["inputs"][request["index"]] = complete_request(request, result, slots[request["index"]],
+                                                                        widget_ids)
+    
+    metrics = session_data.setdefault("metrics", {})
+    metrics["retried"] = metrics.get("retried", 0) + len(requests)
+    retry_queue["failed"] = [index for index in retry_queue["failed"]
+                             if session_data["inputs"][index]["status"] == "error"]
+    
+    try:
+        log_session(retry_queue["log_file"], session_data)
+    except Exception as e:
+        st.error(f"Error logging session: {e}")
+        return
+    recovered = len(requests) - len(retry_queue["failed"])
+    if retry_queue["failed"]:
+        st.warning(f"{recovered} of {len(requests)} combination(s) succeeded on retry; "
+                   f"{len(retry_queue['failed'])} still failed.")
+    else:
+        st.success(f"All {len(requests)} retried combination(s) succeeded. Session updated in {retry_queue['log_file']}")
+
+class SessionProfiler:
+    """
+    Sampling CPU profiler combined with tracemalloc snapshots at stage boundaries.
+    
+    A background thread samples the stacks of the profiled thread (and any
+    worker threads whose name starts with "pvt-") at a fixed interval, so the
+    report reflects where wall-clock time goes, including time spent waiting on
+    the API. Memory is tracked per stage with tracemalloc.
+    """
+    
+    def __init__(self, interval: float = 0.005, top_n: int = 20):
+        """
+        Args:
+            interval: Seconds between stack samples
+            top_n: Number of functions and allocation sites to include in the report
+        """
+        self.interval = interval
+        self.top_n = top_n
+        self.self_samples = Counter()
+        self.total_samples = Counter()
+        self.num_samples = 0
+        self.stages = []
+        self.current_stage = None
+        self.largest_snapshot = None
+        self.largest_snapshot_size = 0
+        self._target_thread_id = None
+        self._stop_event = threading.Event()
+        self._sampler = None
+        self._started_tracemalloc = False
+    
+    def start(self):
+        """
+        Start sampling and memory tracing for the calling thread.
+        """
+        self._target_thread_id = threading.get_ident()
+        if not tracemalloc.is_tracing():
+            tracemalloc.start(10)
+            self._started_tracemalloc = True
+        self._stop_event.clear()
+        self._sampler = threading.Thread(target=self._sample_loop, name="profiler-sampler", daemon=True)
+        self._sampler.start()
+    
+    def stop(self):
+        """
+        Stop sampling and memory tracing.
+        """
+        self._stop_event.set()
+        if self._sampler is not None:
+            self._sampler.join()
+            self._sampler = None
+        if self._started_tracemalloc:
+            tracemalloc.stop()
+            self._started_tracemalloc = False
+    
+    def _sample_loop(self):
+        sampler_id = threading.get_ident()
+        while not self._stop_event.wait(self.interval):
+            names = {t.ident: t.name for t in threading.enumerate()}
+            for thread_id, frame in sys._current_frames().items():
+                if thread_id == sampler_id:
+                    continue
+                if thread_id != self._target_thread_id and not names.get(thread_id, "").startswith("pvt-"):
+                    continue
+                self._record_stack(frame)
+    
+    def _record_stack(self, frame):
+        leaf = True
+        seen = set()
+        while frame is not None:
+            code = frame.f_code
+            key = f"{code.co_name} ({os.path.basename(code.co_filename)}:{code.co_firstlineno})"
+            if leaf:
+                self.self_samples[key] += 1
+                leaf = False
+            if key not in seen:
+                self.total_samples[key] += 1
+                seen.add(key)
+            frame = frame.f_back
+        self.num_samples += 1
+    
+    def _take_snapshot(self):
+        # Exclude the profiler's own bookkeeping from the statistics
+        return tracemalloc.take_snapshot().filter_traces((
+            tracemalloc.Filter(False, tracemalloc.__file__),
+            tracemalloc.Filter(False, threading.__file__),
+        ))
+    
+    @contextlib.contextmanager
+    def stage(self, name: str):
+        """
+        Measure wall time, CPU time and memory for a named stage of the session.
+        
+        Args:
+            name: Stage name used in the report
+        """
+        tracemalloc.reset_peak()
+        start_snapshot = self._take_snapshot()
+        start_current, _ = tracemalloc.get_traced_memory()
+        start_wall = time.perf_counter()
+        start_cpu = time.process_time()
+        start_samples = self.num_samples
+        self.current_stage = name
+        try:
+            yield
+        finally:
+            end_current, peak = tracemalloc.get_traced_memory()
+            end_snapshot = self._take_snapshot()
+            if end_current > self.largest_snapshot_size:
+                self.largest_snapshot = end_snapshot
+                self.largest_snapshot_size = end_current
+            growth = end_snapshot.compare_to(start_snapshot, "lineno")
+            self.stages.append({
+                "name": name,
+                "wall": time.perf_counter() - start_wall,
+                "cpu": time.process_time() - start_cpu,
+                "samples": self.num_samples - start_samples,
+                "start_memory": start_current,
+                "end_memory": end_current,
+                "peak_memory": peak,
+                "top_growth": [stat for stat in growth if stat.size_diff > 0][:5]
+            })
+            self.current_stage = None
+    
+    @contextlib.contextmanager
+    def thread_stage(self, name: str):
+        """
+        Measure a stage that runs on its own thread while the script thread is in another stage.
+        
+        CPU time is the thread's own. Memory is traced for the whole process:
+        the peak is the highest traced memory seen by the callable this yields,
+        which the stage calls as it works. The growth between the stage's
+        start and end includes what other threads allocated meanwhile; the
+        growth sites tell the stage's own allocations apart.
+        
+        Args:
+            name: Stage name used in the report
+        """
+        start_snapshot = self._take_snapshot()
+        start_current, _ = tracemalloc.get_traced_memory()
+        start_wall = time.perf_counter()
+        start_cpu = time.thread_time()
+        peak = [start_current]
+        
+        def note_memory():
+            peak[0] = max(peak[0], tracemalloc.get_traced_memory()[0])
+        
+        try:
+            yield note_memory
+        finally:
+            # The profiler may have been stopped already if the session ended early
+            if tracemalloc.is_tracing():
+                end_current, _ = tracemalloc.get_traced_memory()
+                growth = self._take_snapshot().compare_to(start_snapshot, "lineno")
+                self.stages.append({
+                    "name": f"{name} (thread)",
+                    "wall": time.perf_counter() - start_wall,
+                    "cpu": time.thread_time() - start_cpu,
+                    "samples": None,
+                    "start_memory": start_current,
+                    "end_memory": end_current,
+                    "peak_memory": max(peak[0], end_current),
+                    "top_growth": [stat for stat in growth if stat.size_diff > 0][:5]
+                })
+    
+    def format_report(self) -> str:
+        """
+        Format the collected samples and memory statistics as a plain-text report.
+        
+        Returns:
+            The report text
+        """
+        def mb(num_bytes):
+            return f"{num_bytes / (1024 * 1024):.2f} MB"
+        
+        lines = [f"Session profile ({self.num_samples} samples every {self.interval * 1000:.1f} ms)", ""]
+        
+        lines.append("Stages:")
+        for stage in self.stages:
+            lines.append(
+                f"  {stage['name']}: wall {stage['wall']:.3f}s, cpu {stage['cpu']:.3f}s, "
+                f"peak {mb(stage['peak_memory'])}, "
+                f"memory {mb(stage['start_memory'])} -> {mb(stage['end_memory'])}"
+            )
+            for stat in stage["top_growth"]:
+                frame = stat.traceback[0]
+                lines.append(f"      +{mb(stat.size_diff)} at {frame.filename}:{frame.lineno}")
+        lines.append("")
+        
+        for title, counter in (("Top functions (self samples):", self.self_samples),
+                               ("Top functions (cumulative samples):", self.total_samples)):
+            lines.append(title)
+            for key, count in counter.most_common(self.top_n):
+                share = 100.0 * count / max(self.num_samples, 1)
+                lines.append(f"  {count:8d} {share:6.1f}%  {key}")
+            lines.append("")
+        
+        lines.append("Largest allocations (at highest stage-end memory):")
+        if self.largest_snapshot is not None:
+            for stat in self.largest_snapshot.statistics("lineno")[:self.top_n]:
+                frame = stat.traceback[0]
+                lines.append(f"  {mb(stat.size):>12} in {stat.count:8d} blocks  {frame.filename}:{frame.lineno}")
+        
+        return "\n".join(lines) + "\n"
+    
+    def save_report(self, log_file: str) -> str:
+        """
+        Save the report next to the session log.
+        
+        Args:
+            log_file: Path to the session log file
+            
+        Returns:
+            Path of the written report
+        """
+        report_path = os.path.splitext(log_file)[0] + "_profile.txt"
+        os.makedirs(os.path.dirname(report_path) or ".", exist_ok=True)
+        with open(report_path, "w", encoding="utf-8") as f:
+            f.write(self.format_report())
+        return report_path
+
+def profile_stage(profiler: Optional[SessionProfiler], name: str):
+    """
+    Return a context manager for a profiled stage, or a no-op if profiling is off.
+    
+    Args:
+        profiler: Active profiler or None
+        name: Stage name
+    """
+    if profiler is None:
+        return contextlib.nullcontext()
+    return profiler.stage(name)
+
+def profile_thread_stage(profiler: Optional[SessionProfiler], name: str):
+    """
+    Return a context manager for a stage on a worker thread (see SessionProfiler.thread_stage()),
+    or a no-op if profiling is off. Either yields a callable to call as the stage works.
+    """
+    if profiler is None:
+        return contextlib.nullcontext(lambda: None)
+    return profiler.thread_stage(name)
 
 def main():
     """
@@ -318,27 +4398,203 @@ def main():
     st.sidebar.header("LLM Parameters")
     
     api_key = st.sidebar.text_input("API Key", type="password")
+    model_options = ["claude-3-7-sonnet-latest", "claude-3-5-haiku-latest", "claude-3-haiku-20240307"]
     model = st.sidebar.selectbox(
         "Model", 
-        ["claude-3-7-sonnet-latest", "claude-3-5-haiku-latest", "claude-3-haiku-20240307"]
+        model_options
     )
     temperature = st.sidebar.slider("Temperature", 0.0, 1.0, 0.7)
     max_tokens = st.sidebar.number_input("Max Tokens", 1, 128000, 32000)
+    auto_tokens = st.sidebar.checkbox("Size max tokens from history", value=False,
+                                      help="Set max_tokens per template and model from the output lengths of "
+                                           "earlier sessions in the log directory, up to Max Tokens")
+    if auto_tokens:
+        auto_tokens_percentile = st.sidebar.slider("Output length percentile", 50, 100, 95,
+                                                   help="Percentile of earlier output tokens the limit is based on")
+        auto_tokens_margin = st.sidebar.number_input("Safety margin (%)", 0, 1000, 25)
+        auto_tokens_min_samples = st.sidebar.number_input("Minimum earlier outputs", 1, 100000, 20,
+                                                          help="Templates with fewer earlier outputs use Max Tokens")
     top_p = st.sidebar.slider("Top P", 0.0, 1.0, 1.0)
     system_prompt = st.sidebar.text_area("System Prompt", "")
     
+    backend_labels = {
+        "anthropic": "Anthropic API",
+        "record": "Anthropic API (record fixtures)",
+        "replay": "Replay fixtures (offline)",
+        "mock": "Mock responses (offline)"
+    }
+    backend = st.sidebar.selectbox("Backend", list(backend_labels.keys()),
+                                   format_func=lambda key: backend_labels[key],
+                                   help="Record request/response pairs to a fixture file, or replay them without calling the API")
+    fixture_path = ""
+    replay_latency = False
+    mock_latency = 1.0
+    mock_output_chars = 2000
+    if backend in ("record", "replay"):
+        fixture_path = st.sidebar.text_input("Fixture File Path", "~/logs/pvt_fixtures/fixtures.jsonl")
+    if backend == "replay":
+        replay_latency = st.sidebar.checkbox("Reproduce recorded latency", value=False,
+                                             help="Sleep for the recorded duration of each call before returning it")
+    if backend == "mock":
+        mock_latency = st.sidebar.number_input("Mock latency (seconds)", 0.0, 600.0, 1.0)
+        mock_output_chars = st.sidebar.number_input("Mock output length (characters)", 1, 10000000, 2000)
+    
+    st.sidebar.markdown("---")
+    st.sidebar.header("Reliability")
+    connect_timeout = st.sidebar.number_input("Connect timeout (seconds)", 1.0, 120.0, 10.0)
+    read_timeout = st.sidebar.number_input("Read timeout (seconds)", 5.0, 3600.0, 600.0,
+                                           help="Longest wait for the next chunk of a streamed response")
+    fallback_models = st.sidebar.multiselect("Fallback models", [option for option in model_options if option != model],
+                                             help="Models tried in order when a call fails with an overload, server, "
+                                                  "timeout or connection error")
+    breaker_threshold = st.sidebar.number_input("Circuit breaker threshold", 1, 100, 5,
+                                                help="Consecutive overload errors after which a model gets no calls "
+                                                     "until the cooldown has passed")
+    breaker_cooldown = st.sidebar.number_input("Circuit breaker cooldown (seconds)", 1.0, 600.0, 30.0)
+    
+    st.sidebar.markdown("---")
+    st.sidebar.header("Shared API Limits")
+    client_id = st.session_state.setdefault("client_id", uuid.uuid4().hex[:8])
+    session_label = st.sidebar.text_input("Session label", "",
+                                          help="Name shown to other users of this server in the API usage panel "
+                                               "and used as the session label of the metrics; sessions without "
+                                               "one are reported together as \"unlabelled\"")
+    client_label = session_label or f"session-{client_id}"
+    # A label per browser session would make the number of metric series grow without bound
+    metrics_label = session_label or "unlabelled"
+    shared_concurrency = st.sidebar.number_input("Shared concurrency limit", 0, 1000, 0,
+                                                 help="Maximum calls in flight for this API key across all sessions "
+                                                      "on this server, shared fairly between them. Applies to everyone "
+                                                      "once a run starts; 0 keeps the limit currently in effect")
+    shared_tpm = st.sidebar.number_input("Shared tokens per minute", 0, 100000000, 0,
+                                         help="Estimated prompt and output tokens per minute for this API key across "
+                                              "all sessions on this server; 0 keeps the limit currently in effect")
+    
+    st.sidebar.markdown("---")
+    st.sidebar.header("Monitoring")
+    metrics_port = st.sidebar.number_input("Metrics port", 0, 65535, 0,
+                                           help="Serve request, token, latency and queue metrics in the Prometheus "
+                                                "text format at http://127.0.0.1:<port>/metrics; 0 disables")
+    metrics_file = st.sidebar.text_input("Metrics file", "",
+                                         help="Rewrite the same metrics to this file periodically (e.g. for a "
+                                              "textfile collector); empty disables")
+    metrics_interval = 15.0
+    if metrics_file:
+        metrics_interval = st.sidebar.number_input("Metrics file interval (seconds)", 1.0, 3600.0, 15.0)
+    
     st.sidebar.markdown("---")
     st.sidebar.header("Application Settings")
-    max_iterations = st.sidebar.number_input("Max Iterations", 1, 100, 10, 
+    max_iterations = st.sidebar.number_input("Max Iterations", 1, 1000000, 10, 
                                            help="Maximum number of combinations to process")
+    concurrency = st.sidebar.number_input("Concurrency", 1, 64, 4,
+                                          help="Maximum number of LLM calls in flight at once")
+    adaptive_concurrency = st.sidebar.checkbox("Adapt concurrency", value=False,
+                                               help="Start with 2 calls in flight and raise the limit while calls "
+                                                    "succeed at steady latency; halve it on rate-limit or overload "
+                                                    "errors. Concurrency is the maximum")
+    scheduling_policy = st.sidebar.selectbox(
+        "Scheduling Policy", list(SCHEDULING_POLICIES.keys()),
+        help="Order in which pending requests are started. longest_first estimates each request's duration "
+             "from its prompt size and the output lengths of earlier sessions, which shortens the tail of slow calls"
+    )
+    hedge_requests = st.sidebar.checkbox("Hedge slow requests", value=False,
+                                         help="Start a duplicate of a call that runs longer than most, use whichever "
+                                              "finishes first and cancel the other")
+    hedge_percentile = None
+    hedge_budget = 0.1
+    if hedge_requests:
+        hedge_percentile = st.sidebar.slider("Hedge after latency percentile", 50, 99, 95)
+        hedge_budget = st.sidebar.slider("Max extra calls (% of requests)", 1, 50, 10) / 100.0
+    spill_threshold = st.sidebar.number_input("Spill outputs larger than (characters)", 0, 10000000, 100000,
+                                              help="Longer responses are written to files next to the log as they "
+                                                   "stream in; only a preview is kept on the page and in the log. "
+                                                   "0 keeps every response in memory")
+    pack_inputs = st.sidebar.checkbox("Pack small inputs", value=False,
+                                      help="Send several combinations in one request and split the answers apart; "
+                                           "packs whose answers cannot be split are re-sent one combination at a time")
+    pack_token_budget = 4000
+    pack_max_items = 20
+    if pack_inputs:
+        pack_token_budget = st.sidebar.number_input("Pack token budget", 100, 200000, 4000,
+                                                    help="Maximum estimated prompt tokens of a packed request")
+        pack_max_items = st.sidebar.number_input("Max inputs per pack", 2, 500, 20)
+    expand_depth = st.sidebar.number_input("Expansion queue depth", 1, 100000, 64,
+                                           help="Combinations read ahead of rendering; expansion waits while "
+                                                "this many are queued")
+    render_depth = st.sidebar.number_input("Render queue depth", 1, 100000, 64,
+                                           help="Rendered prompts waiting for dispatch; rendering waits while "
+                                                "this many are queued")
+    lookahead = st.sidebar.number_input("Scheduling lookahead", 1, 1000000, 256,
+                                        help="Requests the scheduler holds and orders by the scheduling policy "
+                                             "before starting them")
     log_file = st.sidebar.text_input("Log File Path", "~/logs/pvt_file_iterative/file_iterative_tests.xml")
     append_datetime = st.sidebar.checkbox("Append datetime to log filename", value=True,
                                      help="Add current date and time to the log file name")
+    with st.sidebar.expander("Log rotation and retention"):
+        log_max_mb = st.number_input("Rotate log at size (MB)", 0, 100000, 100,
+                                     help="Start a new file before a session would be added to a log this large; "
+                                          "0 disables")
+        log_max_age_days = st.number_input("Rotate log after (days)", 0, 3650, 0,
+                                           help="Start a new file once the log's first session is this old; "
+                                                "0 disables")
+        log_compress = st.checkbox("Compress rotated logs", value=True)
+        log_keep = st.number_input("Old logs to keep", 0, 100000, 0,
+                                   help="Rotated and datetime-stamped logs of the same name beyond this many are "
+                                        "deleted, newest kept; 0 keeps all")
+        log_retention_days = st.number_input("Delete old logs after (days)", 0, 3650, 0,
+                                             help="0 keeps them regardless of age")
+        session_index_file = st.text_input("Session index", "~/logs/pvt_session_index.jsonl",
+                                           help="Where every logged session is recorded (file, byte offset, time, "
+                                                "model, template hashes); empty disables")
+    watch_mode = st.sidebar.checkbox("Watch mode", value=False,
+                                     help="After the run, keep polling the files referenced by the variables "
+                                          "and re-run only the combinations whose inputs changed")
+    watch_interval = 2.0
+    if watch_mode:
+        watch_interval = st.sidebar.number_input("Watch poll interval (seconds)", 0.5, 60.0, 2.0)
+    profile_session = st.sidebar.checkbox("Profile session", value=False,
+                                     help="Sample CPU usage and snapshot memory at each stage, "
+                                          "saving a report next to the session log")
+    
+    # Show how the sessions on this server are sharing the API key
+    governor = None
+    if api_key and backend in ("anthropic", "record"):
+        governor = get_api_governor(key_fingerprint(api_key))
+        governor.register(client_id, client_label)
+        with st.expander("Shared API Usage"):
+            limits = []
+            if governor.max_concurrency:
+                limits.append(f"{governor.max_concurrency} calls in flight")
+            if governor.tokens_per_minute:
+                limits.append(f"{governor.tokens_per_minute:,} tokens per minute")
+            st.caption(f"Limits for this API key: {', '.join(limits) or 'none'}"
+                       + (f" (set by {governor.configured_by})" if governor.configured_by else ""))
+            st.dataframe(governor.status(), use_container_width=True)
+            if limits and st.button("Remove shared limits",
+                                    help="Let every session use the API key without the shared limits again"):
+                governor.configure(0, 0, client_label)
+                st.rerun()
+    
+    # Expose the sweep metrics to monitoring systems (shared by all sessions of the server)
+    # Settings are applied when this session changes them, so a session left at the
+    # defaults does not stop the exporters another session started
+    monitor = get_sweep_monitor()
+    metrics_settings = (int(metrics_port), os.path.expanduser(metrics_file) if metrics_file else "", metrics_interval)
+    if st.session_state.get("metrics_settings", (0, "", 15.0)) != metrics_settings:
+        st.session_state["metrics_settings"] = metrics_settings
+        try:
+            get_metrics_exporters().apply(*metrics_settings)
+        except OSError as e:
+            st.sidebar.error(f"Could not serve metrics on port {metrics_port}: {e}")
     
     # Main interface
     prompt_template = st.text_area("Prompt Template", 
                                  "Write a short summary of {{file_content}}.", 
                                  height=200)
+    sweep_templates = st.checkbox("Sweep template variants", value=False,
+                                  help="Render every combination with each variant of the prompt template, "
+                                       "separated by lines like \"=== name ===\". Use $$templates(path) as the "
+                                       "prompt template to read one variant per file in a directory instead.")
     
     # Variable definitions input
     st.subheader("Variable Definitions")
@@ -350,104 +4606,423 @@ def main():
     - `$$dir(path)` - Content of all files in a directory (non-recursive)
     - `$$dir(path, recursive=True)` - Content of all files in a directory (recursive)
     - `$$list([elem1, elem2, ...])` - List of elements
+    - `$$file`/`$$dir` options: `strip_comments=True`, `collapse_whitespace=True`, `drop_license=True`, `max_lines=N`, `chunk_tokens=N` (map-reduce values larger than N tokens)
+    - `$$lines(path)` - One value per line of a file (blank lines skipped unless `skip_blank=False`)
+    - `$$jsonl(path, columns=["a", "b"])` - One record per JSONL line; columns available as `{{var.a}}`
+    - `$$csv(path, columns=["a", "b"], delimiter=",")` - One record per CSV row (first row is the header)
     """)
     
     var_definitions = st.text_area("Variable Definitions", 
                                 "file_content=$$dir(./sample_data)")
     
+    with st.expander("Map-Reduce Templates"):
+        st.markdown("""
+        Used for `$$file`/`$$dir` variables with `chunk_tokens=N` when a value is larger than N estimated tokens:
+        the map template runs on each chunk (`{{chunk}}`, `{{chunk_index}}`, `{{chunk_count}}`), and the reduce
+        template combines the partial results (`{{partials}}`, `{{partial_count}}`), in several rounds if needed.
+        Other variables can be used in both.
+        """)
+        map_template = st.text_area("Map Template",
+                                    "This is part {{chunk_index}} of {{chunk_count}} of a document. "
+                                    "Write a short summary of this part.\n\n{{chunk}}", height=120)
+        reduce_template = st.text_area("Reduce Template",
+                                       "Combine these {{partial_count}} partial summaries of one document into "
+                                       "a single short summary.\n\n{{partials}}", height=120)
+    
+    with st.expander("Template Experiment"):
+        st.markdown("""
+        Compare template variants on the same combinations. Separate the variants in the prompt template
+        with lines like `=== concise ===` (or a bare `===`). Every variant first gets the minimum number of calls;
+        after that, calls go mostly to the variants scoring best, and a variant is dropped once it is unlikely
+        to be the best one. Max Iterations is the call budget.
+        """)
+        run_experiment = st.checkbox("Run as template experiment", value=False)
+        scorer_type = st.selectbox("Scorer", list(SCORERS), format_func=lambda name: f"{name}: {SCORERS[name]}")
+        scorer = {"type": scorer_type}
+        if scorer_type == "contains":
+            scorer["expected"] = st.text_input("Expected text", "{{expected}}",
+                                               help="Rendered with the combination's variables")
+        elif scorer_type == "regex":
+            scorer["pattern"] = st.text_input("Pattern", r"^\s*\S")
+        elif scorer_type == "llm_judge":
+            scorer["judge_template"] = st.text_area(
+                "Judge Template", "Rate how well this response answers the prompt, from 0 (useless) to 10 "
+                "(perfect). Reply with the number only.\n\nPrompt:\n{{prompt}}\n\nResponse:\n{{output}}", height=120)
+            scorer["judge_model"] = st.selectbox("Judge model", model_options)
+        experiment_confidence = st.slider("Elimination confidence", 0.80, 0.99, 0.95, 0.01,
+                                          help="A variant is dropped when its probability of being best falls "
+                                               "below 1 minus this value, split between the checks made as "
+                                               "the scores come in")
+        experiment_min_calls = st.number_input("Minimum calls per variant", 1, 1000, 5)
+        experiment_stop_early = st.checkbox("Stop when one variant remains", value=True)
+
     if st.button("Test Prompt"):
-        # Check for API key
-        if not api_key:
+        # Check for API key (not needed for the offline backends)
+        if not api_key and backend not in ("replay", "mock"):
             st.error("Please enter your API key in the sidebar.")
             return
         
-        with st.spinner("Processing..."):
-            # Parse variable definitions
-            variables = parse_variable_definitions(var_definitions)
-            
-            # Expand variables to all combinations
-            combinations = expand_variables(variables)
-            
-            if not combinations:
-                st.error("No valid combinations found. Please check your variable definitions.")
-                return
+        profiler = SessionProfiler() if profile_session else None
+        if profiler:
+            profiler.start()
+        try:
+            with st.spinner("Processing..."):
+                # Parse variable definitions
+                variables = parse_variable_definitions(var_definitions)
                 
-            # Limit the number of combinations to process
-            if len(combinations) > max_iterations:
-                st.warning(f"Found {len(combinations)} possible combinations. Limiting to {max_iterations} as configured.")
-                combinations = combinations[:max_iterations]
-            
-            # Prepare session data for logging
-            session_data = {
-                "llm_params": {
-                    "api_key": api_key,
-                    "model": model,
-                    "temperature": temperature,
-                    "max_tokens": max_tokens,
-                    "top_p": top_p,
-                    "system_prompt": system_prompt,
-                    "max_iterations": max_iterations
-                },
-                "inputs": []
-            }
-            
-            # Process each combination
-            for i, combo in enumerate(combinations):
-                # Display variable combination (for files, show path instead of content)
-                display_vars = {}
-                for var_name, var_value in combo.items():
-                    if var_name.endswith("_path"):
-                        display_vars[var_name] = var_value
-                    else:
-                        # For display purposes, truncate large content
-                        if isinstance(var_value, str) and len(var_value) > 100:
-                            display_vars[var_name] = var_value[:100] + "..."
-                        else:
-                            display_vars[var_name] = var_value
+                # Template variants share one expansion of the variables; a template experiment
+                # needs at least two of them
+                templates = None
+                experiment = None
+                sweep_templates = (sweep_templates or bool(TEMPLATE_DIRECTORY.match(prompt_template.strip()))) \
+                    and not run_experiment
+                if run_experiment or sweep_templates:
+                    try:
+                        templates = load_templates(prompt_template)
+                        if run_experiment and scorer_type == "regex":
+                            re.compile(scorer["pattern"])
+                    except (ValueError, OSError, re.error) as e:
+                        st.error(f"Invalid template variants: {e}")
+                        return
+                    if run_experiment and len(templates) < 2:
+                        st.error("A template experiment needs at least two variants separated by \"=== name ===\" lines.")
+                        return
+                
+                # Expand variables lazily; file-backed values are read as combinations are processed
+                # Problems reading the inputs are collected here, since most of them are
+                # found on the expansion thread, and shown as the run progresses
+                preprocess_stats = {}
+                input_notices = []
+                
+                def show_input_notices():
+                    while input_notices:
+                        level, message = input_notices.pop(0)
+                        getattr(st, level)(message)
+                
+                # Only the first combination is read here; the rest are expanded during
+                # the calls (see the expand_seconds metric)
+                with profile_stage(profiler, "first_combination"):
+                    combination_iter = iter_combinations(variables, preprocess_stats, input_notices)
+                    first_combo = next(combination_iter, None)
+                show_input_notices()
                 
-                st.subheader(f"Combination {i+1}")
-                st.write("Variables:")
-                st.json(display_vars)
+                if first_combo is None:
+                    st.error("No valid combinations found. Please check your variable definitions.")
+                    return
                 
-                # Render the template
-                rendered_prompt = render_template(prompt_template, combo)
+                # Limit the number of combinations to process
+                combinations = itertools.islice(itertools.chain([first_combo], combination_iter), max_iterations)
                 
-                # Display the rendered template
-                with st.expander("Rendered Prompt"):
-                    st.text_area("", rendered_prompt, height=150)
+                # Large outputs are spilled to a directory named after the session's log file
+                final_log_file = get_log_filename(log_file, append_datetime)
+                spill_dir = os.path.join(os.path.dirname(final_log_file), f"{Path(final_log_file).stem}_outputs")
+
+                # Prepare session data for logging
+                session_data = {
+                    "session_id": uuid.uuid4().hex[:12],
+                    "llm_params": {
+                        "api_key": api_key,
+                        "model": model,
+                        "temperature": temperature,
+                        "max_tokens": max_tokens,
+                        "top_p": top_p,
+                        "system_prompt": system_prompt,
+                        "max_iterations": max_iterations,
+                        "backend": backend,
+                        "connect_timeout": connect_timeout,
+                        "read_timeout": read_timeout,
+                        "fallback_models": ",".join(fallback_models)
+                    },
+                    "inputs": []
+                }
+                session_data["log_policy"] = {
+                    "max_mb": log_max_mb,
+                    "max_age_days": log_max_age_days,
+                    "compress": log_compress,
+                    "keep": log_keep,
+                    "retention_days": log_retention_days,
+                    "index_file": session_index_file
+                }
+                if sweep_templates:
+                    session_data["templates"] = [{"id": template_id, "template": template}
+                                                 for template_id, template in templates]
                 
-                # Call the LLM
                 llm_params = {
                     "api_key": api_key,
                     "model": model,
                     "temperature": temperature,
                     "max_tokens": max_tokens,
                     "top_p": top_p,
-                    "system_prompt": system_prompt
+                    "system_prompt": system_prompt,
+                    "backend": backend,
+                    "fixture_path": fixture_path,
+                    "replay_latency": replay_latency,
+                    "mock_latency": mock_latency,
+                    "mock_output_chars": mock_output_chars,
+                    "connect_timeout": connect_timeout,
+                    "read_timeout": read_timeout,
+                    "spill_dir": spill_dir,
+                    "spill_threshold": spill_threshold
                 }
                 
-                response = call_llm(rendered_prompt, llm_params)
+                # Each combination is displayed in its own slot, created as its result arrives
+                # (and updated by watch mode)
+                slots = {}
+                keys = {}
+                inputs = {}
+                widget_ids = itertools.count()
+
+                # Historical output lengths are only needed to order requests by cost and to size max_tokens
+                output_history = None
+                token_sizing = None
+                if auto_tokens:
+                    token_sizing = {"model": model, "percentile": auto_tokens_percentile,
+                                    "margin": auto_tokens_margin / 100.0, "min_samples": auto_tokens_min_samples,
+                                    "ceiling": max_tokens}
+                if scheduling_policy != "natural" or token_sizing is not None:
+                    output_history = load_output_history(
+                        os.path.dirname(os.path.expanduser(log_file)),
+                        index=get_session_index(session_index_file) if session_index_file else None)
                 
-                # Display the LLM's response
-                st.write("LLM Response:")
-                st.text_area("", response, height=200)
+                # Variables with chunk_tokens are processed by map-reduce when they are too large
+                map_reduce = None
+                chunk_limits = {var_name: var_def["chunk_tokens"] for var_name, var_def in variables.items()
+                                if isinstance(var_def, dict) and var_def.get("chunk_tokens")}
+                if chunk_limits and (run_experiment or sweep_templates):
+                    # The map and reduce templates do not depend on the variant, and request indexes
+                    # are per variant, so oversized values are not split when variants are compared
+                    st.warning("Map-reduce is not used with template variants; oversized values are sent as they are.")
+                elif chunk_limits:
+                    map_reduce = {"chunk_tokens": chunk_limits, "map_template": map_template,
+                                  "reduce_template": reduce_template}
                 
-                # Add to session data for logging
-                session_data["inputs"].append({
-                    "variables": combo,
-                    "prompt": rendered_prompt,
-                    "output": response
-                })
-            
-            # Log the session
-            try:
-                final_log_file = get_log_filename(log_file, append_datetime)
-                log_session(final_log_file, session_data)
-                st.success(f"Session logged to {final_log_file}")
-            except Exception as e:
-                st.error(f"Error logging session: {e}")
+                # Expand and render in background stages feeding the dispatcher through bounded
+                # queues, so only a window of combinations is held ahead of the calls
+                # (an experiment renders each combination itself, with the variant it picks)
+                if run_experiment:
+                    pipeline_templates = None
+                elif sweep_templates:
+                    pipeline_templates = templates
+                else:
+                    pipeline_templates = prompt_template
+                pipeline = PlanPipeline(combinations, pipeline_templates, map_reduce, output_history, max_tokens,
+                                        expand_depth, render_depth, token_sizing, profiler)
+                source = pipeline.requests()
+
+                # Dispatch the requests concurrently
+                dispatcher_args = {
+                    "concurrency": concurrency,
+                    "policy": scheduling_policy,
+                    "hedge_percentile": hedge_percentile,
+                    "hedge_budget": hedge_budget,
+                    "fallback_models": fallback_models,
+                    "breaker_threshold": breaker_threshold,
+                    "breaker_cooldown": breaker_cooldown,
+                    "adaptive": adaptive_concurrency,
+                    "governor": governor,
+                    "client_id": client_id,
+                    "lookahead": concurrency if run_experiment else lookahead,
+                    "monitor": monitor,
+                    "session_label": metrics_label
+                }
+                if governor is not None and (shared_concurrency or shared_tpm):
+                    governor.configure(shared_concurrency or governor.max_concurrency,
+                                       shared_tpm or governor.tokens_per_minute, client_label)
+                if run_experiment:
+                    # Templates are chosen as requests are dispatched, so each choice sees the latest scores
+                    bandit = TemplateBandit([template_id for template_id, _ in templates], experiment_confidence,
+                                            experiment_min_calls)
+                    judge = None
+                    if scorer["type"] == "llm_judge":
+                        judge = RequestDispatcher(
+                            dict(llm_params, model=scorer["judge_model"], temperature=0.0, max_tokens=16,
+                                 spill_threshold=0),
+                            **dict(dispatcher_args, fallback_models=[], hedge_percentile=None, adaptive=False))
+                    experiment = TemplateExperiment(templates, scorer, judge, bandit, output_history,
+                                                    max_tokens, concurrency, experiment_stop_early, token_sizing)
+                    source = experiment.requests(source)
+                dispatcher = RequestDispatcher(llm_params, **dispatcher_args)
+                progress = st.empty()
+                pipeline.start()
+                monitor.track(client_id, metrics_label, lambda: [
+                    ("pvt_queue_depth", {"queue": "expand"}, pipeline.expand_queue.qsize()),
+                    ("pvt_queue_depth", {"queue": "render"}, pipeline.render_queue.qsize()),
+                    ("pvt_queue_depth", {"queue": "pending"}, dispatcher.live["pending"]),
+                    ("pvt_queue_depth", {"queue": "in_flight"}, dispatcher.live["in_flight"]),
+                    ("pvt_concurrency_limit", {}, dispatcher.live["limit"])
+                ])
+                try:
+                    with profile_stage(profiler, "llm_calls"):
+                        if pack_inputs and not run_experiment:
+                            results = dispatch_packed(dispatcher, source, pack_token_budget, pack_max_items)
+                        else:
+                            results = dispatcher.run(source)
+                        for request, result in results:
+                            # Add to session data for logging
+                            slots[request["index"]] = st.empty()
+                            keys[request["index"]] = request["key"]
+                            inputs[request["index"]] = complete_request(
+                                request, result, slots[request["index"]], widget_ids)
+                            if experiment:
+                                experiment.score(request, result, inputs[request["index"]])
+                            show_input_notices()
+                            depths = pipeline.depths()
+                            progress.caption(f"{len(inputs)} completed · expansion queue {depths['expand_queue']} · "
+                                             f"render queue {depths['render_queue']} · "
+                                             f"{dispatcher.live['pending']} pending · "
+                                             f"{dispatcher.live['in_flight']} in flight")
+                finally:
+                    pipeline.stop()
+                    monitor.untrack(client_id)
+                progress.empty()
+                show_input_notices()
+                session_data["metrics"] = dict(dispatcher.metrics)
+                session_data["metrics"]["peak_expand_queue"] = pipeline.peaks["expand"]
+                session_data["metrics"]["peak_render_queue"] = pipeline.peaks["render"]
+                session_data["metrics"]["expand_seconds"] = round(pipeline.busy["expand"], 3)
+                session_data["metrics"]["render_seconds"] = round(pipeline.busy["render"], 3)
+                
+                # Oversized documents go through map-reduce after the regular requests
+                map_reduce_jobs = []
+                for index, combo, chunk_var in sorted(pipeline.map_reduce_combos, key=lambda item: item[0]):
+                    slots[index] = st.empty()
+                    keys[index] = combination_key(combo)
+                    map_reduce_jobs.append(plan_map_reduce(index, combo, chunk_var, map_reduce, slots[index], widget_ids))
+                if map_reduce_jobs:
+                    map_reduce_start = time.perf_counter()
+                    with profile_stage(profiler, "map_reduce"), st.spinner(
+                            f"Map-reduce over {sum(len(job['chunks']) for job in map_reduce_jobs)} chunks..."):
+                        for job, result in run_map_reduce(map_reduce_jobs, dispatcher, map_reduce):
+                            inputs[job["index"]] = complete_request(job, result, slots[job["index"]], widget_ids)
+                    session_data["metrics"]["map_reduce_inputs"] = len(map_reduce_jobs)
+                    # A failed job's calls are all in "intermediate"; a finished one also made its final reduce
+                    session_data["metrics"]["map_reduce_calls"] = sum(
+                        len(inputs[job["index"]]["intermediate"]) + (inputs[job["index"]]["status"] != "error")
+                        for job in map_reduce_jobs)
+                    session_data["metrics"]["map_reduce_seconds"] = round(time.perf_counter() - map_reduce_start, 3)
+
+                # Report how the template variants did and how the calls were split between them
+                if experiment:
+                    session_data["experiment"] = experiment.finish()
+                    st.subheader("Template Experiment")
+                    if session_data["experiment"]["winner"]:
+                        st.success(f"Best variant: {session_data['experiment']['winner']}")
+                    st.dataframe([{key: value for key, value in template.items() if key != "template"}
+                                  for template in session_data["experiment"]["templates"]])
+                    allocation = {template_id: [] for template_id, _ in templates}
+                    counts = Counter()
+                    for event in session_data["experiment"]["history"]:
+                        if event["type"] == "dispatch":
+                            counts[event["template"]] += 1
+                            for template_id in allocation:
+                                allocation[template_id].append(counts[template_id])
+                    st.line_chart(allocation)
+                
+                # Inputs are logged (and retried, and watched) in combination order
+                session_data["inputs"] = [inputs[index] for index in sorted(inputs)]
+                seen = Counter()
+                placeholders = {occurrence_key(keys[index], seen): slots[index] for index in sorted(inputs)}
+                
+                # Report how long the calls took overall, and how natural order would have done
+                metrics = session_data["metrics"]
+                st.subheader("Dispatch")
+                cols = st.columns(3)
+                cols[0].metric("Makespan", f"{metrics['makespan']:.1f}s")
+                cols[1].metric(f"Simulated ({scheduling_policy})", f"{metrics['simulated_makespan']:.1f}s")
+                cols[2].metric("Simulated (natural order)", f"{metrics['natural_order_makespan']:.1f}s",
+                               delta=f"{metrics['natural_order_makespan'] - metrics['simulated_makespan']:+.1f}s vs policy",
+                               delta_color="off")
+                if "hedges_issued" in metrics:
+                    st.caption(f"Hedged {metrics['hedges_issued']} slow call(s) after the p{metrics['hedge_percentile']} "
+                               f"latency; the duplicate finished first {metrics['hedges_won']} time(s).")
+                if metrics.get("packed_calls"):
+                    st.caption(f"Packed {metrics['packed_inputs']} combinations into {metrics['packed_calls']} request(s); "
+                               f"{metrics['pack_fallbacks']} had to be re-sent individually.")
+                if "concurrency_timeline" in metrics:
+                    st.caption(f"Adaptive concurrency ended at {metrics['final_concurrency']} calls in flight "
+                               f"(maximum {concurrency}).")
+                    st.line_chart({"seconds": [point["t"] for point in metrics["concurrency_timeline"]],
+                                   "in-flight limit": [point["limit"] for point in metrics["concurrency_timeline"]]},
+                                  x="seconds", y="in-flight limit")
+                if metrics.get("failovers") or metrics.get("breaker_trips"):
+                    st.warning(f"{metrics['failovers']} call(s) failed over to a fallback model; circuit breakers "
+                               f"opened {metrics['breaker_trips']} time(s), pausing dispatch for "
+                               f"{metrics['breaker_paused_seconds']:.1f}s.")
+
+                # Anything left in the generator was cut off by the iteration limit
+                if experiment and experiment.stopped_early:
+                    st.info("Stopped early: a single template variant remains.")
+                elif next(combination_iter, None) is not None:
+                    st.warning(f"Found more than {max_iterations} possible combinations. Limited to {max_iterations} as configured.")
+                
+                # Report how often outputs were cut off by max_tokens, to tune the sizing margin
+                limit_rows = summarize_token_limits(session_data["inputs"], max_tokens)
+                if limit_rows:
+                    hits = sum(row["hits"] for row in limit_rows)
+                    session_data["metrics"]["max_tokens_hits"] = hits
+                    session_data["metrics"]["max_tokens_hit_rate"] = round(
+                        hits / sum(row["calls"] for row in limit_rows), 4)
+                if limit_rows and (token_sizing is not None or hits):
+                    st.subheader("Output Limits")
+                    if token_sizing is not None:
+                        for row in limit_rows:
+                            variant = dict(templates or []).get(row["template"], prompt_template)
+                            row["earlier_outputs"] = auto_max_tokens(output_history, template_hash(variant),
+                                                                     token_sizing)[1]
+                    st.dataframe(limit_rows)
+                    if hits:
+                        st.warning(f"{hits} output(s) stopped at max_tokens "
+                                   f"({session_data['metrics']['max_tokens_hit_rate']:.1%}).")
+                
+                # Report the token savings of input preprocessing
+                if preprocess_stats:
+                    session_data["preprocessing"] = summarize_preprocessing(preprocess_stats)
+                    st.subheader("Input Preprocessing")
+                    st.dataframe([{"variable": var_name, **stats}
+                                  for var_name, stats in session_data["preprocessing"].items()])
+
+                # Log the session
+                try:
+                    with profile_stage(profiler, "log_session"):
+                        log_session(final_log_file, session_data)
+                    st.success(f"Session logged to {final_log_file}")
+                except Exception as e:
+                    st.error(f"Error logging session: {e}")
+                
+                # Remember failed combinations so they can be retried on their own
+                failed_count = queue_failed_inputs(session_data, llm_params, dispatcher_args, final_log_file)
+                if failed_count:
+                    st.warning(f"{failed_count} combination(s) failed. Use \"Retry failed combinations\" to re-run only those.")
+
+                # Save the profiling report next to the log
+                if profiler:
+                    profiler.stop()
+                    try:
+                        report_path = profiler.save_report(final_log_file)
+                        st.success(f"Profile report saved to {report_path}")
+                    except Exception as e:
+                        st.error(f"Error saving profile report: {e}")
+                    with st.expander("Profile Report"):
+                        st.text(profiler.format_report())
+                
+                st.balloons()
             
-            st.balloons()
+            # Keep the session open and re-run combinations as their input files change
+            if watch_mode and templates:
+                st.warning("Watch mode is not available with template variants.")
+            elif watch_mode:
+                watch_inputs(variables, prompt_template, dispatcher, max_iterations, session_data, map_reduce,
+                             placeholders, final_log_file, watch_interval, widget_ids, output_history, token_sizing)
+        finally:
+            # Make sure sampling stops even if the session ends early
+            if profiler:
+                profiler.stop()
+    
+    # Re-run the failed combinations of the last session
+    retry_queue = st.session_state.get("retry_queue")
+    if retry_queue and retry_queue["failed"]:
+        if st.button(f"Retry failed combinations ({len(retry_queue['failed'])})", key="retry_failed"):
+            retry_failed_inputs(retry_queue, itertools.count())
 
 if __name__ == "__main__":
     main()
\ No newline at end of file